@@ -1,12 +1,18 @@
-#ifndef LOGGER
+#ifndef LOGGER_H
+
+#define LOGGER_H
 
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  *
  * A lightweight logging module that is just simply a better printf!
  *
- * NO MULTI THREADS SAFETY IMPLEMENTED
+ * NOT THREAD SAFE BY DEFAULT, see logger_enable_threadsafe
  * YOU MUST USE logger_delete TO REMOVE A LOGGER
  * it used memory allocation and will lead to memory leak otherwise
  * It does not free the file pointers and references
@@ -32,11 +38,19 @@
  *
  * Format:
  * Use those keywords:
- * REF, LEVEL, FILENAME, LINE, DATE, TIME, MSG
+ * REF, LEVEL, FILENAME, LINE, DATE, TIME, MSG, FIELDS (key-value fields, see logger_kv)
+ * and for sub-second precision:
+ * MSEC (milliseconds, 000-999), USEC (microseconds, 000000-999999),
+ * ISO8601 (RFC3339, 2024-01-31T13:45:00.123456+01:00), EPOCHNS (nanoseconds since epoch)
+ * and for syslog: PRI (facility user * 8 + the level's severity),
+ * HOSTNAME and PID (see LOGGER_RFC5424_FORMAT)
  * enclosed in brackets to get dynamic values, use / for escaping brackets, such as
- * "[DATE] - [TIME] /[[REF]/] - [LEVEL] | ([FILENAME:LINE]) [MSG]"
+ * "[DATE] - [TIME] /[[REF]/] - [LEVEL] | ([FILENAME]:[LINE]) [MSG]"
  * Will give something like
  * 00/00/0000 - 00:00 [mylogger] - INFO | (main.c:69) x = 5
+ * The format is compiled once when it is set, an unknown label or a missing ]
+ * is reported on stderr and makes logger_create return NULL
+ * (logger_change_format keeps the old format instead)
  * You can use ANSI code for colors but must prefix every [ with / to escape
  * Such as: "\033/[1;34m/[[REF]/]\033/[0m \033/[1;32m/[[LEVEL]/]\033/[0m - \033/[1;37m/[[MSG]/]\033/[0m";
  * You can also use logger_level_color(int level, char *ansi_code);
@@ -57,6 +71,9 @@
  * Colors will overwrite code in format
  *
  * The colors are set globally to all loggers
+ * but only loggers writing to a terminal use them, others print the plain label
+ * The colored label is built once when the color is set (the color part
+ * is cut if the whole label doesn't fit in 64 bytes)
  *
  * v2.1.0
  * Array logging
@@ -73,9 +90,10 @@
  * logger_arrayf(logger, level, array, element_size, len, func, msg, ...) \
  * __logger_log_array__(__FILE__, __LINE__, logger, level, array, element_size, len, \
  * (void (*)(FILE *, void *))func, msg, __VA_ARGS__)
- * All it does is print the message, then call print_element
- * for each of the member of the array
+ * It prints the message followed by each member of the array in one record
  * The function pass in should expect a FILE *fp and a pointer to the type being print out
+ * The built-in printers (PRINT_*) are recognized and don't go through stdio
+ * See logger_change_array_style for compact output, truncation and statistics
  *
  *
  * Look below for parameters
@@ -83,53 +101,161 @@
 
 #define DEFAULT_LOG_FORMAT "/[[REF]/]/[[LEVEL]/] - ([FILENAME]:[LINE])\n- [MSG]\n"
 
+/* A syslog line (RFC 5424) with the logger's reference as APP-NAME,
+ * for logger_sink_socket with rfc5424 */
+#define LOGGER_RFC5424_FORMAT "<[PRI]>1 [ISO8601] [HOSTNAME] [REF] [PID] - - [MSG]\n"
+
+/* LEVEL FILTERING
+ * Compile with -DLOGGER_MIN_LEVEL=INFO (or a number, TRACE is 0) to remove
+ * every macro call of a lower level from the program, arguments are not evaluated
+ * The other calls check the logger's level inline before calling in,
+ * a filtered call only costs a load and a compare (and its arguments are not evaluated)
+ * logger and level may be evaluated more than once, don't give them side effects */
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOGGER_LIKELY(x)   __builtin_expect(!!(x), 1)
+#define LOGGER_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define LOGGER_LIKELY(x)   (x)
+#define LOGGER_UNLIKELY(x) (x)
+#endif
+
+/* True if a record of level would be printed by logger */
+#define logger_enabled(logger, lvl) \
+((int)(lvl) >= (int)(LOGGER_MIN_LEVEL) && (int)(lvl) < (int)OFF && \
+ (int)(lvl) >= (int)((const volatile struct LOGGER_HEAD *)(logger)) -> level)
+
+/* Call call only when level passes, hint is LOGGER_LIKELY or LOGGER_UNLIKELY */
+#define __logger_gate__(hint, logger, level, call) \
+(hint(logger_enabled(logger, level)) ? (call) : (void)0)
+
+/* CALL SITES
+ * With GCC or clang on ELF targets, each fixed level message macro (logger_info,
+ * logger_debugf...) keeps a LOGGER_SITE in the logger_sites section, so calls
+ * can be switched on or off while running, see logger_sites_set
+ * A site switched off costs a load and a branch, one left to the default
+ * adds the level check, one switched on is logged whatever the levels
+ * Those macros are statements then, not expressions
+ * Define LOGGER_NO_SITES to go back to the plain level check */
+#if !defined(LOGGER_NO_SITES) && (defined(__GNUC__) || defined(__clang__)) && defined(__ELF__)
+#define LOGGER_SITES 1
+#define __logger_site_gate__(hint, logger, lvl, ...) do { \
+    static LOGGER_SITE __logger_site__ \
+        __attribute__((section("logger_sites"), aligned(sizeof(void *)))) = { __FILE__, __LINE__, lvl, 0 }; \
+    unsigned char __logger_state__ = ((const volatile LOGGER_SITE *)&__logger_site__) -> state; \
+    if ((int)(lvl) >= (int)(LOGGER_MIN_LEVEL) && \
+        hint(__logger_state__ ? __logger_state__ == LOGGER_SITE_ON : logger_enabled(logger, lvl))) { \
+        __logger_site_msg__(&__logger_site__, logger, __VA_ARGS__); \
+    } \
+} while (0)
+#else
+#define LOGGER_SITES 0
+#define __logger_site_gate__(hint, logger, lvl, ...) \
+__logger_gate__(hint, logger, lvl, __logger_msg__(__FILE__, __LINE__, logger, lvl, __VA_ARGS__))
+#endif
+
 /* FORMATTED LOG MESSAGES 
  * You must provide at least 1 variadic arguement
  * If you don't, use the unformatted one
  * Just the way macros work in standard C 
- * (I trying to remove all extensions usage) */
+ * (I trying to remove all extensions usage)
+ * TRACE and DEBUG are expected to be filtered, the others to be printed */
 #define logger_logf(logger, level, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, level, msg, __VA_ARGS__)
+__logger_gate__(, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg, __VA_ARGS__))
 // Use this instead of __logger_msg__
 
 #define logger_tracef(logger, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, TRACE, msg, __VA_ARGS__)
+__logger_site_gate__(LOGGER_UNLIKELY, logger, TRACE, msg, __VA_ARGS__)
 #define logger_debugf(logger, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, DEBUG, msg, __VA_ARGS__)
+__logger_site_gate__(LOGGER_UNLIKELY, logger, DEBUG, msg, __VA_ARGS__)
 #define logger_infof(logger, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, INFO, msg, __VA_ARGS__)
+__logger_site_gate__(LOGGER_LIKELY, logger, INFO, msg, __VA_ARGS__)
 #define logger_warningf(logger, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, WARNING, msg, __VA_ARGS__)
+__logger_site_gate__(LOGGER_LIKELY, logger, WARNING, msg, __VA_ARGS__)
 #define logger_errorf(logger, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, ERROR, msg, __VA_ARGS__)
+__logger_site_gate__(LOGGER_LIKELY, logger, ERROR, msg, __VA_ARGS__)
 #define logger_fatalf(logger, msg, ...) \
-__logger_msg__(__FILE__, __LINE__, logger, FATAL, msg, __VA_ARGS__)
+__logger_site_gate__(LOGGER_LIKELY, logger, FATAL, msg, __VA_ARGS__)
 
 #define logger_log(logger, level, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, level, msg)
+__logger_gate__(, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg))
 // Use this instead of __logger_msg__
 
 #define logger_trace(logger, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, TRACE, msg)
+__logger_site_gate__(LOGGER_UNLIKELY, logger, TRACE, msg)
 #define logger_debug(logger, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, DEBUG, msg)
+__logger_site_gate__(LOGGER_UNLIKELY, logger, DEBUG, msg)
 #define logger_info(logger, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, INFO, msg)
+__logger_site_gate__(LOGGER_LIKELY, logger, INFO, msg)
 #define logger_warning(logger, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, WARNING, msg)
+__logger_site_gate__(LOGGER_LIKELY, logger, WARNING, msg)
 #define logger_error(logger, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, ERROR, msg)
+__logger_site_gate__(LOGGER_LIKELY, logger, ERROR, msg)
 #define logger_fatal(logger, msg) \
-__logger_msg__(__FILE__, __LINE__, logger, FATAL, msg)
+__logger_site_gate__(LOGGER_LIKELY, logger, FATAL, msg)
+
+/* RATE LIMITED LOG MESSAGES
+ * Each call site keeps its own state, n must be a constant
+ * _every logs one call out of n, _first the first n calls only,
+ * _rate at most n calls per second and says how many it dropped
+ * once a call passes again
+ * A dropped call costs the level check, one atomic operation
+ * and for _rate a clock read */
+#define __logger_limited__(kind, n, logger, level, call) do { \
+    static LOGGER_LIMIT __logger_site__ = { kind, n, 0, 0 }; \
+    unsigned long long __logger_skipped__ = 0; \
+    if (logger_enabled(logger, level) && __logger_limit__(&__logger_site__, &__logger_skipped__)) { \
+        if (__logger_skipped__) { \
+            __logger_suppressed__(__FILE__, __LINE__, logger, level, __logger_skipped__); \
+        } \
+        call; \
+    } \
+} while (0)
+
+#define logger_logf_every(logger, level, n, msg, ...) \
+__logger_limited__(LOGGER_LIMIT_EVERY, n, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg, __VA_ARGS__))
+#define logger_logf_first(logger, level, n, msg, ...) \
+__logger_limited__(LOGGER_LIMIT_FIRST, n, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg, __VA_ARGS__))
+#define logger_logf_rate(logger, level, n, msg, ...) \
+__logger_limited__(LOGGER_LIMIT_RATE, n, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg, __VA_ARGS__))
+
+#define logger_log_every(logger, level, n, msg) \
+__logger_limited__(LOGGER_LIMIT_EVERY, n, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg))
+#define logger_log_first(logger, level, n, msg) \
+__logger_limited__(LOGGER_LIMIT_FIRST, n, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg))
+#define logger_log_rate(logger, level, n, msg) \
+__logger_limited__(LOGGER_LIMIT_RATE, n, logger, level, __logger_msg__(__FILE__, __LINE__, logger, level, msg))
+
+/* key-value logging
+ * logger_kv(logger, INFO, "login", LOGGER_STR("user", name), LOGGER_INT("id", id))
+ * At least one field must be given */
+#define LOGGER_INT(key, v)    ((LOGGER_FIELD){ (key), LOGGER_FIELD_INT, { .i = (v) } })
+#define LOGGER_DOUBLE(key, v) ((LOGGER_FIELD){ (key), LOGGER_FIELD_DOUBLE, { .d = (v) } })
+#define LOGGER_STR(key, v)    ((LOGGER_FIELD){ (key), LOGGER_FIELD_STRING, { .s = (v) } })
+#define LOGGER_BOOL(key, v)   ((LOGGER_FIELD){ (key), LOGGER_FIELD_BOOL, { .b = (v) != 0 } })
+
+#define logger_kv(logger, level, msg, ...) \
+__logger_gate__(, logger, level, __logger_kv__(__FILE__, __LINE__, logger, level, msg, \
+(const LOGGER_FIELD[]){ __VA_ARGS__ }, sizeof((const LOGGER_FIELD[]){ __VA_ARGS__ }) / sizeof(LOGGER_FIELD)))
+
+#define logger_trace_kv(logger, msg, ...) logger_kv(logger, TRACE, msg, __VA_ARGS__)
+#define logger_debug_kv(logger, msg, ...) logger_kv(logger, DEBUG, msg, __VA_ARGS__)
+#define logger_info_kv(logger, msg, ...) logger_kv(logger, INFO, msg, __VA_ARGS__)
+#define logger_warning_kv(logger, msg, ...) logger_kv(logger, WARNING, msg, __VA_ARGS__)
+#define logger_error_kv(logger, msg, ...) logger_kv(logger, ERROR, msg, __VA_ARGS__)
+#define logger_fatal_kv(logger, msg, ...) logger_kv(logger, FATAL, msg, __VA_ARGS__)
 
 /* array logging */
 
 #define logger_array(logger, level, array, element_size, len, func, msg) \
-__logger_log_array__(__FILE__, __LINE__, logger, level, array, element_size, len, \
-(void (*)(FILE *, void *))func, msg)
+__logger_gate__(, logger, level, __logger_log_array__(__FILE__, __LINE__, logger, level, array, element_size, len, \
+(void (*)(FILE *, void *))func, msg))
 #define logger_arrayf(logger, level, array, element_size, len, func, msg, ...) \
-__logger_log_array__(__FILE__, __LINE__, logger, level, array, element_size, len, \
-(void (*)(FILE *, void *))func, msg, __VA_ARGS__)
+__logger_gate__(, logger, level, __logger_log_array__(__FILE__, __LINE__, logger, level, array, element_size, len, \
+(void (*)(FILE *, void *))func, msg, __VA_ARGS__))
 
 /* Default printers for array logging */
 #define PRINT_C __logger_print_c__
@@ -146,6 +272,12 @@ typedef enum LOGLEVEL log_level_t;
 
 typedef struct LOGGER LOGGER;
 
+/* What the macros can see of a logger, it is the start of every LOGGER
+ * Don't write to it, use logger_change_level */
+struct LOGGER_HEAD {
+    unsigned char level;
+};
+
 /* LOGGERS */
 
 /* Logger creation and initiallization 
@@ -154,7 +286,7 @@ typedef struct LOGGER LOGGER;
 LOGGER *logger_create(const char *ref, const FILE *file, const char *format, const log_level_t level);
 
 /* Logger removal
- * free the format(as it is linked list) and the logger */
+ * free the format(as it is a compiled program) and the logger */
 void logger_remove(LOGGER *logger);
 
 
@@ -170,6 +302,12 @@ void __logger_log_array__(const char *fname, const int line,
                           void *array, size_t element_size, size_t len,
                           void (*print_element)(FILE *, void *), const char *msg, ...);
 
+/* print text that is already rendered (len bytes) as the record's message
+ * For front-ends formatting on their own, such as logger.hpp */
+void __logger_text__(const char *fname, int line,
+                     const LOGGER *logger, const log_level_t level,
+                     const char *text, size_t len);
+
 /* Change logger param */
 void logger_change_file(LOGGER *logger, const FILE *file);
 void logger_change_format(LOGGER *logger, const char *format);
@@ -178,6 +316,427 @@ void logger_change_ref(LOGGER *logger, const char *ref);
 void logger_change_rffl(LOGGER *logger, const char *ref, const FILE *file, const char *format, const int level);
 /* Those are self-explanatory, paste NULL or -1 to keep it unchanged */
 
+/* Rate limited logging */
+
+enum LOGGER_LIMIT_KIND {
+    LOGGER_LIMIT_EVERY, /* one call out of every N */
+    LOGGER_LIMIT_FIRST, /* the first N calls, then nothing */
+    LOGGER_LIMIT_RATE   /* at most N calls per second, in bursts of up to N */
+};
+
+/* One call site's state, the limited macros keep a static one per site */
+typedef struct LOGGER_LIMIT {
+    int kind;                      /* LOGGER_LIMIT_* */
+    unsigned long long n;
+    unsigned long long state;      /* calls seen, or when the next call may pass (ns) */
+    unsigned long long suppressed; /* calls dropped since one passed */
+} LOGGER_LIMIT;
+
+/* Decide if a call passes, without locks or formatting
+ * On a pass, *suppressed is how many the rate limit dropped before it
+ * This is not suppose to be call, use the limited macros instead */
+int __logger_limit__(LOGGER_LIMIT *limit, unsigned long long *suppressed);
+
+/* Log "suppressed K messages" for a call site */
+void __logger_suppressed__(const char *fname, int line,
+                           const LOGGER *logger, const log_level_t level,
+                           unsigned long long count);
+
+/* Dynamic call sites */
+
+enum LOGGER_SITE_STATE {
+    LOGGER_SITE_DEFAULT, /* logged if the logger's level lets it through */
+    LOGGER_SITE_ON,      /* always logged, whatever the logger's and sinks' levels */
+    LOGGER_SITE_OFF      /* never logged */
+};
+
+/* One call of a fixed level macro (logger_info, logger_debugf...),
+ * the macros keep a static one per call in the logger_sites section */
+typedef struct LOGGER_SITE {
+    const char *file;
+    int line;
+    int level;
+    unsigned char state; /* LOGGER_SITE_*, changed with logger_sites_set */
+} LOGGER_SITE;
+
+/* print the log message of a call site, use macros instead */
+void __logger_site_msg__(const LOGGER_SITE *site, const LOGGER *logger, const char *msg, ...);
+
+/* Make the sites of a program or library known, the header does it at startup */
+void __logger_sites_register__(LOGGER_SITE *start, LOGGER_SITE *stop);
+
+/* Set the state of the sites whose file matches the glob file (the whole
+ * path or its last part, NULL for all), with a line in [first_line, last_line]
+ * (0 for no bound) and of level (-1 for all)
+ * Sites registered later get it too, the last matching setting wins
+ * Return the number of sites changed or -1 if an argument is invalid */
+int logger_sites_set(const char *file, int first_line, int last_line,
+                     const int level, const int state);
+
+/* Apply settings written as "glob[:first[-last]][@LEVEL]=on|off|default",
+ * separated by ; or new lines, empty or # lines are skipped
+ * "http_*.c=on;main.c:40-60=off;*@TRACE=off"
+ * At startup the LOGGER_SITES environment variable is applied this way,
+ * then the file named by LOGGER_SITES_FILE
+ * Return the number of sites changed or -1 on the first invalid setting
+ * (those before it are applied) */
+int logger_sites_control(const char *settings);
+
+/* logger_sites_control with the content of the file at path
+ * Return the number of sites changed or -1 if it can't be read or is invalid */
+int logger_sites_load(const char *path);
+
+/* Write "file:line LEVEL state" for every known site */
+void logger_sites_list(FILE *file);
+
+#if LOGGER_SITES
+/* The linker gives the bounds of the section in each program or library */
+extern LOGGER_SITE __start_logger_sites[] __attribute__((weak, visibility("hidden")));
+extern LOGGER_SITE __stop_logger_sites[] __attribute__((weak, visibility("hidden")));
+
+__attribute__((constructor)) static void __logger_sites_init__(void) {
+    __logger_sites_register__(__start_logger_sites, __stop_logger_sites);
+}
+#endif
+
+/* Array logging */
+
+enum LOGGER_ARRAY_STYLE {
+    LOGGER_ARRAY_LINES   = 0, /* one "iN: value" line per element (default) */
+    LOGGER_ARRAY_COMPACT = 1, /* [v0, v1, ...] after the message on its line */
+    LOGGER_ARRAY_STATS   = 2  /* add the min, max and mean of PRINT_D and PRINT_F arrays */
+};
+
+/* style is LOGGER_ARRAY_LINES or LOGGER_ARRAY_COMPACT, optionally | LOGGER_ARRAY_STATS
+ * Arrays longer than head + tail only show their first head and last tail
+ * elements and how many were skipped (0 and 0 to show them all)
+ * The built-in printers are formatted without stdio, PRINT_F in the
+ * shortest form that reads back as the same double */
+void logger_change_array_style(LOGGER *logger, const int style, size_t head, size_t tail);
+
+/* Structured logging */
+
+enum LOGGER_FIELD_TYPE {
+    LOGGER_FIELD_INT, LOGGER_FIELD_DOUBLE, LOGGER_FIELD_STRING, LOGGER_FIELD_BOOL
+};
+
+/* A typed key-value pair attached to a record, build them with the macros */
+typedef struct LOGGER_FIELD {
+    const char *key;
+    int type;
+    union {
+        long long i;
+        double d;
+        const char *s;
+        int b;
+    } value;
+} LOGGER_FIELD;
+
+/* Log msg (plain text, not a format) with count fields
+ * In text mode the fields go where the format has [FIELDS],
+ * or right after the message, as key=value pairs
+ * Strings are escaped for the mode, nothing is allocated for it
+ * This is not suppose to be call, use logger_kv instead */
+void __logger_kv__(const char *fname, int line,
+                   const LOGGER *logger, const log_level_t level, const char *msg,
+                   const LOGGER_FIELD *fields, size_t count);
+
+/* Output modes */
+
+enum LOGGER_MODE {
+    LOGGER_TEXT,   /* format every record (default) */
+    LOGGER_BINARY, /* write the raw arguments, format later with logger_decode */
+    LOGGER_JSON,   /* one JSON object per line */
+    LOGGER_LOGFMT  /* one line of key=value pairs */
+};
+
+/* In JSON and logfmt mode the labels of the format become keys named after
+ * them in lowercase (ref, level, date, time, filename, line, msg, msec, usec,
+ * iso8601, epochns) in the format's order, the text between them is left out,
+ * then come the record's fields (see logger_kv)
+ * Such as "[ISO8601] [LEVEL] [MSG]" giving
+ * {"iso8601":"2024-01-31T13:45:00.123456+01:00","level":"INFO","msg":"hi","user":"bob"} */
+
+/* In binary mode a record is only the call site id, the time, the level
+ * and a copy of the arguments (strings included), the call site itself
+ * (msg, file, line) is written once the first time it logs
+ * The format and ref are written to the file when they change
+ * Return 0 or -1 for an unknown mode or if memory ran out */
+int logger_change_mode(LOGGER *logger, const int mode);
+
+/* Turn a binary log back into text with the format it was written with
+ * A piece cut out of a longer log (rotated files are whole logs) may lack
+ * the format and call sites written before it: records keep their message
+ * only, or a placeholder naming the call site when its message is not in it
+ * Return the number of records or -1 if in is not a valid binary log
+ * (the bin/logger_decode tool does the same from the command line) */
+long logger_decode(FILE *in, FILE *out);
+
+/* Multi-threading */
+
+/* Let several threads log and change the logger at the same time
+ * Call it before the logger is shared, it can't be turned off
+ * The level is read atomically, format/file/ref changes publish a new copy
+ * of the config and free the old one once no thread is rendering with it,
+ * so logging threads never wait on a lock (except the FILE's own one)
+ * logger_enable_async turns it on by itself */
+void logger_enable_threadsafe(LOGGER *logger);
+
+/* Asynchronous logging */
+
+enum LOGGER_OVERFLOW {
+    LOGGER_BLOCK,       /* wait for the writer to make room */
+    LOGGER_DROP_NEWEST, /* drop the record that doesn't fit */
+    LOGGER_DROP_BELOW   /* drop records below keep_level, wait for the others */
+};
+
+/* Hand records to a writer thread through a lock-free queue of capacity records
+ * (rounded up to a power of 2, 0 for the default of 4096)
+ * The message is still formatted by the caller, the rest is done by the writer
+ * overflow is what to do when the queue is full (see above)
+ * Return 0 or -1 if the queue or the thread could not be created */
+int logger_enable_async(LOGGER *logger, size_t capacity, int overflow, log_level_t keep_level);
+
+/* Write what is still queued and go back to logging on the caller's thread
+ * Other threads may keep logging meanwhile, the queue is freed once none of
+ * them can still reach it, logger_remove does it too */
+void logger_disable_async(LOGGER *logger);
+
+/* Wait until every record logged so far is written and flush the file */
+void logger_flush(LOGGER *logger);
+
+/* Coalescing */
+
+/* Hold back records repeating the last one (same call site, level,
+ * message and fields) and write "last message repeated N times" once
+ * a different record comes, on logger_flush, or when the first held back
+ * one is timeout_ms old (0 for no timeout), even if nothing is logged after
+ * it: a timer thread writes the note then, which makes the logger thread safe
+ * Messages are formatted before they are compared, binary mode doesn't coalesce
+ * Return 0 or -1 if memory ran out */
+int logger_enable_coalescing(LOGGER *logger, long timeout_ms);
+
+/* Write the note of the repeats held back and stop coalescing */
+void logger_disable_coalescing(LOGGER *logger);
+
+/* Statistics */
+
+#define LOGGER_STATS_BUCKETS 128
+
+/* Counters since logger_enable_stats or the last reset
+ * The histograms count durations in log-linear buckets:
+ * bucket i holds durations from logger_stats_bucket(i) ns up to the next one's */
+typedef struct LOGGER_STATS {
+    unsigned long long accepted;     /* records that passed the level check */
+    unsigned long long filtered;     /* calls below every sink's level that reached the library */
+    unsigned long long bytes;        /* written to the sinks */
+    unsigned long long write_errors; /* sink writes that failed */
+    unsigned long long dropped;      /* records the async queue had no room for */
+    unsigned long long render_ns[LOGGER_STATS_BUCKETS]; /* rendering time, per record and format */
+    unsigned long long write_ns[LOGGER_STATS_BUCKETS];  /* time in sink writes */
+} LOGGER_STATS;
+
+/* Start counting, per thread so threads don't contend on the counters
+ * The macros skip filtered calls without calling the library, count_filtered
+ * makes them call it for every level so those are counted too, at the cost
+ * of a call and the arguments for each
+ * Return 0 or -1 if memory ran out */
+int logger_enable_stats(LOGGER *logger, const int count_filtered);
+
+/* Stop counting, what was counted can still be read */
+void logger_disable_stats(LOGGER *logger);
+
+/* Fill stats, and start again from zero if reset
+ * Return 0 or -1 if stats were never enabled */
+int logger_stats(LOGGER *logger, LOGGER_STATS *stats, const int reset);
+
+/* Lowest duration of a histogram bucket in ns */
+unsigned long long logger_stats_bucket(size_t bucket);
+
+/* Flight recorder */
+
+/* Keep the last records (count of them) of level and above in memory,
+ * whatever level the sinks take, so TRACE can stay on at little cost:
+ * the message is formatted into a ring slot, nothing else is done
+ * Messages longer than 200 bytes are cut
+ * The ring is dumped, rendered with the logger's format, after a FATAL
+ * record (which is written once, before the dump) or on logger_dump_recorder
+ * Return 0 or -1 if level is invalid or memory ran out */
+int logger_enable_recorder(LOGGER *logger, size_t records, const log_level_t level);
+
+void logger_disable_recorder(LOGGER *logger);
+
+/* Write what the recorder kept since the last dump to the logger's sink */
+void logger_dump_recorder(LOGGER *logger);
+
+/* Dump the recorder to fd on SIGSEGV, SIGABRT, SIGBUS, SIGFPE and SIGILL,
+ * then hand the signal to the previous handler
+ * The handler is async-signal-safe: it writes "LEVEL sec.nsec file:line msg"
+ * lines with write(2), whatever the format
+ * fd -1 is the file behind the sink if it has one (not in binary mode), else stderr
+ * Records still queued in async mode or held in a sink's buffer are lost
+ * Return 0 or -1 if too many loggers are registered (16) */
+int logger_recorder_crash_handler(LOGGER *logger, int fd);
+
+/* Registry */
+
+/* The logger called name, created on first use along with the ancestors it lacks
+ * Names are dot separated ("net.http.client"), "" is the root, writing to stdout
+ * A new logger logs through its parent as it is at the time (sinks, format,
+ * mode, async queue) with its own name as REF (the parent's in binary mode):
+ * its level decides what the parent's own sink gets, sinks added to the parent
+ * keep their levels, it starts with its parent's level
+ * logger_change_file or logger_change_sink gives it a sink of its own
+ * Registry loggers are thread-safe and live until logger_registry_clear,
+ * logger_remove refuses them
+ * Return NULL if name is invalid (empty part) or memory ran out */
+LOGGER *logger_get(const char *name);
+
+/* Change the level of name and of every logger under it
+ * Return 0 or -1 if name or level is invalid */
+int logger_registry_level(const char *name, const log_level_t level);
+
+/* Remove every registry logger, none can be used afterwards */
+void logger_registry_clear(void);
+
+/* Sinks */
+
+/* A destination for the rendered records, used instead of a FILE */
+typedef struct LOGGER_SINK LOGGER_SINK;
+
+enum LOGGER_MSYNC {
+    LOGGER_MSYNC_NONE,  /* leave it to the kernel, records survive a crash but not a power loss */
+    LOGGER_MSYNC_ASYNC, /* start writing back on every flush */
+    LOGGER_MSYNC_SYNC   /* wait for the disk on every flush */
+};
+
+/* Append to path through a shared memory mapping: logging is a memcpy,
+ * the file is allocated and mapped window bytes at a time
+ * (rounded up to pages, 0 for the default of 16MiB)
+ * sync is when the mapping is written back: on flush and when moving
+ * to the next window (logger_flush, and after every batch in async mode)
+ * The file ends with up to a window of zeros until the sink is closed
+ * Return the sink or NULL if the file can't be opened or mapped */
+LOGGER_SINK *logger_sink_mmap(const char *path, size_t window, int sync);
+
+/* Write to path and rotate it once it would grow past max_size bytes
+ * and/or every interval seconds (on multiples of interval, 0 to disable either)
+ * The full file is renamed to path.suffix, suffix being a strftime format
+ * (NULL for "%Y%m%d-%H%M%S", -1, -2... is added to names already taken)
+ * and a new file is opened under path, records keep flowing meanwhile
+ * A helper thread then closes the old file, gzips it if compress is set
+ * and deletes the oldest archives so only keep are left (0 keeps all), files
+ * named otherwise, even path.something, are never touched
+ * A binary logger starts every new file with its format and the call sites
+ * it knows, so each file decodes on its own
+ * Return the sink or NULL if path can't be opened */
+LOGGER_SINK *logger_sink_rotating(const char *path, const char *suffix,
+                                  size_t max_size, long interval,
+                                  int keep, int compress);
+
+/* Make the logger write to sink instead of its file
+ * The sink stays yours, close it once no logger uses it
+ * logger_change_file goes back to a FILE
+ * Return 0 or -1 if memory ran out */
+int logger_change_sink(LOGGER *logger, LOGGER_SINK *sink);
+
+/* A sink writing to a FILE, closing it leaves the FILE open
+ * Each write flushes the FILE and is one write(2) on its descriptor, so
+ * records appended by several processes (O_APPEND) never cut each other
+ * A FILE without a descriptor (fmemopen, fopencookie) gets an fwrite */
+LOGGER_SINK *logger_sink_file(FILE *file);
+
+/* A sink writing to the file descriptor fd with write and writev, no stdio:
+ * in text mode each record is one writev pointing at the format's literals,
+ * the ref, the file name and the message where they are (text under 64 bytes
+ * is copied), in async mode a whole batch is one writev of up to IOV_MAX pieces
+ * close_fd: close fd with the sink
+ * Return the sink or NULL if fd is negative or memory ran out */
+LOGGER_SINK *logger_sink_fd(int fd, int close_fd);
+
+/* Append to path with io_uring: records are copied into depth buffers of
+ * buffer_size bytes (0 for the defaults of 8 and 64KiB), registered with the
+ * ring as the file is, and a full buffer becomes a write submitted with the
+ * others queued by a single system call; completions are read from memory
+ * Records logged on their own share the current buffer, submitted once full,
+ * on flush, or by a timer thread 1ms after it got its first record (what a
+ * crash may lose), in async mode a batch is submitted when it ends
+ * A write only waits when every buffer is in flight, flush submits what is
+ * buffered without waiting for the disk, close waits for every write
+ * Writes go at explicit offsets, the file must have no other writer
+ * Kernels without io_uring (or where it is disabled) get pwrite instead
+ * Return the sink or NULL if the file can't be opened */
+LOGGER_SINK *logger_sink_uring(const char *path, unsigned depth, size_t buffer_size);
+
+typedef struct LOGGER_URING_STATS {
+    int uring;                     /* 0 if the sink fell back to pwrite */
+    int fixed_buffers;             /* the buffers are registered with the ring */
+    int fixed_file;                /* the file is too */
+    unsigned depth;                /* buffers, the most writes in flight */
+    size_t buffer_size;
+    unsigned in_flight;            /* writes submitted and not completed */
+    size_t in_flight_bytes;
+    size_t buffered_bytes;         /* copied and not submitted yet */
+    unsigned long long writes;     /* buffers written */
+    unsigned long long enters;     /* io_uring_enter calls, submitting or waiting */
+    unsigned long long waits;      /* times a record waited for a buffer */
+    unsigned long long errors;     /* failed writes, finished with pwrite */
+} LOGGER_URING_STATS;
+
+/* Fill stats for a sink from logger_sink_uring
+ * Return 0 or -1 if it is another kind of sink */
+int logger_sink_uring_stats(LOGGER_SINK *sink, LOGGER_URING_STATS *stats);
+
+enum LOGGER_SOCKET {
+    LOGGER_SOCKET_UNIX_DGRAM,      /* one record per datagram, e.g. /dev/log */
+    LOGGER_SOCKET_UNIX_STREAM,     /* records back to back on a connection */
+    LOGGER_SOCKET_UDP              /* one record per datagram, "host:port" */
+};
+
+/* Send records to a local collector over a socket that never blocks:
+ * address is a path for unix sockets, "host:port" or "[host]:port" for UDP
+ * Records wait in a queue of at most queue records (0 for 1024) until the
+ * socket takes them, async loggers send a whole batch with one sendmmsg
+ * When the queue is full new records are dropped and counted, while the
+ * collector is away the connection is retried every half a second
+ * rfc5424 frames records for syslog: the trailing newline is left out and
+ * stream records get their length in front (octet counting, RFC 6587),
+ * pair it with LOGGER_RFC5424_FORMAT
+ * Return the sink or NULL if the address is invalid */
+LOGGER_SINK *logger_sink_socket(int type, const char *address, size_t queue, int rfc5424);
+
+typedef struct LOGGER_SOCKET_STATS {
+    int connected;
+    size_t queued;                 /* records waiting for the socket */
+    size_t queued_bytes;
+    unsigned long long sent;       /* records the socket took */
+    unsigned long long dropped;    /* records lost to a full queue or too large */
+    unsigned long long reconnects;
+    unsigned long long errors;     /* failed sends other than a lost collector */
+} LOGGER_SOCKET_STATS;
+
+/* Fill stats for a sink from logger_sink_socket
+ * Return 0 or -1 if it is another kind of sink */
+int logger_sink_socket_stats(LOGGER_SINK *sink, LOGGER_SOCKET_STATS *stats);
+
+/* Also write the records of level and above to sink (fan-out)
+ * format is the sink's own (NULL to follow the logger's),
+ * colored 1 or 0 to force the colored or plain labels, -1 if it is a terminal
+ * A record is rendered once per distinct format and coloring, and the macros
+ * skip it if no sink takes its level (logger_change_level is the logger's own sink)
+ * Array elements are part of the message, every sink gets them
+ * In binary mode only the logger's own sink is binary, the others get text
+ * Up to 31 sinks can be added, they stay yours
+ * Return 0 or -1 on a bad format, too many sinks or no memory */
+int logger_add_sink(LOGGER *logger, LOGGER_SINK *sink, const log_level_t level,
+                    const char *format, const int colored);
+
+/* Stop writing to a sink added with logger_add_sink, return -1 if it wasn't */
+int logger_remove_sink(LOGGER *logger, LOGGER_SINK *sink);
+
+/* Flush and free the sink, closing what it writes to */
+void logger_sink_close(LOGGER_SINK *sink);
+
 /* Coloring levels label */
 
 /* change color of a level */
@@ -198,5 +757,8 @@ void __logger_print_f__(FILE *f, double *pF); /* print using %f specifier (same
 void __logger_print_s__(FILE *f, char **pS); /* print using %s specifier */
 void __logger_print_p__(FILE *f, void **pPtr); /* print using %p specifiers */
 
+#ifdef __cplusplus
+}
 #endif
 
+#endif
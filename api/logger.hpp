@@ -0,0 +1,621 @@
+#ifndef LOGGER_HPP
+
+#define LOGGER_HPP
+
+#include "logger.h"
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if __cplusplus >= 202002L
+#include <source_location>
+#endif
+
+/*
+ * C++17 front-end of liblogger, header only, over the same LOGGER
+ *
+ * liblogger::info(logger, LOGGER_FORMAT("request %d from %s took %.3f ms"), id, host, ms);
+ * and from C++20 on, the format can also be given as it is:
+ * liblogger::info(logger, "request %d from %s took %.3f ms", id, host, ms);
+ * liblogger::log(logger, level, format, args...) takes the level
+ *
+ * The message format is parsed at compile time and checked against the
+ * arguments, a missing or extra argument or a wrong type doesn't compile:
+ * %d %i %u %o %x %X take any integer or enum (length modifiers are ignored,
+ * the argument's own type is used), %c a char or integer,
+ * %s a const char *, std::string or std::string_view,
+ * %f %F %e %E %g %G %a %A a floating point number, %p a pointer, %% is a %
+ * Flags, width and precision work as in printf, * and %n do not
+ *
+ * The level is checked inline first, like the C macros (the arguments are
+ * evaluated though), then each argument is written by code made for its type
+ * and its conversion, taken by reference, never through varargs: numbers go
+ * through std::to_chars, %a may normalize its digits differently from printf
+ * The text goes to the logger through __logger_text__: same sinks, levels
+ * and modes as the C calls, the MSG label gets the text
+ * Messages up to 512 bytes don't allocate
+ */
+
+/* A format checked at compile time, in C++17 and later */
+#define LOGGER_FORMAT(format) \
+([] { \
+    struct logger_format_ : liblogger::detail::format_tag { \
+        static constexpr std::string_view text() { return format; } \
+        static constexpr const char *file() { return __FILE__; } \
+        static constexpr int line() { return __LINE__; } \
+    }; \
+    return logger_format_{}; \
+}())
+
+namespace liblogger {
+
+namespace detail {
+
+/* Base of the LOGGER_FORMAT types */
+struct format_tag {};
+
+enum flag : unsigned char {
+    left = 1, plus = 2, space = 4, alt = 8, zero = 16
+};
+
+/* Literal text of the format, then one conversion */
+struct piece {
+    std::size_t offset = 0;
+    std::size_t len = 0;
+    char conv = 0; // 0 after the last literal, % for %%
+    unsigned char flags = 0;
+    int width = 0;
+    int precision = -1; // -1 for none
+    bool escaped = false; // the literal holds %% (written as %) instead of ending there
+};
+
+enum class error {
+    none, invalid, missing, extra, type
+};
+
+constexpr int max_width = 4096;
+
+/* Read the piece starting at pos, return false if the conversion isn't supported */
+constexpr bool next_piece(std::string_view format, std::size_t &pos, piece &out) {
+    out = piece{};
+    out.offset = pos;
+    while (pos < format.size() && format[pos] != '%') {
+        pos++;
+    }
+    out.len = pos - out.offset;
+    if (pos == format.size()) {
+        return true;
+    }
+    for (pos++; pos < format.size(); pos++) {
+        char c = format[pos];
+        if (c == '-') out.flags |= left;
+        else if (c == '+') out.flags |= plus;
+        else if (c == ' ') out.flags |= space;
+        else if (c == '#') out.flags |= alt;
+        else if (c == '0') out.flags |= zero;
+        else break;
+    }
+    for (; pos < format.size() && format[pos] >= '0' && format[pos] <= '9'; pos++) {
+        out.width = out.width * 10 + (format[pos] - '0');
+        if (out.width > max_width) {
+            return false;
+        }
+    }
+    if (pos < format.size() && format[pos] == '.') {
+        out.precision = 0;
+        for (pos++; pos < format.size() && format[pos] >= '0' && format[pos] <= '9'; pos++) {
+            out.precision = out.precision * 10 + (format[pos] - '0');
+            if (out.precision > max_width) {
+                return false;
+            }
+        }
+    }
+    while (pos < format.size() && std::string_view("hlLqjzt").find(format[pos]) != std::string_view::npos) {
+        pos++;
+    }
+    if (pos == format.size()) {
+        return false;
+    }
+    out.conv = format[pos++];
+    return std::string_view("diuoxXcsfFeEgGaAp%").find(out.conv) != std::string_view::npos;
+}
+
+/* Pieces in format, the last literal included */
+constexpr std::size_t count_pieces(std::string_view format) {
+    std::size_t pos = 0, count = 0;
+    piece p;
+    do {
+        if (!next_piece(format, pos, p)) {
+            return count + 1;
+        }
+        count++;
+    } while (p.conv);
+    return count;
+}
+
+template <std::size_t N>
+constexpr std::array<piece, N> compile(std::string_view format) {
+    std::array<piece, N> pieces{};
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < N; i++) {
+        next_piece(format, pos, pieces[i]);
+    }
+    return pieces;
+}
+
+template <class T>
+using bare_t = std::remove_cv_t<std::remove_reference_t<T>>;
+
+template <class T>
+constexpr bool is_string_v = std::is_same_v<std::decay_t<T>, const char *> ||
+                             std::is_same_v<std::decay_t<T>, char *> ||
+                             std::is_same_v<bare_t<T>, std::string> ||
+                             std::is_same_v<bare_t<T>, std::string_view>;
+
+template <class T>
+constexpr bool accepts(char conv) {
+    using U = bare_t<T>;
+    switch (conv) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            return std::is_integral_v<U> || std::is_enum_v<U>;
+        case 'c':
+            return std::is_integral_v<U>;
+        case 's':
+            return is_string_v<T>;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            return std::is_floating_point_v<U>;
+        case 'p':
+            return std::is_pointer_v<std::decay_t<T>> || std::is_null_pointer_v<U>;
+    }
+    return false;
+}
+
+template <class... Args>
+constexpr error check(std::string_view format) {
+    bool (*const accept[])(char) = { &accepts<Args>..., nullptr };
+    std::size_t pos = 0, arg = 0;
+    piece p;
+    do {
+        if (!next_piece(format, pos, p)) {
+            return error::invalid;
+        }
+        if (p.conv && p.conv != '%') {
+            if (arg == sizeof...(Args)) {
+                return error::missing;
+            }
+            if (!accept[arg](p.conv)) {
+                return error::type;
+            }
+            arg++;
+        }
+    } while (p.conv);
+    return arg == sizeof...(Args) ? error::none : error::extra;
+}
+
+template <class F>
+using is_format = std::is_base_of<format_tag, F>;
+
+/* The pieces of a LOGGER_FORMAT, and which one each argument goes to */
+template <class F>
+struct program {
+    static constexpr std::size_t size = count_pieces(F::text());
+    static constexpr std::array<piece, size> pieces = compile<size>(F::text());
+};
+
+/* The message, on the stack until it gets long */
+class writer {
+public:
+    const char *data() const {
+        return spilled_ ? heap_.data() : local_;
+    }
+
+    std::size_t size() const {
+        return len_;
+    }
+
+    char *reserve(std::size_t n) {
+        if (!spilled_ && len_ + n <= sizeof(local_)) {
+            return local_ + len_;
+        }
+        if (!spilled_) {
+            heap_.assign(local_, len_);
+            spilled_ = true;
+        }
+        heap_.resize(len_ + n);
+        return &heap_[len_];
+    }
+
+    void append(const char *s, std::size_t n) {
+        if (n) {
+            std::memcpy(reserve(n), s, n);
+            len_ += n;
+        }
+    }
+
+    /* body in width, spaces on the left unless flags has left */
+    void pad(unsigned char flags, int width, const char *body, std::size_t n) {
+        std::size_t fill = width > 0 && static_cast<std::size_t>(width) > n ? width - n : 0;
+        char *out = reserve(n + fill);
+        if (!(flags & left)) {
+            std::memset(out, ' ', fill);
+            out += fill;
+        }
+        if (n) {
+            std::memcpy(out, body, n);
+        }
+        if (flags & left) {
+            std::memset(out + n, ' ', fill);
+        }
+        len_ += n + fill;
+    }
+
+    /* prefix (sign, 0x), zeros and the n digits in width: the zero flag
+     * pads between prefix and digits, else spaces go left unless flags has left */
+    void number(unsigned char flags, int width, std::string_view prefix, std::size_t zeros,
+                const char *digits, std::size_t n) {
+        std::size_t body = prefix.size() + zeros + n;
+        std::size_t fill = width > 0 && static_cast<std::size_t>(width) > body ? width - body : 0;
+        std::size_t total = body + fill;
+        if ((flags & zero) && !(flags & left)) {
+            zeros += fill;
+            fill = 0;
+        }
+        char *out = reserve(total);
+        if (!(flags & left)) {
+            std::memset(out, ' ', fill);
+            out += fill;
+        }
+        if (!prefix.empty()) {
+            std::memcpy(out, prefix.data(), prefix.size());
+        }
+        std::memset(out + prefix.size(), '0', zeros);
+        out += prefix.size() + zeros;
+        if (n) {
+            std::memcpy(out, digits, n);
+        }
+        if (flags & left) {
+            std::memset(out + n, ' ', fill);
+        }
+        len_ += total;
+    }
+
+private:
+    char local_[512];
+    std::string heap_;
+    std::size_t len_ = 0;
+    bool spilled_ = false;
+};
+
+inline void to_upper(char *text, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        if (text[i] >= 'a' && text[i] <= 'z') {
+            text[i] -= 'a' - 'A';
+        }
+    }
+}
+
+/* d i u o x X as printf writes them, the value in its own width */
+template <class N>
+inline void write_integer(writer &out, const piece &p, N number) {
+    using M = std::make_unsigned_t<N>;
+    std::string_view prefix;
+    M magnitude = static_cast<M>(number); // like printf, u o x X read a negative value as unsigned
+    if (p.conv == 'd' || p.conv == 'i') {
+        bool negative = false;
+        if constexpr (std::is_signed_v<N>) {
+            negative = number < 0;
+        }
+        magnitude = negative ? static_cast<M>(0 - magnitude) : magnitude;
+        prefix = negative ? "-" : p.flags & plus ? "+" : p.flags & space ? " " : "";
+    }
+    int base = p.conv == 'o' ? 8 : p.conv == 'x' || p.conv == 'X' ? 16 : 10;
+    char digits[3 * sizeof(M) + 1];
+    std::size_t n = 0;
+    if (magnitude || p.precision) { // %.0d writes nothing for 0
+        n = std::to_chars(digits, digits + sizeof(digits), magnitude, base).ptr - digits;
+    }
+    if (p.conv == 'X') {
+        to_upper(digits, n);
+    }
+    std::size_t zeros = p.precision > 0 && static_cast<std::size_t>(p.precision) > n ? p.precision - n : 0;
+    if ((p.flags & alt) && p.conv == 'o' && !zeros && (!n || digits[0] != '0')) {
+        zeros = 1;
+    } else if ((p.flags & alt) && base == 16 && magnitude) {
+        prefix = p.conv == 'x' ? "0x" : "0X";
+    }
+    // a precision turns the zero flag off
+    out.number(p.precision < 0 ? p.flags : p.flags & ~zero, p.width, prefix, zeros, digits, n);
+}
+
+/* %#: the point stays, and %#g keeps its zeros up to precision digits
+ * text has room for them after its n characters */
+inline std::size_t float_alt(char *text, std::size_t n, char conv, int precision) {
+    std::size_t mantissa = 0;
+    while (mantissa < n && text[mantissa] != 'e' && text[mantissa] != 'p') {
+        mantissa++;
+    }
+    bool point = std::memchr(text, '.', mantissa) != nullptr;
+    std::size_t zeros = 0;
+    if (conv == 'g') {
+        std::size_t digits = 0;
+        for (std::size_t i = 0; i < mantissa; i++) {
+            digits += text[i] != '.' && (digits || text[i] != '0');
+        }
+        std::size_t wanted = precision < 0 ? 6 : precision ? precision : 1;
+        zeros = wanted > (digits ? digits : 1) ? wanted - (digits ? digits : 1) : 0;
+    }
+    std::size_t insert = !point + zeros;
+    std::memmove(text + mantissa + insert, text + mantissa, n - mantissa);
+    if (!point) {
+        text[mantissa++] = '.';
+    }
+    std::memset(text + mantissa, '0', zeros);
+    return n + insert;
+}
+
+/* f F e E g G a A as printf writes them */
+template <class F>
+inline void write_float(writer &out, const piece &p, F value) {
+    char conv = p.conv >= 'A' && p.conv <= 'Z' ? p.conv + ('a' - 'A') : p.conv;
+    char prefix[4];
+    std::size_t prefix_len = 0;
+    if (std::signbit(value) || (p.flags & (plus | space))) {
+        prefix[prefix_len++] = std::signbit(value) ? '-' : p.flags & plus ? '+' : ' ';
+    }
+    F magnitude = std::fabs(value);
+    unsigned char flags = p.flags;
+    char local[128];
+    std::string spill;
+    char *text = local;
+    std::size_t n;
+    if (!std::isfinite(magnitude)) {
+        std::memcpy(local, std::isnan(magnitude) ? "nan" : "inf", 3);
+        n = 3;
+        flags &= ~zero;
+    } else {
+        if (conv == 'a') {
+            prefix[prefix_len++] = '0';
+            prefix[prefix_len++] = 'x';
+        }
+        int precision = p.precision < 0 ? 6 : p.precision;
+        auto convert = [&](char *first, char *last) {
+            switch (conv) {
+                case 'f':
+                    return std::to_chars(first, last, magnitude, std::chars_format::fixed, precision);
+                case 'e':
+                    return std::to_chars(first, last, magnitude, std::chars_format::scientific, precision);
+                case 'g':
+                    return std::to_chars(first, last, magnitude, std::chars_format::general, precision);
+            }
+            return p.precision < 0 ? std::to_chars(first, last, magnitude, std::chars_format::hex)
+                                   : std::to_chars(first, last, magnitude, std::chars_format::hex, precision);
+        };
+        // room for %# to add a point and zeros
+        std::size_t room = (p.flags & alt) ? precision + 2 : 0;
+        auto result = convert(local, local + sizeof(local) - room);
+        if (result.ec != std::errc()) {
+            spill.resize(std::numeric_limits<F>::max_exponent10 + precision + 32 + room);
+            text = &spill[0];
+            result = convert(text, text + spill.size() - room);
+        }
+        n = result.ptr - text;
+        if (p.flags & alt) {
+            n = float_alt(text, n, conv, p.precision);
+        }
+    }
+    if (p.conv != conv) {
+        to_upper(prefix, prefix_len);
+        to_upper(text, n);
+    }
+    out.number(flags, p.width, std::string_view(prefix, prefix_len), 0, text, n);
+}
+
+/* %p as glibc writes it: 0x and the address in hex, (nil) for null */
+inline void write_pointer(writer &out, const piece &p, const void *pointer) {
+    if (!pointer) {
+        out.pad(p.flags, p.width, "(nil)", 5);
+        return;
+    }
+    char digits[2 * sizeof(std::uintptr_t)];
+    std::size_t n = std::to_chars(digits, digits + sizeof(digits),
+                                  reinterpret_cast<std::uintptr_t>(pointer), 16).ptr - digits;
+    std::size_t zeros = p.precision > 0 && static_cast<std::size_t>(p.precision) > n ? p.precision - n : 0;
+    std::string_view prefix = p.flags & plus ? "+0x" : p.flags & space ? " 0x" : "0x";
+    out.number(p.precision < 0 ? p.flags : p.flags & ~zero, p.width, prefix, zeros, digits, n);
+}
+
+template <class T>
+inline void write_value(writer &out, const piece &p, const T &value) {
+    using U = bare_t<T>;
+    if constexpr (is_string_v<T>) {
+        std::string_view s;
+        if constexpr (std::is_same_v<U, std::string> || std::is_same_v<U, std::string_view>) {
+            s = value;
+        } else if (const char *text = value) {
+            s = text;
+        } else {
+            s = p.precision < 0 || p.precision >= 6 ? "(null)" : ""; // as glibc does
+        }
+        if (p.precision >= 0 && s.size() > static_cast<std::size_t>(p.precision)) {
+            s = s.substr(0, p.precision);
+        }
+        out.pad(p.flags, p.width, s.data(), s.size());
+    } else if constexpr (std::is_floating_point_v<U>) {
+        write_float(out, p, value);
+    } else if constexpr (std::is_pointer_v<std::decay_t<T>> || std::is_null_pointer_v<U>) {
+        write_pointer(out, p, static_cast<const void *>(value));
+    } else {
+        using I = std::conditional_t<std::is_enum_v<U>, std::underlying_type<U>, std::common_type<U>>;
+        using N = std::conditional_t<std::is_same_v<typename I::type, bool>, int, typename I::type>;
+        N number = static_cast<N>(value);
+        if (p.conv == 'c') {
+            char c = static_cast<char>(number);
+            out.pad(p.flags, p.width, &c, 1);
+        } else if (!p.flags && !p.width && p.precision < 0 && (p.conv == 'd' || p.conv == 'i')) {
+            char text[3 * sizeof(N) + 2];
+            out.append(text, std::to_chars(text, text + sizeof(text), number).ptr - text);
+        } else {
+            write_integer(out, p, number);
+        }
+    }
+}
+
+/* Write the pieces before the one of the next argument and its literal,
+ * then the argument */
+template <class T>
+inline void write_argument(writer &out, std::string_view format, const piece *pieces,
+                           std::size_t &next, const T &value) {
+    for (;; next++) {
+        const piece &p = pieces[next];
+        out.append(format.data() + p.offset, p.len);
+        if (p.conv != '%') {
+            write_value(out, p, value);
+            next++;
+            return;
+        }
+        out.append("%", 1);
+    }
+}
+
+/* The literal of p, each %% in it written as % */
+inline void write_literal(writer &out, std::string_view format, const piece &p) {
+    const char *s = format.data() + p.offset;
+    const char *end = s + p.len;
+    while (p.escaped && s < end) {
+        const char *percent = static_cast<const char *>(std::memchr(s, '%', end - s));
+        if (!percent) {
+            break;
+        }
+        out.append(s, percent - s + 1);
+        s = percent + 2;
+    }
+    out.append(s, end - s);
+}
+
+/* Whatever follows the last argument */
+inline void write_rest(writer &out, std::string_view format, const piece *pieces,
+                       std::size_t next, std::size_t size) {
+    for (; next < size; next++) {
+        out.append(format.data() + pieces[next].offset, pieces[next].len);
+        if (pieces[next].conv == '%') {
+            out.append("%", 1);
+        }
+    }
+}
+
+#if __cplusplus >= 202002L
+/* Not constexpr: calling it in a consteval constructor is the compile error */
+inline void format_does_not_match_its_arguments() {}
+
+template <class... Args>
+struct format_string {
+    std::string_view text;
+    std::source_location where;
+    // one per argument then the rest, each literal running on past its %%
+    std::array<piece, sizeof...(Args) + 1> pieces{};
+
+    template <class S>
+        requires std::is_convertible_v<const S &, std::string_view>
+    consteval format_string(const S &s, std::source_location where = std::source_location::current())
+        : text(s), where(where) {
+        if (check<Args...>(text) != error::none) {
+            format_does_not_match_its_arguments();
+        }
+        std::size_t pos = 0;
+        for (piece &compiled : pieces) {
+            std::size_t start = pos;
+            bool escaped = false;
+            piece p;
+            do {
+                next_piece(text, pos, p);
+                escaped |= p.conv == '%';
+            } while (p.conv == '%');
+            compiled = p;
+            compiled.offset = start;
+            compiled.len = p.offset + p.len - start;
+            compiled.escaped = escaped;
+        }
+    }
+};
+#endif
+
+} // namespace detail
+
+#if __cplusplus >= 202002L
+template <class... Args>
+using format = detail::format_string<std::type_identity_t<Args>...>;
+#endif
+
+/* Log the arguments with a LOGGER_FORMAT */
+template <class F, class... Args>
+inline std::enable_if_t<detail::is_format<F>::value>
+log(LOGGER *logger, log_level_t level, F, Args &&... args) {
+    constexpr detail::error error = detail::check<Args...>(F::text());
+    static_assert(error != detail::error::invalid, "liblogger: invalid conversion in the format (* and %n are not supported)");
+    static_assert(error != detail::error::missing, "liblogger: more conversions than arguments");
+    static_assert(error != detail::error::extra, "liblogger: more arguments than conversions");
+    static_assert(error != detail::error::type, "liblogger: an argument's type doesn't match its conversion");
+    if (!logger_enabled(logger, level)) {
+        return;
+    }
+    using P = detail::program<F>;
+    detail::writer out;
+    std::size_t next = 0;
+    (detail::write_argument(out, F::text(), P::pieces.data(), next, args), ...);
+    detail::write_rest(out, F::text(), P::pieces.data(), next, P::size);
+    __logger_text__(F::file(), F::line(), logger, level, out.data(), out.size());
+}
+
+#if __cplusplus >= 202002L
+/* Log the arguments with a format checked where it is written */
+template <class... Args>
+inline void log(LOGGER *logger, log_level_t level, format<Args...> format, Args &&... args) {
+    if (!logger_enabled(logger, level)) {
+        return;
+    }
+    detail::writer out;
+    std::size_t next = 0;
+    ((detail::write_literal(out, format.text, format.pieces[next]),
+      detail::write_value(out, format.pieces[next++], args)), ...);
+    detail::write_literal(out, format.text, format.pieces[next]);
+    __logger_text__(format.where.file_name(), format.where.line(), logger, level, out.data(), out.size());
+}
+#endif
+
+#if __cplusplus >= 202002L
+#define LOGGER_CXX_LEVEL(name, level) \
+template <class F, class... Args> \
+inline std::enable_if_t<detail::is_format<F>::value> name(LOGGER *logger, F format, Args &&... args) { \
+    log(logger, level, format, std::forward<Args>(args)...); \
+} \
+template <class... Args> \
+inline void name(LOGGER *logger, format<Args...> format, Args &&... args) { \
+    log<Args...>(logger, level, format, std::forward<Args>(args)...); \
+}
+#else
+#define LOGGER_CXX_LEVEL(name, level) \
+template <class F, class... Args> \
+inline std::enable_if_t<detail::is_format<F>::value> name(LOGGER *logger, F format, Args &&... args) { \
+    log(logger, level, format, std::forward<Args>(args)...); \
+}
+#endif
+
+LOGGER_CXX_LEVEL(trace, TRACE)
+LOGGER_CXX_LEVEL(debug, DEBUG)
+LOGGER_CXX_LEVEL(info, INFO)
+LOGGER_CXX_LEVEL(warning, WARNING)
+LOGGER_CXX_LEVEL(error, ERROR)
+LOGGER_CXX_LEVEL(fatal, FATAL)
+
+#undef LOGGER_CXX_LEVEL
+
+} // namespace liblogger
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef ARRAY_H
+
+#define ARRAY_H
+
+#include "buffer.h"
+#include <stddef.h>
+#include <stdio.h>
+
+/* How __logger_log_array__ lays the elements out (LOGGER_ARRAY_* flags
+ * and how many elements to keep at each end, 0 and 0 for all) */
+typedef struct ArrayStyle {
+    unsigned char flags;
+    size_t head;
+    size_t tail;
+} ArrayStyle;
+
+/* Append the elements after the message already in buffer
+ * The built-in printers are recognized and formatted without stdio,
+ * other printers write to a memory stream
+ * Return 0 or -1 if memory ran out */
+int array_render(LogBuffer *buffer, const ArrayStyle *style, const void *array,
+                 size_t element_size, size_t len, void (*print_element)(FILE *, void *));
+
+#endif
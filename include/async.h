@@ -0,0 +1,22 @@
+#ifndef ASYNC_H
+
+#define ASYNC_H
+
+#include "logger_imp.h"
+
+/* Lock-free bounded multi-producer queue drained by one writer thread */
+typedef struct AsyncQueue AsyncQueue;
+
+AsyncQueue *async_start(lgimp_t *logger, size_t capacity, int overflow, log_level_t keep_level);
+
+/* Render the message on the caller's thread and queue the record
+ * Return 0 or -1 if it was dropped by the overflow policy or for lack of memory */
+int async_push(AsyncQueue *queue, LogRecord *record);
+
+/* Wait until everything queued so far reached the file */
+void async_flush(AsyncQueue *queue);
+
+/* Drain the queue, stop the writer and free everything */
+void async_stop(AsyncQueue *queue);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef BINLOG_H
+
+#define BINLOG_H
+
+#include "logger_imp.h"
+
+/* Binary log: records keep their raw arguments and are only formatted
+ * when the file is decoded
+ *
+ * The stream is a sequence of entries, each starting with a tag byte
+ * (integers are native, lengths are uint32):
+ * 'H' version:u8 format:len+bytes ref:len+bytes    the config to decode with
+ * 'D' id:u32 line:i32 fname:len+bytes msg:len+bytes    a call site, before its first record
+ * 'R' id:u32 level:u8 sec:i64 nsec:u32 args:len+bytes    a record of call site id
+ * 'T' level:u8 sec:i64 nsec:u32 line:i32 fname:len+bytes text:len+bytes
+ *     a record that could not be deferred (table full or unsupported specifier)
+ */
+
+#define BINLOG_VERSION 1
+
+/* Call site dictionary of one output stream */
+typedef struct BinaryLog BinaryLog;
+
+BinaryLog *binlog_create(void);
+void binlog_free(BinaryLog *log);
+
+/* Append the 'H' entry for config */
+int binlog_header(const LoggerConfig *config, LogBuffer *buffer);
+
+/* Append the entries of a record, records without args go as text
+ * Return a call site to pass to binlog_written once buffer is out, or NULL */
+void *binlog_record(BinaryLog *log, LogRecord *record, LogBuffer *buffer);
+
+/* The dictionary entry of site reached the stream, later records can skip it */
+void binlog_written(void *site);
+
+/* Append the 'D' entry of every call site seen so far, for a new file
+ * that must decode without the ones before it */
+int binlog_dictionary(const BinaryLog *log, LogBuffer *buffer);
+
+/* Turn a binary log back into text, return the number of records or -1 */
+long binlog_decode(FILE *in, FILE *out);
+
+#endif
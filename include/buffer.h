@@ -0,0 +1,37 @@
+#ifndef BUFFER_H
+
+#define BUFFER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/* A growable byte buffer a whole record is rendered into before being written */
+typedef struct LogBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} LogBuffer;
+
+/* The calling thread's record buffer, freed when the thread exits */
+LogBuffer *buffer_thread_local(void);
+
+/* A second one, for a message formatted before its record is rendered */
+LogBuffer *buffer_thread_message(void);
+
+/* All of these return 0 on success, -1 if the buffer could not grow */
+int buffer_reserve(LogBuffer *buffer, size_t extra);
+int buffer_append(LogBuffer *buffer, const char *s, size_t len);
+int buffer_append_str(LogBuffer *buffer, const char *s);
+int buffer_append_int(LogBuffer *buffer, long long value);
+int buffer_append_padded(LogBuffer *buffer, unsigned long long value, int width); // zero padded
+int buffer_append_double(LogBuffer *buffer, double value); // shortest form that reads back the same
+int buffer_vprintf(LogBuffer *buffer, const char *format, va_list args);
+int buffer_printf(LogBuffer *buffer, const char *format, ...);
+
+/* Write value's decimal digits backwards ending at end, return where they start */
+char *buffer_digits(char *end, unsigned long long value);
+
+/* Empty the buffer, giving the memory back if a huge record made it grow */
+void buffer_clear(LogBuffer *buffer);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef COALESCE_H
+
+#define COALESCE_H
+
+#include "logger_imp.h"
+#include <pthread.h>
+
+/* Repeats of a logger's last record, held back and counted
+ * lock is held from coalesce_check until the note and the record are
+ * handed out, so another thread's record can't get between them
+ * With a timeout a timer thread writes the note of a run that is
+ * timeout old, even if nothing is logged after it */
+typedef struct Coalesce {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a run started, or stop
+    pthread_t timer;
+    int timed; // the timer thread runs
+    int stop;
+    lgimp_t *logger;
+    unsigned long long hash; // of the last record written, 0 before the first
+    const char *fname;
+    int line;
+    log_level_t level;
+    size_t repeats; // held back since it was written
+    struct timespec since; // when the first of them came
+    long long timeout; // ns, 0 for none
+} Coalesce;
+
+/* A run of repeats that ended, "last message repeated" is written for it */
+typedef struct CoalesceRun {
+    const char *fname;
+    int line;
+    log_level_t level;
+    size_t repeats; // 0 if there is nothing to write
+} CoalesceRun;
+
+/* timeout_ms is how long repeats can be held back, 0 for as long as they last
+ * (no timer thread then), logger gets the notes of the runs that time out */
+Coalesce *coalesce_create(lgimp_t *logger, long timeout_ms);
+
+/* Stop the timer thread, the caller must not be in a read section of the logger */
+void coalesce_free(Coalesce *coalesce);
+
+/* Return 1 if record repeats the last one and is held back
+ * The message must be rendered already (args NULL)
+ * run gets the repeats to write before record, if any */
+int coalesce_check(Coalesce *coalesce, const LogRecord *record, CoalesceRun *run);
+
+/* End the current run, run gets its repeats */
+void coalesce_end(Coalesce *coalesce, CoalesceRun *run);
+
+/* Whether the current run is timeout old, with lock held */
+int coalesce_expired(const Coalesce *coalesce);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef EPOCH_H
+
+#define EPOCH_H
+
+#include <stdatomic.h>
+
+#define EPOCH_SHARDS 16
+
+/* Read-side counters of an RCU-style guard, spread over cache lines
+ * so readers on different threads don't fight over one counter */
+typedef struct EpochShard {
+    _Alignas(64) atomic_long readers[2];
+} EpochShard;
+
+/* Readers never block: they count themselves in the current epoch
+ * Writers publish a new pointer then wait for the old epoch to empty */
+typedef struct EpochGuard {
+    atomic_uint epoch;
+    EpochShard shards[EPOCH_SHARDS];
+} EpochGuard;
+
+/* Which shard the calling thread counts itself in */
+unsigned epoch_shard(void);
+
+/* Return a token to give back to epoch_exit */
+static inline unsigned epoch_enter(EpochGuard *guard) {
+    unsigned shard = epoch_shard();
+    unsigned epoch = atomic_load(&guard -> epoch) & 1;
+    atomic_fetch_add(&guard -> shards[shard].readers[epoch], 1);
+    return shard << 1 | epoch;
+}
+
+static inline void epoch_exit(EpochGuard *guard, unsigned token) {
+    atomic_fetch_sub_explicit(&guard -> shards[token >> 1].readers[token & 1], 1,
+                              memory_order_release);
+}
+
+/* Wait until every reader that could still see what was replaced is done
+ * Writers must be serialized by the caller */
+void epoch_synchronize(EpochGuard *guard);
+
+#endif
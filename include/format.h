@@ -0,0 +1,39 @@
+#ifndef FORMAT_H
+
+#define FORMAT_H
+
+#include <stddef.h>
+
+/* One opcode per format label, OP_LITERAL is a plain span of text */
+enum FORMAT_OPCODE {
+    OP_REF, OP_LEVEL, OP_DATE, OP_TIME, OP_FILENAME, OP_LINE, OP_MSG,
+    OP_MSEC, OP_USEC, OP_ISO8601, OP_EPOCHNS, OP_FIELDS,
+    OP_PRI, OP_HOSTNAME, OP_PID,
+    OP_LITERAL
+};
+
+/* What a program needs from the clock */
+#define FORMAT_USES_TIME     1 // any time label
+#define FORMAT_USES_SUBSEC   2 // a label finer than a second
+#define FORMAT_USES_FIELDS   4 // says where the key-value fields go
+
+typedef struct FormatOp {
+    const char *string; /* only for OP_LITERAL, points into the program's pool */
+    size_t len;
+    unsigned char code;
+} FormatOp;
+
+/* A compiled format, ops, literal pool and source live in a single allocation */
+typedef struct FormatProgram {
+    size_t count;
+    unsigned flags;
+    const char *source; // the format it was compiled from
+    FormatOp ops[];
+} FormatProgram;
+
+/* Compile a format string, return NULL (and report why on stderr)
+ * on unknown labels, unterminated brackets or allocation failure */
+FormatProgram *format_compile(const char *s);
+void format_free(FormatProgram *program);
+
+#endif
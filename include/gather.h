@@ -0,0 +1,48 @@
+#ifndef GATHER_H
+
+#define GATHER_H
+
+#include "buffer.h"
+#include "sink.h"
+#include <stddef.h>
+
+#define GATHER_MIN_TEXT 64 // shorter text is cheaper to copy than to give its own iovec
+
+/* A piece of rendered output: text somewhere else (base set)
+ * or a span of the buffer the rest of the output went to (base NULL) */
+typedef struct GatherPiece {
+    const char *base;
+    size_t offset; // in the buffer, when base is NULL
+    size_t len;
+} GatherPiece;
+
+/* Rendered records as pieces for a writev, the buffer holds the text
+ * that had to be copied, the pieces say in which order */
+typedef struct GatherList {
+    GatherPiece *pieces;
+    size_t count;
+    size_t cap;
+    size_t mark; // bytes of the buffer already in a piece
+    size_t bytes; // total length of the pieces
+    int batch; // written after later records: only text lasting as long as the config may be pointed at
+} GatherList;
+
+/* The calling thread's list, for records written one at a time */
+GatherList *gather_thread_local(void);
+
+/* Point at s if it is long enough, else copy it to buffer
+ * Return 0 or -1 if memory ran out */
+int gather_text(GatherList *gather, LogBuffer *buffer, const char *s, size_t len);
+
+/* Make a piece of what was appended to buffer since the last one
+ * Return 0 or -1 if memory ran out */
+int gather_close(GatherList *gather, const LogBuffer *buffer);
+
+/* Close the list and hand it to the sink's writev, IOV_MAX pieces at a time
+ * Return 0 or -1 */
+int gather_write(GatherList *gather, const LogBuffer *buffer, LOGGER_SINK *sink);
+
+/* Empty the list, to go with an empty buffer */
+void gather_clear(GatherList *gather);
+
+#endif
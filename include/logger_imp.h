@@ -0,0 +1,186 @@
+#ifndef LOGGER_IMP_H
+
+#define LOGGER_IMP_H
+
+#include "array.h"
+#include "buffer.h"
+#include "epoch.h"
+#include "format.h"
+#include "gather.h"
+#include "logger.h"
+#include "sink.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Internals shared by the modules of the library, not part of the API */
+
+struct AsyncQueue;
+struct BinaryLog;
+
+#define LOGGER_MAX_SINKS 32 // the logger's own sink included
+
+/* A sink of a fan-out logger, the logger's own one is described by the config
+ * A record is rendered once per distinct (format, colored) */
+typedef struct LoggerOutput {
+    LOGGER_SINK *sink;
+    FormatProgram *format; // owned, NULL to use the logger's
+    unsigned char colored;
+    unsigned char level; // lowest level written to it
+} LoggerOutput;
+
+typedef struct LoggerOutputs {
+    size_t count;
+    LoggerOutput outputs[];
+} LoggerOutputs;
+
+/* Everything a record is rendered and written with
+ * Never modified once published, a change publishes a new copy */
+typedef struct LoggerConfig {
+    const char *ref;
+    LOGGER_SINK *sink; // destination
+    unsigned char owns_sink; // sink wraps the user's FILE, closed with the config
+    FormatProgram *format; // compiled printing format, owned
+    unsigned char colored; // sink is a terminal, use the colored labels
+    unsigned char mode; // LOGGER_MODE
+    struct BinaryLog *binary; // call site dictionary of the sink in binary mode, owned
+    struct Coalesce *coalesce; // repeats held back, owned, NULL unless coalescing
+    struct Recorder *recorder; // last records kept in memory, owned, NULL if off
+    LoggerOutputs *extra; // sinks added with logger_add_sink, owned, NULL if none
+    ArrayStyle array; // layout of logged arrays
+} LoggerConfig;
+
+struct LOGGER_IMP {
+    _Atomic unsigned char level; // what the macros check (LOGGER_HEAD): min(min_level, record_level), or TRACE to count filtered calls
+    _Atomic unsigned char min_level; // lowest level any sink takes, read relaxed
+    _Atomic unsigned char sink_level; // lowest level of the config's own sink
+    _Atomic unsigned char record_level; // lowest level the recorder keeps, OFF without one
+    unsigned char threadsafe; // readers go through the guard
+    _Atomic(LoggerConfig *) config;
+    _Atomic(struct AsyncQueue *) async; // NULL when logging on the caller's thread, used under the guard
+    pthread_mutex_t lock; // serializes config changes
+    EpochGuard guard; // protects config from being freed under readers
+    _Atomic(struct LoggerStats *) stats; // stats_block while counting, else NULL
+    struct LoggerStats *stats_block; // from the first logger_enable_stats to logger_remove
+    unsigned char count_filtered; // the macros let every level through while counting
+    unsigned char pooled; // memory belongs to the registry's arena
+};
+typedef struct LOGGER_IMP lgimp_t;
+
+/* Bytes a logger takes, it must be 64 aligned (the guard's counters are) */
+#define LOGGER_IMP_SIZE ((sizeof(lgimp_t) + 63) / 64 * 64)
+
+/* Set up a logger in memory writing to sink, closed with it if owns_sink
+ * Return it or NULL if memory ran out or format is invalid (sink is left alone) */
+LOGGER *logger_init(void *memory, const char *ref, LOGGER_SINK *sink, const int owns_sink,
+                    const int colored, const char *format, const log_level_t level);
+
+/* Undo logger_init, memory is left to the caller */
+void logger_destroy(lgimp_t *logger);
+
+/* The logger a registry child writes through while sink is its link to it, else NULL */
+lgimp_t *registry_parent(const LOGGER_SINK *sink);
+
+/* One log call on its way to the file
+ * msg is a printf format used with args, or, if args is NULL,
+ * text that is already rendered (msg_len bytes)
+ * raw records are finished output (binary entries) written as they are */
+typedef struct LogRecord {
+    const char *fname;
+    int line;
+    log_level_t level;
+    struct timespec time; // zero if not taken yet
+    const char *msg;
+    va_list *args;
+    size_t msg_len;
+    unsigned char raw;
+    const LOGGER_FIELD *fields; // logger_kv's, rendered after msg
+    size_t field_count;
+    unsigned char forced; // from a call site switched on, passes every level
+    void *site; // raw binary output: the call site to mark written once it is out
+    const char *ref; // REF instead of the config's: the registry child it comes from,
+                     // whose level stands for the level of the config's own sink
+} LogRecord;
+
+/* Append the record rendered with the config's format to buffer
+ * Return 0 or -1 if the buffer could not grow */
+int logger_render(const LoggerConfig *config, LogRecord *record, LogBuffer *buffer);
+
+/* Take the time the config's formats need, if any */
+void logger_stamp(const LoggerConfig *config, LogRecord *record);
+
+/* Render the record once per distinct format of the sinks taking its level,
+ * from sink first on (0 is the config's own), using scratch
+ * Each sink gets it appended to batches[i], or written right away if batches is NULL
+ * Sinks with writev get text records on their own, in batches[i] and gathers[i]
+ * Return the number of bytes handed out */
+size_t logger_dispatch(lgimp_t *logger, const LoggerConfig *config, LogRecord *record,
+                       size_t first, LogBuffer *scratch, LogBuffer *batches, GatherList *gathers);
+
+/* Write to a sink, counting bytes, errors and time when stats are on
+ * Return 0 or -1 if the sink failed */
+int logger_write(lgimp_t *logger, LOGGER_SINK *sink, const char *data, size_t len);
+
+/* Hand one record of a batch to a sink with queue, counting it */
+void logger_queue(lgimp_t *logger, LOGGER_SINK *sink, const char *data, size_t len);
+
+/* The same with writev, for the pieces of gather and the text in buffer */
+void logger_write_gather(lgimp_t *logger, LOGGER_SINK *sink, GatherList *gather, const LogBuffer *buffer);
+
+/* Log a registry child's record as the parent would its own: the parent's
+ * mode, async queue, sinks and their levels (record -> ref names the child)
+ * Return 0 or -1 if raw output was dropped or the sink failed */
+int logger_forward(lgimp_t *parent, LogRecord *record);
+
+/* Write the note of coalesce's run if it timed out, for its timer thread */
+void logger_coalesce_expire(lgimp_t *logger, struct Coalesce *coalesce);
+
+/* The logger's counters, NULL unless counting */
+static inline struct LoggerStats *logger_counting(lgimp_t *logger) {
+    return atomic_load_explicit(&logger -> stats, memory_order_acquire);
+}
+
+/* Sink i of config, 0 being its own, return -1 past the last one */
+static inline int logger_output(lgimp_t *logger, const LoggerConfig *config,
+                                size_t i, LoggerOutput *out) {
+    if (i == 0) {
+        out -> sink = config -> sink;
+        out -> format = config -> format;
+        out -> colored = config -> colored;
+        out -> level = atomic_load_explicit(&logger -> sink_level, memory_order_relaxed);
+        return 0;
+    }
+    if (!config -> extra || i > config -> extra -> count) {
+        return -1;
+    }
+    *out = config -> extra -> outputs[i - 1];
+    if (!out -> format) {
+        out -> format = config -> format;
+    }
+    return 0;
+}
+
+/* Whether output i (0 is the config's own sink) of level takes the record */
+static inline int logger_takes(const LogRecord *record, size_t i, unsigned char level) {
+    return record -> level >= level || record -> forced || (i == 0 && record -> ref);
+}
+
+/* The current config, valid until logger_read_unlock
+ * Only costs the guard when the logger is in thread-safe mode */
+static inline const LoggerConfig *logger_read_lock(lgimp_t *logger, unsigned *token) {
+    if (logger -> threadsafe) {
+        *token = epoch_enter(&logger -> guard);
+    }
+    return atomic_load_explicit(&logger -> config, memory_order_acquire);
+}
+
+static inline void logger_read_unlock(lgimp_t *logger, unsigned token) {
+    if (logger -> threadsafe) {
+        epoch_exit(&logger -> guard, token);
+    }
+}
+
+#endif
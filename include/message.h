@@ -0,0 +1,17 @@
+#ifndef MESSAGE_H
+
+#define MESSAGE_H
+
+#include "buffer.h"
+#include <stdarg.h>
+
+/* printf for record messages, without stdio on the common conversions
+ * A format is parsed once and kept by address (its text is checked on each use)
+ * Integers, %s, %c, %p and most %f/%g are written directly, other floating
+ * conversions go through snprintf one at a time, and formats with anything
+ * else (%n, %m, %1$d, wide characters, ' or I flags) go to vsnprintf whole
+ * Numbers use the C locale
+ * Return 0 or -1 if the buffer could not grow */
+int message_vprintf(LogBuffer *buffer, const char *format, va_list args);
+
+#endif
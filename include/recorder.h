@@ -0,0 +1,46 @@
+#ifndef RECORDER_H
+
+#define RECORDER_H
+
+#include "logger_imp.h"
+#include <stdatomic.h>
+
+#define RECORDER_MSG 200 // longer messages are cut, a slot is 256 bytes
+
+/* One captured record, a seqlock: sequence is odd while the slot is
+ * written and 2 * (position + 1) once it holds position */
+typedef struct RecorderSlot {
+    _Atomic unsigned long long sequence;
+    struct timespec time;
+    const char *fname;
+    int line;
+    unsigned char level;
+    unsigned char written; // left out of recorder_dump, the sink has it
+    unsigned short len;
+    char msg[RECORDER_MSG];
+} RecorderSlot;
+
+/* The last records of a logger, kept in memory whatever the sinks take */
+typedef struct Recorder {
+    _Alignas(64) _Atomic unsigned long long head; // next position
+    _Atomic unsigned long long dumped; // positions below were dumped already
+    size_t mask;
+    log_level_t level; // lowest level kept
+    RecorderSlot slots[];
+} Recorder;
+
+/* Room for count records (rounded up to a power of 2) */
+Recorder *recorder_create(size_t count, log_level_t level);
+
+/* Copy the record in, formatting its message, without locks
+ * written: the sink gets the record too, recorder_dump leaves it out */
+void recorder_capture(Recorder *recorder, const LogRecord *record, int written);
+
+/* Append the records not dumped yet, rendered with config and ref as REF */
+int recorder_dump(Recorder *recorder, const LoggerConfig *config, const char *ref, LogBuffer *buffer);
+
+/* Write the records not dumped yet to fd in a fixed layout,
+ * async-signal-safe: no locks, no allocation, no stdio */
+void recorder_dump_fd(Recorder *recorder, int fd);
+
+#endif
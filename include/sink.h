@@ -0,0 +1,42 @@
+#ifndef SINK_H
+
+#define SINK_H
+
+#include "buffer.h"
+#include "logger.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+/* Where rendered records go, every sink starts with a LOGGER_SINK
+ * write gets one or more whole records and may be called from several threads
+ * A sink with writev gets text records in pieces instead, pointing at
+ * the text where it lies as much as possible (see gather.h)
+ * A sink with queue gets an async batch one record at a time, then a flush */
+typedef struct SinkOps {
+    int (*write)(LOGGER_SINK *sink, const char *data, size_t len); // 0 or -1
+    int (*flush)(LOGGER_SINK *sink);
+    void (*close)(LOGGER_SINK *sink); // flush and free the sink
+    int (*writev)(LOGGER_SINK *sink, const struct iovec *iov, int count); // 0 or -1, may be NULL
+    int (*queue)(LOGGER_SINK *sink, const char *data, size_t len); // one record to go out on flush, may be NULL
+} SinkOps;
+
+struct LOGGER_SINK {
+    const SinkOps *ops;
+    FILE *file; // the stream behind the sink if there is one, else NULL
+};
+
+/* A sink writing to file with fwrite, closing it leaves file open */
+LOGGER_SINK *sink_file(FILE *file);
+
+/* What a new file must start with to be read on its own, appended to buffer
+ * Return 0 or -1 to start the file empty */
+typedef int (*SinkPreamble)(void *arg, LogBuffer *buffer);
+
+/* Have a rotating sink write preamble(arg) at the top of every new file,
+ * before any record can reach it (NULL to stop)
+ * It is called while a record is being written, from that thread
+ * Return 0 or -1 if sink doesn't rotate */
+int sink_rotating_preamble(LOGGER_SINK *sink, SinkPreamble preamble, void *arg);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef STATS_H
+
+#define STATS_H
+
+#include "logger.h"
+#include <stdatomic.h>
+
+#define STATS_SHARDS 16 // threads share a shard once there are more
+
+enum STATS_COUNTER {
+    STATS_ACCEPTED, STATS_FILTERED, STATS_BYTES, STATS_ERRORS, STATS_DROPPED, STATS_COUNTERS
+};
+
+enum STATS_HISTOGRAM {
+    STATS_RENDER, STATS_WRITE, STATS_HISTOGRAMS
+};
+
+/* One thread's counters, on their own cache lines so counting never
+ * bounces a line between cores */
+typedef struct StatsShard {
+    _Alignas(64) _Atomic unsigned long long counters[STATS_COUNTERS];
+    _Atomic unsigned long long histograms[STATS_HISTOGRAMS][LOGGER_STATS_BUCKETS];
+} StatsShard;
+
+typedef struct LoggerStats {
+    StatsShard shards[STATS_SHARDS];
+} LoggerStats;
+
+LoggerStats *stats_create(void);
+
+/* This thread's shard */
+StatsShard *stats_shard(LoggerStats *stats);
+
+static inline void stats_add(LoggerStats *stats, int counter, unsigned long long n) {
+    if (stats) {
+        atomic_fetch_add_explicit(&stats_shard(stats) -> counters[counter], n,
+                                  memory_order_relaxed);
+    }
+}
+
+/* Start timing, 0 when not counting */
+unsigned long long stats_start(LoggerStats *stats);
+
+/* Count the time since start in a histogram */
+void stats_time(LoggerStats *stats, int histogram, unsigned long long start);
+
+/* Sum the shards, zeroing them if reset */
+void stats_snapshot(LoggerStats *stats, LOGGER_STATS *out, int reset);
+
+#endif
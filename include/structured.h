@@ -0,0 +1,34 @@
+#ifndef STRUCTURED_H
+
+#define STRUCTURED_H
+
+#include "buffer.h"
+#include "logger.h"
+
+/* Key-value encoding for the JSON and logfmt modes and the [FIELDS] label
+ * Values are rendered straight into the record buffer then escaped in place */
+
+/* The key a format label (FORMAT_OPCODE) is written with */
+const char *structured_label_key(int code);
+
+/* Labels written as JSON numbers rather than strings */
+int structured_label_numeric(int code);
+
+/* Open the record ({ in JSON) */
+int structured_begin(LogBuffer *buffer, int mode);
+
+/* Close the record and end the line */
+int structured_end(LogBuffer *buffer, int mode);
+
+/* Separator and key, first is the first pair of the record */
+int structured_key(LogBuffer *buffer, int mode, const char *key, int first);
+
+/* Turn what was appended since start into a string value of mode,
+ * quoting and escaping it where it is */
+int structured_string(LogBuffer *buffer, int mode, size_t start);
+
+/* Append the fields as pairs, LOGGER_TEXT writes them as logfmt */
+int structured_fields(LogBuffer *buffer, int mode, const LOGGER_FIELD *fields,
+                      size_t count, int first);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef TIMESTAMP_H
+
+#define TIMESTAMP_H
+
+#include <time.h>
+
+/* Calendar strings of one second, rebuilt only when the second changes */
+typedef struct TimeCache {
+    time_t second;
+    char date[16];  // YYYY-MM-DD
+    char time[16];  // HH:MM:SS
+    char iso[24];   // YYYY-MM-DDTHH:MM:SS
+    char zone[8];   // +hh:mm
+} TimeCache;
+
+/* Read the clock, precise is only needed for sub-second labels
+ * otherwise the cheaper coarse clock is used */
+void timestamp_now(struct timespec *ts, int precise);
+
+/* The calling thread's cache, refreshed for ts if needed */
+const TimeCache *timestamp_cache(const struct timespec *ts);
+
+#endif
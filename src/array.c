@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 200809L
+#include "array.h"
+#include "logger.h"
+#include "print_types.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void (*ArrayPrinter)(FILE *, void *);
+
+/* Element types with a fast path, found by comparing printers */
+enum ARRAY_TYPE {
+    ARRAY_OTHER, ARRAY_CHAR, ARRAY_INT, ARRAY_DOUBLE, ARRAY_STRING, ARRAY_POINTER
+};
+
+/* What the elements are written through when there is no fast path */
+typedef struct ArrayStream {
+    FILE *file;
+    char *data;
+    size_t len;
+} ArrayStream;
+
+static int array_type(ArrayPrinter print_element, size_t element_size);
+static int array_element(LogBuffer *buffer, int type, const char *element,
+                         ArrayPrinter print_element, ArrayStream *stream);
+static int array_prefix(LogBuffer *buffer, int compact, int first, size_t index);
+static int array_pointer(LogBuffer *buffer, const void *pointer);
+static int array_stats(LogBuffer *buffer, int compact, int type, const char *array, size_t len);
+
+
+int array_render(LogBuffer *buffer, const ArrayStyle *style, const void *array,
+                 size_t element_size, size_t len, void (*print_element)(FILE *, void *)) {
+    int type = array_type(print_element, element_size);
+    int compact = style -> flags & LOGGER_ARRAY_COMPACT;
+    ArrayStream stream = {NULL, NULL, 0};
+    if (type == ARRAY_OTHER && len) {
+        stream.file = open_memstream(&stream.data, &stream.len);
+        if (!stream.file) {
+            return -1;
+        }
+    }
+
+    // print [0, head) and [len - tail, len), with a count of what is between
+    size_t head = len, tail = 0;
+    if ((style -> head || style -> tail) && style -> head + style -> tail < len) {
+        head = style -> head;
+        tail = style -> tail;
+    }
+    const char *elements = array;
+    int failed = compact ? buffer_append(buffer, " [", 2) : 0;
+    for (size_t i = 0; i < head && !failed; i++) {
+        failed = array_prefix(buffer, compact, i == 0, i) ||
+                 array_element(buffer, type, elements + i * element_size, print_element, &stream);
+    }
+    if (head + tail < len && !failed) {
+        failed = buffer_append_str(buffer, compact ? (head ? ", ... (" : "... (") : "\n... (") ||
+                 buffer_append_int(buffer, len - head - tail) ||
+                 buffer_append(buffer, " more)", 6);
+    }
+    for (size_t i = len - tail; i < len && !failed; i++) {
+        failed = array_prefix(buffer, compact, 0, i) ||
+                 array_element(buffer, type, elements + i * element_size, print_element, &stream);
+    }
+    if (compact && !failed) {
+        failed = buffer_append(buffer, "]", 1);
+    }
+    if (style -> flags & LOGGER_ARRAY_STATS && !failed) {
+        failed = array_stats(buffer, compact, type, elements, len);
+    }
+
+    if (stream.file) {
+        fclose(stream.file);
+        free(stream.data);
+    }
+    return failed ? -1 : 0;
+}
+
+
+static int array_type(ArrayPrinter print_element, size_t element_size) {
+    if (print_element == (ArrayPrinter)__logger_print_c__ && element_size == sizeof(char)) {
+        return ARRAY_CHAR;
+    }
+    if (print_element == (ArrayPrinter)__logger_print_i__ && element_size == sizeof(int)) {
+        return ARRAY_INT;
+    }
+    if (print_element == (ArrayPrinter)__logger_print_f__ && element_size == sizeof(double)) {
+        return ARRAY_DOUBLE;
+    }
+    if (print_element == (ArrayPrinter)__logger_print_s__ && element_size == sizeof(char *)) {
+        return ARRAY_STRING;
+    }
+    if (print_element == (ArrayPrinter)__logger_print_p__ && element_size == sizeof(void *)) {
+        return ARRAY_POINTER;
+    }
+    return ARRAY_OTHER;
+}
+
+
+static int array_element(LogBuffer *buffer, int type, const char *element,
+                         ArrayPrinter print_element, ArrayStream *stream) {
+    switch (type) {
+        case ARRAY_CHAR:
+            return buffer_append(buffer, element, 1);
+        case ARRAY_INT: {
+            int value;
+            memcpy(&value, element, sizeof(value));
+            return buffer_append_int(buffer, value);
+        }
+        case ARRAY_DOUBLE: {
+            double value;
+            memcpy(&value, element, sizeof(value));
+            return buffer_append_double(buffer, value);
+        }
+        case ARRAY_STRING: {
+            const char *value;
+            memcpy(&value, element, sizeof(value));
+            return buffer_append_str(buffer, value);
+        }
+        case ARRAY_POINTER: {
+            const void *value;
+            memcpy(&value, element, sizeof(value));
+            return array_pointer(buffer, value);
+        }
+    }
+
+    // the printer's own trailing newline is dropped, the layout adds its own
+    long start = ftell(stream -> file);
+    print_element(stream -> file, (void *)element);
+    if (start < 0 || fflush(stream -> file) != 0) {
+        return -1;
+    }
+    size_t len = stream -> len - start;
+    if (len && stream -> data[start + len - 1] == '\n') {
+        len--;
+    }
+    return buffer_append(buffer, stream -> data + start, len);
+}
+
+
+/* "\niN: " per line, or ", " between compact elements */
+static int array_prefix(LogBuffer *buffer, int compact, int first, size_t index) {
+    if (compact) {
+        return first ? 0 : buffer_append(buffer, ", ", 2);
+    }
+    return buffer_append(buffer, "\ni", 2) ||
+           buffer_append_int(buffer, index) ||
+           buffer_append(buffer, ": ", 2);
+}
+
+
+/* Like %p: 0x and lowercase hex, (nil) for NULL */
+static int array_pointer(LogBuffer *buffer, const void *pointer) {
+    uintptr_t value = (uintptr_t)pointer;
+    if (!value) {
+        return buffer_append(buffer, "(nil)", 5);
+    }
+    char digits[2 + sizeof(uintptr_t) * 2];
+    char *p = digits + sizeof(digits);
+    while (value) {
+        *--p = "0123456789abcdef"[value & 15];
+        value >>= 4;
+    }
+    *--p = 'x';
+    *--p = '0';
+    return buffer_append(buffer, p, digits + sizeof(digits) - p);
+}
+
+
+/* min, max and mean over every element, skipped ones included (NaNs are left out) */
+static int array_stats(LogBuffer *buffer, int compact, int type, const char *array, size_t len) {
+    if (type != ARRAY_INT && type != ARRAY_DOUBLE) {
+        return 0;
+    }
+    double min = 0, max = 0, sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        double value;
+        if (type == ARRAY_INT) {
+            int v;
+            memcpy(&v, array + i * sizeof(int), sizeof(v));
+            value = v;
+        } else {
+            memcpy(&value, array + i * sizeof(double), sizeof(value));
+            if (value != value) {
+                continue;
+            }
+        }
+        if (!count || value < min) {
+            min = value;
+        }
+        if (!count || value > max) {
+            max = value;
+        }
+        sum += value;
+        count++;
+    }
+    if (!count) {
+        return 0;
+    }
+    return buffer_append_str(buffer, compact ? " (min: " : "\nmin: ") ||
+           buffer_append_double(buffer, min) ||
+           buffer_append(buffer, ", max: ", 7) ||
+           buffer_append_double(buffer, max) ||
+           buffer_append(buffer, ", mean: ", 8) ||
+           buffer_append_double(buffer, sum / count) ||
+           (compact ? buffer_append(buffer, ")", 1) : 0);
+}
@@ -0,0 +1,437 @@
+#define _POSIX_C_SOURCE 200809L
+#include "async.h"
+#include "binlog.h"
+#include "message.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASYNC_DEFAULT_CAPACITY 4096
+#define ASYNC_INLINE_MSG       192 // longer messages go to the heap
+#define ASYNC_BATCH_SIZE       (64 * 1024) // write the batch once it is this big
+#define ASYNC_IDLE_WAIT_NS     (100 * 1000000L)
+
+/* A slot is free for position p when sequence == p
+ * and holds the record of position p when sequence == p + 1 */
+typedef struct AsyncSlot {
+    atomic_size_t sequence;
+    const char *fname;
+    int line;
+    log_level_t level;
+    struct timespec time;
+    size_t msg_len;
+    char *heap_msg;
+    LOGGER_FIELD *fields; // one block with the keys and strings after the array
+    size_t field_count;
+    unsigned char raw;
+    unsigned char forced;
+    void *site; // of a raw record, marked written once the batch is out
+    const char *ref;
+    char msg[ASYNC_INLINE_MSG];
+} AsyncSlot;
+
+struct AsyncQueue {
+    _Alignas(64) atomic_size_t head; // next position claimed by a producer
+    _Alignas(64) atomic_size_t tail; // next position read by the writer
+    atomic_size_t written; // every position below reached the file
+    atomic_size_t dropped;
+    atomic_int sleeping; // writer found the queue empty
+    atomic_int stop;
+    AsyncSlot *slots;
+    size_t mask;
+    int overflow;
+    log_level_t keep_level;
+    lgimp_t *logger;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // the writer waits on it for records
+    pthread_cond_t done; // flushers wait on it for written
+};
+
+/* What a record needs once the caller returns, copied before a slot is
+ * claimed so running out of memory drops the record instead of cutting it */
+typedef struct AsyncCopy {
+    const char *msg; // the caller's or msg below, heap_msg if set
+    size_t msg_len;
+    char *heap_msg;
+    LOGGER_FIELD *fields;
+    size_t field_count;
+    char msg_copy[ASYNC_INLINE_MSG];
+} AsyncCopy;
+
+static void *async_writer(void *arg);
+static int async_ready(AsyncQueue *queue);
+static void async_wake(AsyncQueue *queue);
+static void async_sleep(AsyncQueue *queue);
+static void async_write(AsyncQueue *queue, const LoggerConfig *config,
+                        LogBuffer *batches, GatherList *gathers, LogBuffer *sites, size_t position);
+static int async_copy(const LogRecord *record, AsyncCopy *copy);
+static int async_copy_fields(const LogRecord *record, AsyncCopy *copy);
+static void async_fill(AsyncSlot *slot, const LogRecord *record, const AsyncCopy *copy);
+
+
+AsyncQueue *async_start(lgimp_t *logger, size_t capacity, int overflow, log_level_t keep_level) {
+    size_t size = 1;
+    if (!capacity) {
+        capacity = ASYNC_DEFAULT_CAPACITY;
+    }
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    size_t queue_size = (sizeof(AsyncQueue) + 63) / 64 * 64;
+    AsyncQueue *queue = aligned_alloc(64, queue_size);
+    if (!queue) {
+        return NULL;
+    }
+    memset(queue, 0, sizeof(AsyncQueue));
+    queue -> slots = malloc(size * sizeof(AsyncSlot));
+    if (!queue -> slots) {
+        free(queue);
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue -> slots[i].sequence, i);
+    }
+    queue -> mask = size - 1;
+    queue -> overflow = overflow;
+    queue -> keep_level = keep_level;
+    queue -> logger = logger;
+    pthread_mutex_init(&queue -> lock, NULL);
+    pthread_cond_init(&queue -> wake, NULL);
+    pthread_cond_init(&queue -> done, NULL);
+
+    if (pthread_create(&queue -> thread, NULL, async_writer, queue) != 0) {
+        pthread_mutex_destroy(&queue -> lock);
+        pthread_cond_destroy(&queue -> wake);
+        pthread_cond_destroy(&queue -> done);
+        free(queue -> slots);
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+
+int async_push(AsyncQueue *queue, LogRecord *record) {
+    AsyncCopy copy;
+    if (async_copy(record, &copy) < 0) {
+        atomic_fetch_add_explicit(&queue -> dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    size_t position = atomic_load_explicit(&queue -> head, memory_order_relaxed);
+    AsyncSlot *slot;
+    for (;;) {
+        slot = &queue -> slots[position & queue -> mask];
+        size_t sequence = atomic_load_explicit(&slot -> sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue -> head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // full, the writer is a whole lap behind
+            if (queue -> overflow == LOGGER_DROP_NEWEST ||
+                (queue -> overflow == LOGGER_DROP_BELOW && record -> level < queue -> keep_level)) {
+                atomic_fetch_add_explicit(&queue -> dropped, 1, memory_order_relaxed);
+                free(copy.heap_msg);
+                free(copy.fields);
+                return -1;
+            }
+            async_wake(queue);
+            sched_yield();
+            position = atomic_load_explicit(&queue -> head, memory_order_relaxed);
+        } else {
+            position = atomic_load_explicit(&queue -> head, memory_order_relaxed);
+        }
+    }
+
+    async_fill(slot, record, &copy);
+    atomic_store_explicit(&slot -> sequence, position + 1, memory_order_release);
+
+    // pairs with the store to sleeping in async_sleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue -> sleeping, memory_order_relaxed)) {
+        async_wake(queue);
+    }
+    return 0;
+}
+
+
+void async_flush(AsyncQueue *queue) {
+    size_t target = atomic_load(&queue -> head);
+    pthread_mutex_lock(&queue -> lock);
+    while (atomic_load(&queue -> written) < target) {
+        pthread_cond_signal(&queue -> wake);
+        pthread_cond_wait(&queue -> done, &queue -> lock);
+    }
+    pthread_mutex_unlock(&queue -> lock);
+}
+
+
+void async_stop(AsyncQueue *queue) {
+    atomic_store(&queue -> stop, 1);
+    async_wake(queue);
+    pthread_join(queue -> thread, NULL);
+
+    pthread_mutex_destroy(&queue -> lock);
+    pthread_cond_destroy(&queue -> wake);
+    pthread_cond_destroy(&queue -> done);
+    free(queue -> slots);
+    free(queue);
+}
+
+
+/* Drain the queue in batches until it is empty and asked to stop
+ * A batch is rendered and written under one read of the config,
+ * each sink gets its own part of it */
+static void *async_writer(void *arg) {
+    AsyncQueue *queue = arg;
+    LogBuffer batches[LOGGER_MAX_SINKS] = {{0}};
+    GatherList gathers[LOGGER_MAX_SINKS] = {{0}};
+    LogBuffer scratch = {0};
+    LogBuffer sites = {0}; // binary call sites whose 'D' entry is in batches[0]
+    size_t position = atomic_load_explicit(&queue -> tail, memory_order_relaxed);
+    for (size_t i = 0; i < LOGGER_MAX_SINKS; i++) {
+        gathers[i].batch = 1;
+    }
+
+    for (;;) {
+        size_t start = position;
+        size_t pending = 0;
+        unsigned token = 0;
+        const LoggerConfig *config = logger_read_lock(queue -> logger, &token);
+        for (;;) {
+            AsyncSlot *slot = &queue -> slots[position & queue -> mask];
+            size_t sequence = atomic_load_explicit(&slot -> sequence, memory_order_acquire);
+            if (sequence != position + 1) {
+                break;
+            }
+
+            LogRecord record = {
+                slot -> fname, slot -> line, slot -> level, slot -> time,
+                slot -> heap_msg ? slot -> heap_msg : slot -> msg, NULL, slot -> msg_len, slot -> raw,
+                slot -> fields, slot -> field_count, slot -> forced, slot -> site, slot -> ref
+            };
+            if (record.raw) {
+                buffer_append(&batches[0], record.msg, record.msg_len);
+                if (record.site) {
+                    buffer_append(&sites, (const char *)&record.site, sizeof(void *));
+                }
+                pending += record.msg_len;
+            } else {
+                pending += logger_dispatch(queue -> logger, config, &record, 0, &scratch, batches, gathers);
+            }
+            free(slot -> heap_msg);
+            free(slot -> fields);
+
+            // hand the slot back for the next lap
+            atomic_store_explicit(&slot -> sequence, position + queue -> mask + 1,
+                                  memory_order_release);
+            position++;
+            atomic_store_explicit(&queue -> tail, position, memory_order_release);
+            if (pending >= ASYNC_BATCH_SIZE) {
+                break;
+            }
+        }
+
+        if (position != start) {
+            async_write(queue, config, batches, gathers, &sites, position);
+            logger_read_unlock(queue -> logger, token);
+            continue;
+        }
+        logger_read_unlock(queue -> logger, token);
+        if (atomic_load(&queue -> stop)) {
+            break;
+        }
+        async_sleep(queue);
+    }
+    for (size_t i = 0; i < LOGGER_MAX_SINKS; i++) {
+        free(batches[i].data);
+        free(gathers[i].pieces);
+    }
+    free(scratch.data);
+    free(sites.data);
+    return NULL;
+}
+
+
+static int async_ready(AsyncQueue *queue) {
+    size_t position = atomic_load_explicit(&queue -> tail, memory_order_relaxed);
+    AsyncSlot *slot = &queue -> slots[position & queue -> mask];
+    return atomic_load_explicit(&slot -> sequence, memory_order_acquire) == position + 1;
+}
+
+
+static void async_wake(AsyncQueue *queue) {
+    pthread_mutex_lock(&queue -> lock);
+    pthread_cond_signal(&queue -> wake);
+    pthread_mutex_unlock(&queue -> lock);
+}
+
+
+static void async_sleep(AsyncQueue *queue) {
+    pthread_mutex_lock(&queue -> lock);
+    atomic_store(&queue -> sleeping, 1);
+    if (!async_ready(queue) && !atomic_load(&queue -> stop)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ASYNC_IDLE_WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&queue -> wake, &queue -> lock, &deadline);
+    }
+    atomic_store(&queue -> sleeping, 0);
+    pthread_mutex_unlock(&queue -> lock);
+}
+
+
+/* One write per sink for the whole batch (one writev per IOV_MAX pieces
+ * for sinks taking them), then let flushers know
+ * The binary call sites of the batch are written once the sink took it,
+ * if it failed their next record carries the 'D' entry again */
+static void async_write(AsyncQueue *queue, const LoggerConfig *config,
+                        LogBuffer *batches, GatherList *gathers, LogBuffer *sites, size_t position) {
+    LoggerOutput output;
+    for (size_t i = 0; logger_output(queue -> logger, config, i, &output) == 0; i++) {
+        if (gathers[i].count) {
+            logger_write_gather(queue -> logger, output.sink, &gathers[i], &batches[i]);
+        } else if (batches[i].len &&
+                   logger_write(queue -> logger, output.sink, batches[i].data, batches[i].len) == 0 && !i) {
+            for (size_t j = 0; j + sizeof(void *) <= sites -> len; j += sizeof(void *)) {
+                void *site;
+                memcpy(&site, sites -> data + j, sizeof(void *));
+                binlog_written(site);
+            }
+        }
+        if (!i) {
+            buffer_clear(sites);
+        }
+        output.sink -> ops -> flush(output.sink);
+        buffer_clear(&batches[i]);
+        gather_clear(&gathers[i]);
+    }
+
+    pthread_mutex_lock(&queue -> lock);
+    atomic_store(&queue -> written, position);
+    pthread_cond_broadcast(&queue -> done);
+    pthread_mutex_unlock(&queue -> lock);
+}
+
+
+/* The message can't wait for the writer: its arguments only live during the call
+ * Return 0 or -1 if memory ran out, nothing is kept then */
+static int async_copy(const LogRecord *record, AsyncCopy *copy) {
+    copy -> heap_msg = NULL;
+    if (record -> args) {
+        LogBuffer *text = buffer_thread_message();
+        size_t start = text -> len;
+        va_list args;
+        va_copy(args, *record -> args);
+        int failed = message_vprintf(text, record -> msg, args);
+        va_end(args);
+        size_t len = text -> len - start;
+        if (!failed && len >= ASYNC_INLINE_MSG) {
+            copy -> heap_msg = malloc(len + 1);
+            if (copy -> heap_msg) {
+                memcpy(copy -> heap_msg, text -> data + start, len);
+                copy -> heap_msg[len] = '\0';
+            }
+        } else if (!failed) {
+            memcpy(copy -> msg_copy, text -> data + start, len);
+            copy -> msg_copy[len] = '\0';
+        }
+        text -> len = start;
+        if (failed || (len >= ASYNC_INLINE_MSG && !copy -> heap_msg)) {
+            return -1;
+        }
+        copy -> msg = copy -> heap_msg ? copy -> heap_msg : copy -> msg_copy;
+        copy -> msg_len = len;
+    } else {
+        copy -> msg = record -> msg;
+        copy -> msg_len = record -> msg_len;
+        if (record -> msg_len >= ASYNC_INLINE_MSG) {
+            copy -> heap_msg = malloc(record -> msg_len);
+            if (!copy -> heap_msg) {
+                return -1;
+            }
+            memcpy(copy -> heap_msg, record -> msg, record -> msg_len);
+            copy -> msg = copy -> heap_msg;
+        }
+    }
+    if (async_copy_fields(record, copy) < 0) {
+        free(copy -> heap_msg);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Copy the fields with what their keys and strings point to
+ * Return 0 or -1 if memory ran out */
+static int async_copy_fields(const LogRecord *record, AsyncCopy *copy) {
+    copy -> fields = NULL;
+    copy -> field_count = 0;
+    if (!record -> field_count) {
+        return 0;
+    }
+    size_t count = record -> field_count;
+    size_t size = count * sizeof(LOGGER_FIELD);
+    for (size_t i = 0; i < count; i++) {
+        const LOGGER_FIELD *field = &record -> fields[i];
+        size += field -> key ? strlen(field -> key) + 1 : 0;
+        if (field -> type == LOGGER_FIELD_STRING && field -> value.s) {
+            size += strlen(field -> value.s) + 1;
+        }
+    }
+    LOGGER_FIELD *fields = malloc(size);
+    if (!fields) {
+        return -1;
+    }
+    memcpy(fields, record -> fields, count * sizeof(LOGGER_FIELD));
+    char *strings = (char *)(fields + count);
+    for (size_t i = 0; i < count; i++) {
+        if (fields[i].key) {
+            size_t len = strlen(fields[i].key) + 1;
+            fields[i].key = memcpy(strings, fields[i].key, len);
+            strings += len;
+        }
+        if (fields[i].type == LOGGER_FIELD_STRING && fields[i].value.s) {
+            size_t len = strlen(fields[i].value.s) + 1;
+            fields[i].value.s = memcpy(strings, fields[i].value.s, len);
+            strings += len;
+        }
+    }
+    copy -> fields = fields;
+    copy -> field_count = count;
+    return 0;
+}
+
+
+/* The slot takes over what was copied, short messages go in the slot itself */
+static void async_fill(AsyncSlot *slot, const LogRecord *record, const AsyncCopy *copy) {
+    slot -> fname = record -> fname;
+    slot -> line = record -> line;
+    slot -> level = record -> level;
+    slot -> time = record -> time;
+    slot -> raw = record -> raw;
+    slot -> site = record -> site;
+    slot -> ref = record -> ref;
+    slot -> forced = record -> forced;
+    slot -> heap_msg = copy -> heap_msg;
+    if (!copy -> heap_msg) {
+        memcpy(slot -> msg, copy -> msg, copy -> msg_len);
+        if (copy -> msg_len < ASYNC_INLINE_MSG) {
+            slot -> msg[copy -> msg_len] = '\0';
+        }
+    }
+    slot -> msg_len = copy -> msg_len;
+    slot -> fields = copy -> fields;
+    slot -> field_count = copy -> field_count;
+}
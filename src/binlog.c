@@ -0,0 +1,646 @@
+#include "binlog.h"
+#include "message.h"
+#include "structured.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BINLOG_TABLE_SIZE 4096 // call sites per stream, power of 2
+#define BINLOG_MAX_PROBES 32   // a site not found in that many slots is written as text
+#define BINLOG_MAX_ARGS   32
+
+enum BINLOG_ARG {
+    ARG_INT, ARG_LONG, ARG_LLONG, ARG_INTMAX, ARG_SIZE, ARG_PTRDIFF,
+    ARG_DOUBLE, ARG_LDOUBLE, ARG_STRING, ARG_POINTER,
+    ARG_NONE // %%
+};
+
+enum BINLOG_LENGTH {
+    LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIG_L
+};
+
+/* A slot is free while msg is NULL, the thread that claims it fills
+ * the rest and moves it to SITE_KNOWN, SITE_WRITTEN once the 'D' entry is out */
+enum SITE_STATE {
+    SITE_CLAIMED, SITE_KNOWN, SITE_WRITTEN
+};
+
+typedef struct BinarySite {
+    _Atomic(const char *) msg;
+    atomic_uchar state;
+    unsigned char deferred; // msg only uses specifiers we can encode
+    unsigned char nargs;
+    const char *fname;
+    int line;
+    unsigned char args[BINLOG_MAX_ARGS];
+    int precision[BINLOG_MAX_ARGS]; // of %s: -1 none, -2 star
+} BinarySite;
+
+struct BinaryLog {
+    BinarySite sites[BINLOG_TABLE_SIZE];
+};
+
+/* A parsed printf specifier */
+typedef struct BinarySpec {
+    const char *flags;
+    size_t flags_len;
+    int width; // -1 none, -2 star
+    int precision; // -1 none, -2 star
+    unsigned char length;
+    unsigned char kind;
+    char conversion;
+} BinarySpec;
+
+static const char *binlog_spec(const char *p, BinarySpec *spec);
+static int binlog_signature(BinarySite *site, const char *msg);
+static BinarySite *binlog_site(BinaryLog *log, const LogRecord *record);
+static int binlog_args(const BinarySite *site, va_list args, LogBuffer *buffer);
+static int binlog_text(LogRecord *record, LogBuffer *buffer);
+static int binlog_put_string(LogBuffer *buffer, const char *s, size_t len);
+static int binlog_put_site(LogBuffer *buffer, const BinaryLog *log, const BinarySite *site);
+static int binlog_format(const char *msg, const char *args, size_t len, LogBuffer *text);
+static int binlog_read(FILE *in, void *p, size_t len);
+static int binlog_read_string(FILE *in, char **s, size_t *len);
+
+
+BinaryLog *binlog_create(void) {
+    return calloc(1, sizeof(BinaryLog));
+}
+
+
+void binlog_free(BinaryLog *log) {
+    free(log);
+}
+
+
+int binlog_header(const LoggerConfig *config, LogBuffer *buffer) {
+    const char *format = config -> format ? config -> format -> source : "";
+    const char *ref = config -> ref ? config -> ref : "";
+    char head[2] = { 'H', BINLOG_VERSION };
+    return buffer_append(buffer, head, 2) ||
+           binlog_put_string(buffer, format, strlen(format)) ||
+           binlog_put_string(buffer, ref, strlen(ref)) ? -1 : 0;
+}
+
+
+void *binlog_record(BinaryLog *log, LogRecord *record, LogBuffer *buffer) {
+    BinarySite *site = record -> args ? binlog_site(log, record) : NULL;
+    if (!site || !site -> deferred) {
+        binlog_text(record, buffer);
+        return NULL;
+    }
+
+    uint32_t id = site - log -> sites;
+    int dictionary = atomic_load_explicit(&site -> state, memory_order_acquire) != SITE_WRITTEN;
+    // may be written twice by racing threads, the decoder doesn't mind
+    if (dictionary && binlog_put_site(buffer, log, site)) {
+        return NULL;
+    }
+
+    unsigned char level = record -> level;
+    int64_t sec = record -> time.tv_sec;
+    uint32_t nsec = record -> time.tv_nsec;
+    uint32_t args_len = 0;
+    if (buffer_append(buffer, "R", 1) ||
+        buffer_append(buffer, (char *)&id, 4) ||
+        buffer_append(buffer, (char *)&level, 1) ||
+        buffer_append(buffer, (char *)&sec, 8) ||
+        buffer_append(buffer, (char *)&nsec, 4) ||
+        buffer_append(buffer, (char *)&args_len, 4)) {
+        return NULL;
+    }
+    size_t start = buffer -> len;
+    va_list copy;
+    va_copy(copy, *record -> args);
+    binlog_args(site, copy, buffer);
+    va_end(copy);
+    args_len = buffer -> len - start;
+    memcpy(buffer -> data + start - 4, &args_len, 4);
+    return dictionary ? site : NULL;
+}
+
+
+void binlog_written(void *site) {
+    atomic_store_explicit(&((BinarySite *)site) -> state, SITE_WRITTEN, memory_order_release);
+}
+
+
+int binlog_dictionary(const BinaryLog *log, LogBuffer *buffer) {
+    for (size_t i = 0; i < BINLOG_TABLE_SIZE; i++) {
+        const BinarySite *site = &log -> sites[i];
+        // a site still being claimed gets its entry with its first record
+        if (atomic_load_explicit(&site -> state, memory_order_acquire) != SITE_CLAIMED &&
+            site -> deferred && binlog_put_site(buffer, log, site)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+long binlog_decode(FILE *in, FILE *out) {
+    struct {
+        char *fname;
+        char *msg;
+        int line;
+    } *sites = calloc(BINLOG_TABLE_SIZE, sizeof(*sites));
+    if (!sites) {
+        return -1;
+    }
+
+    LoggerConfig config = {0};
+    char *ref = NULL;
+    LogBuffer text = {0}, args = {0}, output = {0};
+    long records = 0;
+    int tag;
+
+    while ((tag = fgetc(in)) != EOF) {
+        LogRecord record = {0};
+        unsigned char level = 0, version = 0;
+        int64_t sec = 0;
+        uint32_t nsec = 0, id = 0, args_len = 0;
+        int32_t line = 0;
+        char *fname = NULL, *s = NULL;
+        size_t len = 0;
+        buffer_clear(&text);
+
+        switch (tag) {
+            case 'H': {
+                char *format = NULL;
+                if (binlog_read(in, &version, 1) || version != BINLOG_VERSION ||
+                    binlog_read_string(in, &format, &len) ||
+                    binlog_read_string(in, &s, &len)) {
+                    free(format);
+                    goto corrupt;
+                }
+                FormatProgram *program = format_compile(format);
+                free(format);
+                format_free(config.format);
+                free(ref);
+                config.format = program;
+                config.ref = ref = s;
+                continue;
+            }
+            case 'D':
+                if (binlog_read(in, &id, 4) || id >= BINLOG_TABLE_SIZE ||
+                    binlog_read(in, &line, 4) ||
+                    binlog_read_string(in, &fname, &len) ||
+                    binlog_read_string(in, &s, &len)) {
+                    free(fname);
+                    goto corrupt;
+                }
+                free(sites[id].fname);
+                free(sites[id].msg);
+                sites[id].fname = fname;
+                sites[id].msg = s;
+                sites[id].line = line;
+                continue;
+            case 'R':
+                if (binlog_read(in, &id, 4) || id >= BINLOG_TABLE_SIZE ||
+                    binlog_read(in, &level, 1) ||
+                    binlog_read(in, &sec, 8) ||
+                    binlog_read(in, &nsec, 4) ||
+                    binlog_read(in, &args_len, 4)) {
+                    goto corrupt;
+                }
+                buffer_clear(&args);
+                if (buffer_reserve(&args, args_len) < 0 || binlog_read(in, args.data, args_len)) {
+                    goto corrupt;
+                }
+                if (!sites[id].msg) {
+                    // its 'D' entry is not in this stream (a file cut out of a longer
+                    // log), the arguments can't be read without it
+                    buffer_printf(&text, "<call site %u is not described in this log, %u bytes of arguments>",
+                                  (unsigned)id, (unsigned)args_len);
+                    record.fname = "?";
+                    break;
+                }
+                binlog_format(sites[id].msg, args.data, args_len, &text);
+                record.fname = sites[id].fname;
+                record.line = sites[id].line;
+                break;
+            case 'T':
+                if (binlog_read(in, &level, 1) ||
+                    binlog_read(in, &sec, 8) ||
+                    binlog_read(in, &nsec, 4) ||
+                    binlog_read(in, &line, 4) ||
+                    binlog_read_string(in, &fname, &len) ||
+                    binlog_read_string(in, &s, &len)) {
+                    free(fname);
+                    goto corrupt;
+                }
+                buffer_append(&text, s, len);
+                free(s);
+                record.fname = fname;
+                record.line = line;
+                break;
+            default:
+                goto corrupt;
+        }
+
+        record.level = level;
+        record.time.tv_sec = sec;
+        record.time.tv_nsec = nsec;
+        record.msg = text.data ? text.data : "";
+        record.msg_len = text.len;
+        if (config.format) {
+            logger_render(&config, &record, &output);
+        } else {
+            // no header yet, at least keep the message
+            buffer_append(&output, record.msg, record.msg_len);
+            buffer_append(&output, "\n", 1);
+        }
+        fwrite(output.data, 1, output.len, out);
+        buffer_clear(&output);
+        free(fname);
+        records++;
+    }
+    goto done;
+
+corrupt:
+    records = -1;
+done:
+    for (size_t i = 0; i < BINLOG_TABLE_SIZE; i++) {
+        free(sites[i].fname);
+        free(sites[i].msg);
+    }
+    free(sites);
+    free(ref);
+    format_free(config.format);
+    free(text.data);
+    free(args.data);
+    free(output.data);
+    return records;
+}
+
+
+/* Parse the specifier after a '%', return where it ends
+ * or NULL if it is not one we know how to encode */
+static const char *binlog_spec(const char *p, BinarySpec *spec) {
+    spec -> flags = p;
+    while (*p && strchr("-+ #0", *p)) p++;
+    spec -> flags_len = p - spec -> flags;
+
+    spec -> width = -1;
+    if (*p == '*') {
+        spec -> width = -2;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        spec -> width = 0;
+        while (*p >= '0' && *p <= '9') spec -> width = spec -> width * 10 + (*p++ - '0');
+    }
+
+    spec -> precision = -1;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec -> precision = -2;
+            p++;
+        } else {
+            spec -> precision = 0;
+            while (*p >= '0' && *p <= '9') spec -> precision = spec -> precision * 10 + (*p++ - '0');
+        }
+    }
+
+    spec -> length = LEN_NONE;
+    switch (*p) {
+        case 'h': spec -> length = p[1] == 'h' ? LEN_HH : LEN_H; p += p[1] == 'h' ? 2 : 1; break;
+        case 'l': spec -> length = p[1] == 'l' ? LEN_LL : LEN_L; p += p[1] == 'l' ? 2 : 1; break;
+        case 'j': spec -> length = LEN_J; p++; break;
+        case 'z': spec -> length = LEN_Z; p++; break;
+        case 't': spec -> length = LEN_T; p++; break;
+        case 'L': spec -> length = LEN_BIG_L; p++; break;
+    }
+
+    static const unsigned char integer_kinds[] = {
+        ARG_INT, ARG_INT, ARG_INT, ARG_LONG, ARG_LLONG, ARG_INTMAX, ARG_SIZE, ARG_PTRDIFF
+    };
+    spec -> conversion = *p;
+    switch (*p) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            if (spec -> length == LEN_BIG_L) return NULL;
+            spec -> kind = integer_kinds[spec -> length];
+            break;
+        case 'c':
+            if (spec -> length != LEN_NONE) return NULL;
+            spec -> kind = ARG_INT;
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            if (spec -> length == LEN_BIG_L) spec -> kind = ARG_LDOUBLE;
+            else if (spec -> length == LEN_NONE || spec -> length == LEN_L) spec -> kind = ARG_DOUBLE;
+            else return NULL;
+            break;
+        case 's':
+            if (spec -> length != LEN_NONE) return NULL;
+            spec -> kind = ARG_STRING;
+            break;
+        case 'p':
+            if (spec -> length != LEN_NONE) return NULL;
+            spec -> kind = ARG_POINTER;
+            break;
+        case '%':
+            spec -> kind = ARG_NONE;
+            break;
+        default:
+            return NULL; // %n, positional arguments, wide strings...
+    }
+    return p + 1;
+}
+
+
+/* The argument kinds of msg in order, -1 if it can't be deferred */
+static int binlog_signature(BinarySite *site, const char *msg) {
+    unsigned n = 0;
+    const char *p = msg;
+    while (*p) {
+        if (*p++ != '%') continue;
+        BinarySpec spec;
+        p = binlog_spec(p, &spec);
+        if (!p) return -1;
+        if (spec.kind == ARG_NONE) continue;
+        if (n + (spec.width == -2) + (spec.precision == -2) + 1 > BINLOG_MAX_ARGS) return -1;
+        if (spec.width == -2) {
+            site -> precision[n] = -1;
+            site -> args[n++] = ARG_INT;
+        }
+        if (spec.precision == -2) {
+            site -> precision[n] = -1;
+            site -> args[n++] = ARG_INT;
+        }
+        site -> precision[n] = spec.precision;
+        site -> args[n++] = spec.kind;
+    }
+    site -> nargs = n;
+    return 0;
+}
+
+
+/* Find or claim the slot of the record's call site, NULL if the table is full */
+static BinarySite *binlog_site(BinaryLog *log, const LogRecord *record) {
+    uintptr_t hash = (uintptr_t)record -> msg ^ ((uintptr_t)record -> fname >> 4) ^
+                     (uintptr_t)record -> line * 0x9E3779B1u;
+    size_t index = (hash ^ hash >> 12) & (BINLOG_TABLE_SIZE - 1);
+
+    for (int probe = 0; probe < BINLOG_MAX_PROBES; probe++) {
+        BinarySite *site = &log -> sites[index];
+        const char *key = atomic_load_explicit(&site -> msg, memory_order_acquire);
+        if (!key) {
+            if (atomic_compare_exchange_strong(&site -> msg, &key, record -> msg)) {
+                site -> fname = record -> fname;
+                site -> line = record -> line;
+                site -> deferred = binlog_signature(site, record -> msg) == 0;
+                atomic_store_explicit(&site -> state, SITE_KNOWN, memory_order_release);
+                return site;
+            }
+        }
+        if (key == record -> msg) {
+            // the claiming thread is only a few stores away from done
+            while (atomic_load_explicit(&site -> state, memory_order_acquire) == SITE_CLAIMED) {
+                sched_yield();
+            }
+            if (site -> fname == record -> fname && site -> line == record -> line) {
+                return site;
+            }
+        }
+        index = (index + 1) & (BINLOG_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+
+/* The 'D' entry of a call site */
+static int binlog_put_site(LogBuffer *buffer, const BinaryLog *log, const BinarySite *site) {
+    uint32_t id = site - log -> sites;
+    int32_t line = site -> line;
+    const char *msg = atomic_load_explicit(&site -> msg, memory_order_relaxed);
+    return buffer_append(buffer, "D", 1) ||
+           buffer_append(buffer, (char *)&id, 4) ||
+           buffer_append(buffer, (char *)&line, 4) ||
+           binlog_put_string(buffer, site -> fname, strlen(site -> fname)) ||
+           binlog_put_string(buffer, msg, strlen(msg)) ? -1 : 0;
+}
+
+
+/* Copy the raw argument bytes, strings included */
+static int binlog_args(const BinarySite *site, va_list args, LogBuffer *buffer) {
+    int failed = 0;
+    int last_int = -1;
+    for (unsigned i = 0; i < site -> nargs && !failed; i++) {
+        long long wide = 0;
+        switch (site -> args[i]) {
+            case ARG_INT: {
+                int value = va_arg(args, int);
+                last_int = value;
+                failed = buffer_append(buffer, (char *)&value, sizeof(value));
+                continue;
+            }
+            case ARG_LONG: wide = va_arg(args, long); break;
+            case ARG_LLONG: wide = va_arg(args, long long); break;
+            case ARG_INTMAX: wide = va_arg(args, intmax_t); break;
+            case ARG_SIZE: wide = va_arg(args, size_t); break;
+            case ARG_PTRDIFF: wide = va_arg(args, ptrdiff_t); break;
+            case ARG_DOUBLE: {
+                double value = va_arg(args, double);
+                failed = buffer_append(buffer, (char *)&value, sizeof(value));
+                continue;
+            }
+            case ARG_LDOUBLE: {
+                long double value = va_arg(args, long double);
+                failed = buffer_append(buffer, (char *)&value, sizeof(value));
+                continue;
+            }
+            case ARG_POINTER: wide = (uintptr_t)va_arg(args, void *); break;
+            case ARG_STRING: {
+                const char *s = va_arg(args, const char *);
+                int precision = site -> precision[i];
+                if (precision == -2) {
+                    precision = last_int;
+                }
+                if (!s) {
+                    uint32_t none = UINT32_MAX;
+                    failed = buffer_append(buffer, (char *)&none, 4);
+                    continue;
+                }
+                size_t len = precision < 0 ? strlen(s) : strnlen(s, precision);
+                failed = binlog_put_string(buffer, s, len);
+                continue;
+            }
+        }
+        failed = buffer_append(buffer, (char *)&wide, sizeof(wide));
+    }
+    return failed ? -1 : 0;
+}
+
+
+/* The 'T' entry: format now, on the caller's thread */
+static int binlog_text(LogRecord *record, LogBuffer *buffer) {
+    unsigned char level = record -> level;
+    int64_t sec = record -> time.tv_sec;
+    uint32_t nsec = record -> time.tv_nsec;
+    int32_t line = record -> line;
+    uint32_t len = 0;
+    const char *fname = record -> fname ? record -> fname : "";
+    if (buffer_append(buffer, "T", 1) ||
+        buffer_append(buffer, (char *)&level, 1) ||
+        buffer_append(buffer, (char *)&sec, 8) ||
+        buffer_append(buffer, (char *)&nsec, 4) ||
+        buffer_append(buffer, (char *)&line, 4) ||
+        binlog_put_string(buffer, fname, strlen(fname)) ||
+        buffer_append(buffer, (char *)&len, 4)) {
+        return -1;
+    }
+    size_t start = buffer -> len;
+    if (record -> args) {
+        va_list copy;
+        va_copy(copy, *record -> args);
+        int failed = message_vprintf(buffer, record -> msg, copy);
+        va_end(copy);
+        if (failed) return -1;
+    } else if (buffer_append(buffer, record -> msg, record -> msg_len)) {
+        return -1;
+    }
+    if (structured_fields(buffer, LOGGER_TEXT, record -> fields, record -> field_count, 0)) {
+        return -1;
+    }
+    len = buffer -> len - start;
+    memcpy(buffer -> data + start - 4, &len, 4);
+    return 0;
+}
+
+
+static int binlog_put_string(LogBuffer *buffer, const char *s, size_t len) {
+    uint32_t n = len;
+    return buffer_append(buffer, (char *)&n, 4) || buffer_append(buffer, s, len) ? -1 : 0;
+}
+
+
+#define BINLOG_TAKE(var) \
+    if (len - used < sizeof(var)) goto truncated; \
+    memcpy(&var, args + used, sizeof(var)); \
+    used += sizeof(var)
+
+/* printf msg with the encoded arguments, one specifier at a time */
+static int binlog_format(const char *msg, const char *args, size_t len, LogBuffer *text) {
+    size_t used = 0;
+    const char *p = msg;
+    while (*p) {
+        const char *literal = p;
+        while (*p && *p != '%') p++;
+        buffer_append(text, literal, p - literal);
+        if (!*p) break;
+
+        BinarySpec spec;
+        const char *end = binlog_spec(p + 1, &spec);
+        if (!end) {
+            // was written as text on the logging side, never reached
+            return buffer_append_str(text, p);
+        }
+        p = end;
+        if (spec.kind == ARG_NONE) {
+            buffer_append(text, "%", 1);
+            continue;
+        }
+
+        int width = spec.width, precision = spec.precision;
+        if (width == -2) {
+            BINLOG_TAKE(width);
+        }
+        if (precision == -2) {
+            BINLOG_TAKE(precision);
+        }
+        uint32_t n = 0;
+        if (spec.kind == ARG_STRING) {
+            BINLOG_TAKE(n);
+            if (n != UINT32_MAX) {
+                if (len - used < n) goto truncated;
+                precision = n; // the copied bytes aren't terminated
+            }
+        }
+
+        // rebuild the specifier without stars, 8 byte integers all as ll
+        static const char *modifiers[] = { "", "hh", "h", "l", "ll", "j", "z", "t", "L" };
+        const char *modifier = modifiers[spec.length];
+        if (spec.kind >= ARG_LONG && spec.kind <= ARG_PTRDIFF) {
+            modifier = "ll";
+        }
+        char format[64];
+        int at = snprintf(format, sizeof(format), "%%%.*s%s", (int)spec.flags_len, spec.flags,
+                          spec.width != -1 && width < 0 ? "-" : "");
+        if (spec.width != -1) {
+            at += snprintf(format + at, sizeof(format) - at, "%d", width < 0 ? -width : width);
+        }
+        if (precision >= 0) {
+            at += snprintf(format + at, sizeof(format) - at, ".%d", precision);
+        }
+        snprintf(format + at, sizeof(format) - at, "%s%c", modifier, spec.conversion);
+
+        switch (spec.kind) {
+            case ARG_INT: {
+                int value;
+                BINLOG_TAKE(value);
+                buffer_printf(text, format, value);
+                break;
+            }
+            case ARG_DOUBLE: {
+                double value;
+                BINLOG_TAKE(value);
+                buffer_printf(text, format, value);
+                break;
+            }
+            case ARG_LDOUBLE: {
+                long double value;
+                BINLOG_TAKE(value);
+                buffer_printf(text, format, value);
+                break;
+            }
+            case ARG_POINTER: {
+                long long value;
+                BINLOG_TAKE(value);
+                buffer_printf(text, format, (void *)(uintptr_t)value);
+                break;
+            }
+            case ARG_STRING:
+                buffer_printf(text, format, n == UINT32_MAX ? NULL : args + used);
+                used += n == UINT32_MAX ? 0 : n;
+                break;
+            default: {
+                long long value;
+                BINLOG_TAKE(value);
+                buffer_printf(text, format, value);
+                break;
+            }
+        }
+    }
+    return 0;
+
+truncated:
+    return buffer_append_str(text, "<truncated>");
+}
+
+
+static int binlog_read(FILE *in, void *p, size_t len) {
+    return fread(p, 1, len, in) == len ? 0 : -1;
+}
+
+
+static int binlog_read_string(FILE *in, char **s, size_t *len) {
+    uint32_t n;
+    if (binlog_read(in, &n, 4)) {
+        return -1;
+    }
+    *s = malloc((size_t)n + 1);
+    if (!*s) {
+        return -1;
+    }
+    if (binlog_read(in, *s, n)) {
+        free(*s);
+        *s = NULL;
+        return -1;
+    }
+    (*s)[n] = '\0';
+    *len = n;
+    return 0;
+}
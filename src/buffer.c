@@ -0,0 +1,215 @@
+#include "buffer.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_INITIAL_SIZE 256
+#define BUFFER_KEEP_SIZE    (64 * 1024) // larger buffers are freed after use
+#define BUFFER_EXACT_DIGITS 15 // fraction digits tried before falling back to printf
+
+/* "00" to "99", numbers are converted two digits at a time */
+static const char BUFFER_DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const double BUFFER_POWERS[BUFFER_EXACT_DIGITS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+static _Thread_local LogBuffer thread_buffers[2]; // the record, a message formatted ahead of it
+static _Thread_local int thread_buffer_registered;
+static pthread_key_t thread_buffer_key;
+static pthread_once_t thread_buffer_once = PTHREAD_ONCE_INIT;
+
+static void buffer_thread_exit(void *buffer);
+static void buffer_key_create(void);
+
+
+LogBuffer *buffer_thread_local(void) {
+    if (!thread_buffer_registered) {
+        // only used to get a destructor called at thread exit
+        pthread_once(&thread_buffer_once, buffer_key_create);
+        pthread_setspecific(thread_buffer_key, thread_buffers);
+        thread_buffer_registered = 1;
+    }
+    return &thread_buffers[0];
+}
+
+
+LogBuffer *buffer_thread_message(void) {
+    return buffer_thread_local() + 1;
+}
+
+
+int buffer_reserve(LogBuffer *buffer, size_t extra) {
+    if (buffer -> cap - buffer -> len > extra) {
+        return 0; // always keep a byte for the terminating '\0'
+    }
+    size_t cap = buffer -> cap ? buffer -> cap : BUFFER_INITIAL_SIZE;
+    while (cap - buffer -> len <= extra) {
+        cap *= 2;
+    }
+    char *data = realloc(buffer -> data, cap);
+    if (!data) {
+        return -1;
+    }
+    buffer -> data = data;
+    buffer -> cap = cap;
+    return 0;
+}
+
+
+int buffer_append(LogBuffer *buffer, const char *s, size_t len) {
+    if (buffer_reserve(buffer, len) < 0) {
+        return -1;
+    }
+    memcpy(buffer -> data + buffer -> len, s, len);
+    buffer -> len += len;
+    return 0;
+}
+
+
+int buffer_append_str(LogBuffer *buffer, const char *s) {
+    if (!s) {
+        s = "(null)";
+    }
+    return buffer_append(buffer, s, strlen(s));
+}
+
+
+int buffer_append_int(LogBuffer *buffer, long long value) {
+    char digits[24];
+    unsigned long long u = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    char *p = buffer_digits(digits + sizeof(digits), u);
+    *--p = '-';
+    p += value >= 0; // drop the sign without a branch
+    return buffer_append(buffer, p, digits + sizeof(digits) - p);
+}
+
+
+/* Fixed notation with the fewest fraction digits that read back as value
+ * (value * 10^d is an integer n and n / 10^d is value again, both exact
+ * in doubles), values it can't handle go through %.15g to %.17g */
+int buffer_append_double(LogBuffer *buffer, double value) {
+    if (isfinite(value) && fabs(value) < 9007199254740992.0) {
+        for (int d = 0; d <= BUFFER_EXACT_DIGITS; d++) {
+            double scaled = value * BUFFER_POWERS[d];
+            if (fabs(scaled) >= 9007199254740992.0) {
+                break; // integers past 2^53 aren't exact anymore
+            }
+            long long n = (long long)scaled;
+            if ((double)n != scaled || (double)n / BUFFER_POWERS[d] != value) {
+                continue;
+            }
+            unsigned long long u = n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+            unsigned long long scale = (unsigned long long)BUFFER_POWERS[d];
+            char digits[48];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            if (d) {
+                p = buffer_digits(p, u % scale);
+                while (end - p < d) {
+                    *--p = '0';
+                }
+                *--p = '.';
+            }
+            p = buffer_digits(p, u / scale);
+            if (signbit(value)) {
+                *--p = '-';
+            }
+            return buffer_append(buffer, p, end - p);
+        }
+    }
+    char text[32];
+    for (int precision = 15; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*g", precision, value);
+        if (precision == 17 || strtod(text, NULL) == value || value != value) {
+            break;
+        }
+    }
+    return buffer_append_str(buffer, text);
+}
+
+
+int buffer_append_padded(LogBuffer *buffer, unsigned long long value, int width) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+        width--;
+    } while (value || width > 0);
+    return buffer_append(buffer, p, digits + sizeof(digits) - p);
+}
+
+
+int buffer_vprintf(LogBuffer *buffer, const char *format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    size_t room = buffer -> cap - buffer -> len;
+    int n = vsnprintf(room ? buffer -> data + buffer -> len : NULL, room, format, copy);
+    va_end(copy);
+    if (n < 0) {
+        return -1;
+    }
+    if ((size_t)n >= room) {
+        if (buffer_reserve(buffer, n) < 0) {
+            return -1;
+        }
+        vsnprintf(buffer -> data + buffer -> len, n + 1, format, args);
+    }
+    buffer -> len += n;
+    return 0;
+}
+
+
+int buffer_printf(LogBuffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int failed = buffer_vprintf(buffer, format, args);
+    va_end(args);
+    return failed;
+}
+
+
+void buffer_clear(LogBuffer *buffer) {
+    buffer -> len = 0;
+    if (buffer -> cap > BUFFER_KEEP_SIZE) {
+        free(buffer -> data);
+        buffer -> data = NULL;
+        buffer -> cap = 0;
+    }
+}
+
+
+char *buffer_digits(char *end, unsigned long long value) {
+    while (value >= 100) {
+        unsigned pair = (unsigned)(value % 100) * 2;
+        value /= 100;
+        *--end = BUFFER_DIGIT_PAIRS[pair + 1];
+        *--end = BUFFER_DIGIT_PAIRS[pair];
+    }
+    if (value >= 10) {
+        unsigned pair = (unsigned)value * 2;
+        *--end = BUFFER_DIGIT_PAIRS[pair + 1];
+        *--end = BUFFER_DIGIT_PAIRS[pair];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+
+static void buffer_thread_exit(void *buffers) {
+    free(((LogBuffer *)buffers)[0].data);
+    free(((LogBuffer *)buffers)[1].data);
+}
+
+
+static void buffer_key_create(void) {
+    pthread_key_create(&thread_buffer_key, buffer_thread_exit);
+}
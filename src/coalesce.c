@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L
+#include "coalesce.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define COALESCE_FNV_OFFSET 14695981039346656037ULL
+#define COALESCE_FNV_PRIME  1099511628211ULL
+
+static unsigned long long coalesce_hash(const LogRecord *record);
+static unsigned long long coalesce_bytes(unsigned long long hash, const void *data, size_t len);
+static void *coalesce_timer(void *arg);
+
+
+Coalesce *coalesce_create(lgimp_t *logger, long timeout_ms) {
+    Coalesce *coalesce = calloc(1, sizeof(Coalesce));
+    if (!coalesce) {
+        return NULL;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // since is monotonic
+    pthread_cond_init(&coalesce -> wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&coalesce -> lock, NULL);
+    coalesce -> logger = logger;
+    coalesce -> timeout = timeout_ms > 0 ? timeout_ms * 1000000LL : 0;
+    if (coalesce -> timeout) {
+        if (pthread_create(&coalesce -> timer, NULL, coalesce_timer, coalesce) != 0) {
+            pthread_mutex_destroy(&coalesce -> lock);
+            pthread_cond_destroy(&coalesce -> wake);
+            free(coalesce);
+            return NULL;
+        }
+        coalesce -> timed = 1;
+    }
+    return coalesce;
+}
+
+
+void coalesce_free(Coalesce *coalesce) {
+    if (!coalesce) {
+        return;
+    }
+    if (coalesce -> timed) {
+        pthread_mutex_lock(&coalesce -> lock);
+        coalesce -> stop = 1;
+        pthread_cond_signal(&coalesce -> wake);
+        pthread_mutex_unlock(&coalesce -> lock);
+        pthread_join(coalesce -> timer, NULL);
+    }
+    pthread_mutex_destroy(&coalesce -> lock);
+    pthread_cond_destroy(&coalesce -> wake);
+    free(coalesce);
+}
+
+
+int coalesce_check(Coalesce *coalesce, const LogRecord *record, CoalesceRun *run) {
+    run -> repeats = 0;
+    unsigned long long hash = coalesce_hash(record);
+    if (hash != coalesce -> hash || record -> line != coalesce -> line ||
+        record -> level != coalesce -> level || record -> fname != coalesce -> fname) {
+        coalesce_end(coalesce, run);
+        coalesce -> hash = hash;
+        coalesce -> fname = record -> fname;
+        coalesce -> line = record -> line;
+        coalesce -> level = record -> level;
+        return 0;
+    }
+
+    struct timespec now = {0, 0};
+    if (coalesce -> timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    if (!coalesce -> repeats++) {
+        coalesce -> since = now;
+        if (coalesce -> timed) {
+            pthread_cond_signal(&coalesce -> wake);
+        }
+    } else if (coalesce -> timeout &&
+               (now.tv_sec - coalesce -> since.tv_sec) * 1000000000LL +
+               (now.tv_nsec - coalesce -> since.tv_nsec) >= coalesce -> timeout) {
+        // a storm that goes on still shows up now and then
+        coalesce_end(coalesce, run);
+    }
+    return 1;
+}
+
+
+void coalesce_end(Coalesce *coalesce, CoalesceRun *run) {
+    run -> fname = coalesce -> fname;
+    run -> line = coalesce -> line;
+    run -> level = coalesce -> level;
+    run -> repeats = coalesce -> repeats;
+    coalesce -> repeats = 0;
+}
+
+
+int coalesce_expired(const Coalesce *coalesce) {
+    struct timespec now;
+    if (!coalesce -> repeats || !coalesce -> timeout) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - coalesce -> since.tv_sec) * 1000000000LL +
+           (now.tv_nsec - coalesce -> since.tv_nsec) >= coalesce -> timeout;
+}
+
+
+/* Sleep until the run in progress is timeout old, then have the logger
+ * write its note (under the logger's read lock, taken before ours) */
+static void *coalesce_timer(void *arg) {
+    Coalesce *coalesce = arg;
+    pthread_mutex_lock(&coalesce -> lock);
+    while (!coalesce -> stop) {
+        if (!coalesce -> repeats) {
+            pthread_cond_wait(&coalesce -> wake, &coalesce -> lock);
+            continue;
+        }
+        if (!coalesce_expired(coalesce)) {
+            struct timespec due = coalesce -> since;
+            due.tv_sec += coalesce -> timeout / 1000000000LL;
+            due.tv_nsec += coalesce -> timeout % 1000000000LL;
+            if (due.tv_nsec >= 1000000000L) {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&coalesce -> wake, &coalesce -> lock, &due);
+            continue;
+        }
+        pthread_mutex_unlock(&coalesce -> lock);
+        logger_coalesce_expire(coalesce -> logger, coalesce);
+        pthread_mutex_lock(&coalesce -> lock);
+    }
+    pthread_mutex_unlock(&coalesce -> lock);
+    return NULL;
+}
+
+
+/* FNV-1a of the message and fields, the call site is compared as is */
+static unsigned long long coalesce_hash(const LogRecord *record) {
+    unsigned long long hash = coalesce_bytes(COALESCE_FNV_OFFSET, record -> msg, record -> msg_len);
+    for (size_t i = 0; i < record -> field_count; i++) {
+        const LOGGER_FIELD *field = &record -> fields[i];
+        if (field -> key) {
+            hash = coalesce_bytes(hash, field -> key, strlen(field -> key) + 1);
+        }
+        hash = coalesce_bytes(hash, &field -> type, sizeof(field -> type));
+        switch (field -> type) {
+            case LOGGER_FIELD_INT:
+                hash = coalesce_bytes(hash, &field -> value.i, sizeof(field -> value.i));
+                break;
+            case LOGGER_FIELD_DOUBLE:
+                hash = coalesce_bytes(hash, &field -> value.d, sizeof(field -> value.d));
+                break;
+            case LOGGER_FIELD_STRING:
+                if (field -> value.s) {
+                    hash = coalesce_bytes(hash, field -> value.s, strlen(field -> value.s) + 1);
+                }
+                break;
+            case LOGGER_FIELD_BOOL:
+                hash = coalesce_bytes(hash, &field -> value.b, sizeof(field -> value.b));
+                break;
+        }
+    }
+    return hash | 1; // never 0, the hash of nothing logged yet
+}
+
+
+static unsigned long long coalesce_bytes(unsigned long long hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * COALESCE_FNV_PRIME;
+    }
+    return hash;
+}
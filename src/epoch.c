@@ -0,0 +1,39 @@
+#include "epoch.h"
+#include <sched.h>
+
+static atomic_uint epoch_next_shard;
+static _Thread_local unsigned epoch_thread_shard = EPOCH_SHARDS;
+
+static void epoch_wait(EpochGuard *guard, unsigned epoch);
+
+
+unsigned epoch_shard(void) {
+    if (epoch_thread_shard == EPOCH_SHARDS) {
+        epoch_thread_shard = atomic_fetch_add(&epoch_next_shard, 1) % EPOCH_SHARDS;
+    }
+    return epoch_thread_shard;
+}
+
+
+/* A reader may have read the epoch just before a flip and counted itself
+ * after the wait, so flip and wait twice like SRCU does */
+void epoch_synchronize(EpochGuard *guard) {
+    for (int i = 0; i < 2; i++) {
+        unsigned epoch = atomic_fetch_add(&guard -> epoch, 1) & 1;
+        epoch_wait(guard, epoch);
+    }
+}
+
+
+static void epoch_wait(EpochGuard *guard, unsigned epoch) {
+    for (;;) {
+        long readers = 0;
+        for (int i = 0; i < EPOCH_SHARDS; i++) {
+            readers += atomic_load(&guard -> shards[i].readers[epoch]);
+        }
+        if (!readers) {
+            return;
+        }
+        sched_yield();
+    }
+}
@@ -0,0 +1,134 @@
+#include "format.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* indexed by opcode */
+static const char *FORMAT_LABELS[] = {
+    "REF", "LEVEL", "DATE", "TIME", "FILENAME", "LINE", "MSG",
+    "MSEC", "USEC", "ISO8601", "EPOCHNS", "FIELDS",
+    "PRI", "HOSTNAME", "PID"
+};
+
+static int format_label_code(const char *s, size_t len);
+static int format_scan(const char *s, FormatProgram *program, char *pool,
+                       size_t *nops, size_t *pool_len);
+
+
+/* Compile s into a flat program, literal runs (escapes included) are merged */
+FormatProgram *format_compile(const char *s) {
+    if (!s) return NULL;
+
+    size_t nops = 0, pool_len = 0;
+    if (format_scan(s, NULL, NULL, &nops, &pool_len) < 0) {
+        return NULL;
+    }
+
+    size_t source_len = strlen(s);
+    FormatProgram *program = malloc(sizeof(FormatProgram) + nops * sizeof(FormatOp) +
+                                    pool_len + 1 + source_len + 1);
+    if (!program) return NULL;
+    char *pool = (char *)(program -> ops + nops);
+    format_scan(s, program, pool, &nops, &pool_len);
+    pool[pool_len] = '\0';
+    program -> source = pool + pool_len + 1;
+    memcpy(pool + pool_len + 1, s, source_len + 1);
+    program -> count = nops;
+    program -> flags = 0;
+    for (size_t i = 0; i < nops; i++) {
+        switch (program -> ops[i].code) {
+            case OP_DATE:
+            case OP_TIME:
+                program -> flags |= FORMAT_USES_TIME;
+                break;
+            case OP_MSEC:
+            case OP_USEC:
+            case OP_ISO8601:
+            case OP_EPOCHNS:
+                program -> flags |= FORMAT_USES_TIME | FORMAT_USES_SUBSEC;
+                break;
+            case OP_FIELDS:
+                program -> flags |= FORMAT_USES_FIELDS;
+                break;
+        }
+    }
+    return program;
+}
+
+
+void format_free(FormatProgram *program) {
+    free(program);
+}
+
+
+static int format_label_code(const char *s, size_t len) {
+    size_t i;
+    for (i = 0; i < sizeof(FORMAT_LABELS)/sizeof(FORMAT_LABELS[0]); i++) {
+        if (strlen(FORMAT_LABELS[i]) == len && strncmp(s, FORMAT_LABELS[i], len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Walk the format once, only counting when program is NULL,
+ * otherwise filling the ops and the literal pool */
+static int format_scan(const char *s, FormatProgram *program, char *pool,
+                       size_t *nops, size_t *pool_len) {
+    const char *format = s;
+    size_t op = 0, used = 0;
+    int in_literal = 0;
+
+    while (*s) {
+        if (*s == '[') {
+            const char *sp = ++s;
+            while (*s && *s != ']') s++;
+            if (!*s) {
+                fprintf(stderr, "liblogger: unterminated label in format \"%s\"\n", format);
+                return -1;
+            }
+            int code = format_label_code(sp, s - sp);
+            if (code < 0) {
+                fprintf(stderr, "liblogger: unknown label [%.*s] in format \"%s\"\n",
+                        (int)(s - sp), sp, format);
+                return -1;
+            }
+            if (program) {
+                program -> ops[op].string = NULL;
+                program -> ops[op].len = 0;
+                program -> ops[op].code = code;
+            }
+            op++;
+            in_literal = 0;
+            s++;
+            continue;
+        }
+
+        char c = *s;
+        if (*s == '/' && (*(s + 1) == '[' || *(s + 1) == ']')) {
+            c = *(s + 1);
+            s++;
+        }
+        s++;
+
+        if (!in_literal) {
+            if (program) {
+                program -> ops[op].string = pool + used;
+                program -> ops[op].len = 0;
+                program -> ops[op].code = OP_LITERAL;
+            }
+            op++;
+            in_literal = 1;
+        }
+        if (program) {
+            pool[used] = c;
+            program -> ops[op - 1].len++;
+        }
+        used++;
+    }
+
+    *nops = op;
+    *pool_len = used;
+    return 0;
+}
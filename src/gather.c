@@ -0,0 +1,127 @@
+#include "gather.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define GATHER_INITIAL_SIZE 32
+#define GATHER_KEEP_SIZE    4096 // longer lists are freed after use
+
+static _Thread_local GatherList thread_gather;
+static _Thread_local int thread_gather_registered;
+static pthread_key_t thread_gather_key;
+static pthread_once_t thread_gather_once = PTHREAD_ONCE_INIT;
+
+static int gather_grow(GatherList *gather);
+static void gather_thread_exit(void *gather);
+static void gather_key_create(void);
+
+
+GatherList *gather_thread_local(void) {
+    if (!thread_gather_registered) {
+        pthread_once(&thread_gather_once, gather_key_create);
+        pthread_setspecific(thread_gather_key, &thread_gather);
+        thread_gather_registered = 1;
+    }
+    return &thread_gather;
+}
+
+
+int gather_text(GatherList *gather, LogBuffer *buffer, const char *s, size_t len) {
+    if (len < GATHER_MIN_TEXT) {
+        return buffer_append(buffer, s, len);
+    }
+    if (gather_close(gather, buffer) < 0 || gather_grow(gather) < 0) {
+        return -1;
+    }
+    GatherPiece *piece = &gather -> pieces[gather -> count++];
+    piece -> base = s;
+    piece -> offset = 0;
+    piece -> len = len;
+    gather -> bytes += len;
+    return 0;
+}
+
+
+int gather_close(GatherList *gather, const LogBuffer *buffer) {
+    size_t len = buffer -> len - gather -> mark;
+    if (!len) {
+        return 0;
+    }
+    GatherPiece *last = gather -> count ? &gather -> pieces[gather -> count - 1] : NULL;
+    if (last && !last -> base && last -> offset + last -> len == gather -> mark) {
+        last -> len += len; // only copied text in between
+    } else {
+        if (gather_grow(gather) < 0) {
+            return -1;
+        }
+        GatherPiece *piece = &gather -> pieces[gather -> count++];
+        piece -> base = NULL;
+        piece -> offset = gather -> mark;
+        piece -> len = len;
+    }
+    gather -> mark = buffer -> len;
+    gather -> bytes += len;
+    return 0;
+}
+
+
+int gather_write(GatherList *gather, const LogBuffer *buffer, LOGGER_SINK *sink) {
+    if (gather_close(gather, buffer) < 0) {
+        return -1;
+    }
+    struct iovec iov[gather -> count < IOV_MAX ? gather -> count + 1 : IOV_MAX];
+    int failed = 0;
+    for (size_t i = 0; i < gather -> count; ) {
+        int count = 0;
+        for (; i < gather -> count && count < IOV_MAX; i++, count++) {
+            const GatherPiece *piece = &gather -> pieces[i];
+            iov[count].iov_base = (void *)(piece -> base ? piece -> base : buffer -> data + piece -> offset);
+            iov[count].iov_len = piece -> len;
+        }
+        failed |= sink -> ops -> writev(sink, iov, count);
+    }
+    return failed ? -1 : 0;
+}
+
+
+void gather_clear(GatherList *gather) {
+    gather -> count = 0;
+    gather -> mark = 0;
+    gather -> bytes = 0;
+    if (gather -> cap > GATHER_KEEP_SIZE) {
+        free(gather -> pieces);
+        gather -> pieces = NULL;
+        gather -> cap = 0;
+    }
+}
+
+
+/* Room for one more piece */
+static int gather_grow(GatherList *gather) {
+    if (gather -> count < gather -> cap) {
+        return 0;
+    }
+    size_t cap = gather -> cap ? gather -> cap * 2 : GATHER_INITIAL_SIZE;
+    GatherPiece *pieces = realloc(gather -> pieces, cap * sizeof(GatherPiece));
+    if (!pieces) {
+        return -1;
+    }
+    gather -> pieces = pieces;
+    gather -> cap = cap;
+    return 0;
+}
+
+
+static void gather_thread_exit(void *gather) {
+    free(((GatherList *)gather) -> pieces);
+}
+
+
+static void gather_key_create(void) {
+    pthread_key_create(&thread_gather_key, gather_thread_exit);
+}
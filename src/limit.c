@@ -0,0 +1,62 @@
+#define _POSIX_C_SOURCE 200809L
+#include "logger.h"
+#include <time.h>
+
+#define LIMIT_SECOND 1000000000ULL
+
+static int limit_rate(LOGGER_LIMIT *limit, unsigned long long *suppressed);
+
+
+int __logger_limit__(LOGGER_LIMIT *limit, unsigned long long *suppressed) {
+    *suppressed = 0;
+    if (!limit -> n) {
+        return 0;
+    }
+    switch (limit -> kind) {
+        case LOGGER_LIMIT_EVERY:
+            return __atomic_fetch_add(&limit -> state, 1, __ATOMIC_RELAXED) % limit -> n == 0;
+        case LOGGER_LIMIT_FIRST:
+            // once silent, stay read-only so the site's line isn't bounced between cores
+            if (__atomic_load_n(&limit -> state, __ATOMIC_RELAXED) >= limit -> n) {
+                return 0;
+            }
+            return __atomic_fetch_add(&limit -> state, 1, __ATOMIC_RELAXED) < limit -> n;
+        case LOGGER_LIMIT_RATE:
+            return limit_rate(limit, suppressed);
+    }
+    return 1;
+}
+
+
+void __logger_suppressed__(const char *fname, int line,
+                           const LOGGER *logger, const log_level_t level,
+                           unsigned long long count) {
+    __logger_msg__(fname, line, logger, level, "suppressed %llu messages", count);
+}
+
+
+/* Token bucket kept as the time the bucket is full again (GCRA):
+ * each call moves it a 1/n second later, and can't push it more than
+ * a second past now, one compare and swap decides */
+static int limit_rate(LOGGER_LIMIT *limit, unsigned long long *suppressed) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = (unsigned long long)ts.tv_sec * LIMIT_SECOND + ts.tv_nsec;
+    unsigned long long step = LIMIT_SECOND / limit -> n;
+    unsigned long long full = __atomic_load_n(&limit -> state, __ATOMIC_RELAXED);
+    for (;;) {
+        unsigned long long base = full > now ? full : now;
+        if (base + step - now > LIMIT_SECOND) {
+            __atomic_fetch_add(&limit -> suppressed, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(&limit -> state, &full, base + step, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (__atomic_load_n(&limit -> suppressed, __ATOMIC_RELAXED)) {
+        *suppressed = __atomic_exchange_n(&limit -> suppressed, 0, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
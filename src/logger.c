@@ -1,14 +1,31 @@
-#include "linked_list.h"
+#include "array.h"
+#include "async.h"
+#include "binlog.h"
+#include "buffer.h"
+#include "coalesce.h"
+#include "format.h"
+#include "gather.h"
 #include "logger.h"
+#include "logger_imp.h"
+#include "message.h"
+#include "recorder.h"
+#include "sink.h"
+#include "stats.h"
+#include "structured.h"
+#include "timestamp.h"
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <time.h>
+#include <unistd.h>
 
 /* BAD CODE ALLERT :skull: */
 
+_Static_assert(offsetof(lgimp_t, level) == 0 && sizeof(((lgimp_t *)0) -> level) == 1,
+               "the macros read the level through struct LOGGER_HEAD");
+
 #define LOGGER_DEFAULT_TRACE   "\033[0;37m"  // Light Gray
 #define LOGGER_DEFAULT_DEBUG   "\033[0;34m"  // Blue
 #define LOGGER_DEFAULT_INFO    "\033[0;32m"  // Green
@@ -17,46 +34,156 @@
 #define LOGGER_DEFAULT_FATAL   "\033[1;31m"  // Bold Red
 #define LOGGER_RESET           "\033[0m"      // Reset Color
 
-static const char *LOGGER_LEVEL_COLORS[6] = {0};
+#define LOGGER_LABEL_SIZE      64 // color prefix is cut to fit
 
-struct LOGGER_IMP {
-    const char *ref;
-    FILE *file; // destination file
-    const Node *format; // printing format
-    unsigned char level; // lowest level to be print
-};
-typedef struct LOGGER_IMP lgimp_t;
+static const char *LOGGER_LEVEL_COLORS[FATAL + 1] = {0};
+
+/* Color changes are serialized by the lock, readers of the label table
+ * don't take it: they retry if the sequence was odd or moved (seqlock) */
+static pthread_mutex_t LOGGER_COLORS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint LOGGER_LABELS_SEQ;
 
+/* Rendered level labels, [colored][level], the last one is for unknown levels
+ * Rebuilt whenever a color changes so logging only has to copy them */
+typedef struct {
+    char string[LOGGER_LABEL_SIZE];
+    size_t len;
+} level_label_t;
 
-const char *LOGGER_INFO_LABELS[] = {
-    "REF", "LEVEL", "DATE", "TIME", "FILENAME", "LINE", "MSG"
+static const char *LOGGER_LEVEL_NAMES[OFF + 2] = {
+    "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL", "OFF", "UNKNOWN"
+};
+
+static level_label_t LOGGER_LEVEL_LABELS[2][OFF + 2] = {
+    {
+        {"TRACE", 5}, {"DEBUG", 5}, {"INFO", 4}, {"WARNING", 7},
+        {"ERROR", 5}, {"FATAL", 5}, {"OFF", 3}, {"UNKNOWN", 7}
+    },
+    {
+        {"TRACE", 5}, {"DEBUG", 5}, {"INFO", 4}, {"WARNING", 7},
+        {"ERROR", 5}, {"FATAL", 5}, {"OFF", 3}, {"UNKNOWN", 7}
+    }
 };
 
-enum LOGGER_INF_LABELS_ID {
-    REF, LEVEL, DATE, TIME, FILENAME, LINE, MSG
+/* Syslog severities for [PRI], with the user-level facility (1 * 8) */
+#define LOGGER_SYSLOG_FACILITY 8
+static const unsigned char LOGGER_SYSLOG_SEVERITIES[OFF + 2] = {
+    7, 7, 6, 4, 3, 2, 7, 7 // TRACE is debug too, FATAL is critical
 };
 
-static int logger_getID(const char*);
-static char *logger_level_to_string(const int level);
-static Node *logger_formatter(const char *s);
+/* [HOSTNAME] and [PID], read once (and the pid again in a forked child) */
+static pthread_once_t LOGGER_IDENTITY_ONCE = PTHREAD_ONCE_INIT;
+static char LOGGER_HOSTNAME[256];
+static size_t LOGGER_HOSTNAME_LEN;
+static atomic_int LOGGER_PID;
+
+#define LOGGER_MAX_CRASH_LOGGERS 16
+
+/* Loggers whose recorder the crash handler dumps, and where to */
+static struct {
+    _Atomic(lgimp_t *) logger;
+    int fd;
+} LOGGER_CRASH_LOGGERS[LOGGER_MAX_CRASH_LOGGERS];
+
+static const int LOGGER_CRASH_SIGNALS[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+static struct sigaction LOGGER_CRASH_PREVIOUS[sizeof(LOGGER_CRASH_SIGNALS) / sizeof(int)];
+static int LOGGER_CRASH_INSTALLED;
+static pthread_mutex_t LOGGER_CRASH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+static LoggerConfig *logger_config_copy(lgimp_t *logger);
+static void logger_config_abort(lgimp_t *logger, LoggerConfig *config);
+static void logger_config_publish(lgimp_t *logger, LoggerConfig *config);
+static int logger_binary_preamble(void *arg, LogBuffer *buffer);
+static int logger_set_sink(lgimp_t *logger, LOGGER_SINK *sink, int owned);
+static void logger_outputs_free(LoggerOutputs *outputs, const LoggerOutputs *keep);
+static void logger_gate_update(lgimp_t *logger, const LoggerConfig *config);
+static int logger_file_colored(FILE *file);
+static void logger_level_label_build(const int level);
+static size_t logger_level_label(const int level, const int colored, char *out);
+static int logger_render_program(const LoggerConfig *config, const FormatProgram *program,
+                                 const int colored, LogRecord *record, LogBuffer *buffer,
+                                 GatherList *gather);
+static int logger_render_text(LogBuffer *buffer, GatherList *gather,
+                              const char *s, size_t len, const int lasting);
+static size_t logger_gather(lgimp_t *logger, const LoggerConfig *config, const LoggerOutput *output,
+                            LogRecord *record, LogBuffer *buffer, GatherList *batch);
 static void logger_print_msg(const char *fname, const int line, 
                              const LOGGER *logger, const log_level_t level, 
-                             const char *msg, va_list args);
+                             const int forced, const char *msg, va_list args);
+static void logger_print_record(lgimp_t *logger, const LoggerConfig *config,
+                                unsigned token, LogRecord *record);
+static int logger_write_raw(lgimp_t *logger, const LoggerConfig *config,
+                            const char *data, size_t len, void *site);
+static void logger_print_binary(lgimp_t *logger, const LoggerConfig *config,
+                                LogRecord *record);
+static void logger_print_coalesced(lgimp_t *logger, const LoggerConfig *config,
+                                   unsigned token, LogRecord *record);
+static void logger_emit(lgimp_t *logger, const LoggerConfig *config, LogRecord *record);
+static void logger_emit_run(lgimp_t *logger, const LoggerConfig *config, const CoalesceRun *run);
+static void logger_coalesce_flush(lgimp_t *logger);
+static int logger_push(lgimp_t *logger, AsyncQueue *queue, LogRecord *record);
+static int logger_filtered(lgimp_t *logger, const log_level_t level);
+static int logger_recorded(lgimp_t *logger, const log_level_t level);
+static void logger_crash_handler(int sig);
+static void logger_identity_init(void);
+static void logger_identity_fork(void);
 
 
 /* Create a logger using the given parameters */
 LOGGER *logger_create(const char *ref, FILE *file, 
                       const char *format, const log_level_t level) {
-    lgimp_t *logger_imp = (lgimp_t*)malloc(sizeof(lgimp_t));
-    if (!logger_imp) {
+    // the guard's counters are cache line aligned
+    lgimp_t *logger_imp = (lgimp_t*)aligned_alloc(64, LOGGER_IMP_SIZE);
+    LOGGER_SINK *sink = sink_file(file);
+    if (!logger_imp || !sink) {
+        free(sink);
+        free(logger_imp);
+        return NULL;
+    }
+    if (!logger_init(logger_imp, ref, sink, 1, logger_file_colored(file), format, level)) {
+        logger_sink_close(sink);
+        free(logger_imp);
+        return NULL;
+    }
+    return (LOGGER*)logger_imp;
+}
+
+
+LOGGER *logger_init(void *memory, const char *ref, LOGGER_SINK *sink, const int owns_sink,
+                    const int colored, const char *format, const log_level_t level) {
+    lgimp_t *logger_imp = memory;
+    LoggerConfig *config = malloc(sizeof(LoggerConfig));
+    if (!config) {
         return NULL;
     }
 
-    logger_imp -> ref = ref;
-    logger_imp -> file = file;
-    Node *parsed_format = logger_formatter(format);
-    logger_imp -> format = parsed_format;
-    logger_imp -> level = level;
+    config -> ref = ref;
+    config -> sink = sink;
+    config -> owns_sink = owns_sink;
+    config -> colored = colored;
+    config -> mode = LOGGER_TEXT;
+    config -> binary = NULL;
+    config -> coalesce = NULL;
+    config -> recorder = NULL;
+    config -> extra = NULL;
+    config -> array.flags = LOGGER_ARRAY_LINES;
+    config -> array.head = 0;
+    config -> array.tail = 0;
+    config -> format = format_compile(format);
+    if (format && !config -> format) {
+        free(config);
+        return NULL;
+    }
+    memset(logger_imp, 0, sizeof(lgimp_t));
+    atomic_init(&logger_imp -> config, config);
+    atomic_init(&logger_imp -> level, level);
+    atomic_init(&logger_imp -> min_level, level);
+    atomic_init(&logger_imp -> record_level, OFF);
+    atomic_init(&logger_imp -> sink_level, level);
+    logger_imp -> threadsafe = 0;
+    atomic_init(&logger_imp -> async, NULL);
+    pthread_mutex_init(&logger_imp -> lock, NULL);
     return (LOGGER*)logger_imp;
 }
 
@@ -64,44 +191,134 @@ LOGGER *logger_create(const char *ref, FILE *file,
 /* Free allocated memory in the creation process and the logger itself */
 void logger_remove(LOGGER *logger) {
     lgimp_t *logger_imp = (lgimp_t*)logger;
-    linked_list_free(logger_imp -> format);
+    if (logger_imp -> pooled) {
+        fprintf(stderr, "liblogger: logger \"%s\" belongs to the registry, "
+                        "it is removed by logger_registry_clear\n",
+                atomic_load(&logger_imp -> config) -> ref);
+        return;
+    }
+    logger_destroy(logger_imp);
     free(logger_imp);
 }
 
 
+void logger_destroy(lgimp_t *logger_imp) {
+    LOGGER *logger = (LOGGER*)logger_imp;
+    logger_coalesce_flush(logger_imp);
+    logger_disable_async(logger);
+    for (size_t i = 0; i < LOGGER_MAX_CRASH_LOGGERS; i++) {
+        lgimp_t *expected = logger_imp;
+        atomic_compare_exchange_strong(&LOGGER_CRASH_LOGGERS[i].logger, &expected, NULL);
+    }
+    LoggerConfig *config = atomic_load(&logger_imp -> config);
+    if (config -> mode == LOGGER_BINARY) {
+        sink_rotating_preamble(config -> sink, NULL, NULL);
+    }
+    coalesce_free(config -> coalesce); // its timer may still read the config
+    format_free(config -> format);
+    binlog_free(config -> binary);
+    free(config -> recorder);
+    free(logger_imp -> stats_block);
+    logger_outputs_free(config -> extra, NULL);
+    if (config -> owns_sink) {
+        logger_sink_close(config -> sink);
+    }
+    free(config);
+    pthread_mutex_destroy(&logger_imp -> lock);
+}
+
+
 /* Print a log message */
 void __logger_msg__(const char *fname, const int line, 
     const LOGGER *logger, const log_level_t level, const char *msg, ...) {
     va_list args;
     va_start(args, msg);
-    logger_print_msg(fname, line, logger, level, msg, args);
+    logger_print_msg(fname, line, logger, level, 0, msg, args);
+}
+
+
+/* A message from a fixed level macro, a site switched on passes every level */
+void __logger_site_msg__(const LOGGER_SITE *site, const LOGGER *logger, const char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    int forced = ((const volatile LOGGER_SITE *)site) -> state == LOGGER_SITE_ON;
+    logger_print_msg(site -> file, site -> line, logger, site -> level, forced, msg, args);
 }
 
 
-/* Log an array */
+/* Log an array, the elements are part of the message */
 void __logger_log_array__(const char *fname, const int line, 
                           const LOGGER *logger, const log_level_t level, 
                           void *array, size_t element_size, size_t len,
                           void (*print_element)(FILE *, void *), const char *msg, ...) {
-    FILE *fp = ((lgimp_t *)logger) -> file;
+    lgimp_t *logger_imp = (lgimp_t *)logger;
+    if (logger_filtered(logger_imp, level) && !logger_recorded(logger_imp, level)) {
+        return;
+    }
+
     va_list args;
     va_start(args, msg);
-    logger_print_msg(fname, line, logger, level, msg, args);
+    LogBuffer text = {0};
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+    int failed = message_vprintf(&text, msg, args) ||
+                 array_render(&text, &config -> array, array, element_size, len, print_element);
+    va_end(args);
+    if (failed) {
+        logger_read_unlock(logger_imp, token);
+        free(text.data);
+        return;
+    }
+    LogRecord record = { fname, line, level, {0, 0}, text.data, NULL, text.len, 0, NULL, 0, 0, NULL, NULL };
+    logger_print_record(logger_imp, config, token, &record);
+    free(text.data);
+}
+
 
-    for (unsigned int i = 0; i < len; i++) {
-        fprintf(fp, "i%d: ", i);
-        print_element(fp, (char *)array);
-        array = (char *)array + element_size;
+/* Log a message rendered by the caller */
+void __logger_text__(const char *fname, int line,
+                     const LOGGER *logger, const log_level_t level,
+                     const char *text, size_t len) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    if (logger_filtered(logger_imp, level) && !logger_recorded(logger_imp, level)) {
+        return;
     }
+    LogRecord record = { fname, line, level, {0, 0}, text, NULL, len, 0, NULL, 0, 0, NULL, NULL };
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+    logger_print_record(logger_imp, config, token, &record);
 }
 
 
+/* Log a plain message with typed fields after it */
+void __logger_kv__(const char *fname, int line,
+                   const LOGGER *logger, const log_level_t level, const char *msg,
+                   const LOGGER_FIELD *fields, size_t count) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    if (logger_filtered(logger_imp, level) && !logger_recorded(logger_imp, level)) {
+        return;
+    }
+    if (!msg) {
+        msg = "";
+    }
+    LogRecord record = { fname, line, level, {0, 0}, msg, NULL, strlen(msg), 0, fields, count, 0, NULL, NULL };
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+    logger_print_record(logger_imp, config, token, &record);
+}
+
 void logger_change_ref(LOGGER *logger, const char *ref) {
     if (!ref) {
         return;
     }
     lgimp_t *logger_imp = (lgimp_t*)logger;
-    logger_imp -> ref = ref;
+    logger_flush(logger); // queued records keep the old config
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return;
+    }
+    config -> ref = ref;
+    logger_config_publish(logger_imp, config);
 }
 
 
@@ -109,8 +326,106 @@ void logger_change_file(LOGGER *logger, FILE *file) {
     if (!file) {
         return;
     }
+    LOGGER_SINK *sink = sink_file(file);
+    if (!sink) {
+        return;
+    }
+    if (logger_set_sink((lgimp_t*)logger, sink, 1) < 0) {
+        logger_sink_close(sink);
+    }
+}
+
+
+int logger_change_sink(LOGGER *logger, LOGGER_SINK *sink) {
+    if (!sink) {
+        return -1;
+    }
+    return logger_set_sink((lgimp_t*)logger, sink, 0);
+}
+
+
+LOGGER_SINK *logger_sink_file(FILE *file) {
+    return file ? sink_file(file) : NULL;
+}
+
+
+int logger_add_sink(LOGGER *logger, LOGGER_SINK *sink, const log_level_t level,
+                    const char *format, const int colored) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    if (!sink || level < TRACE || level > OFF) {
+        return -1;
+    }
+    FormatProgram *program = NULL;
+    if (format) {
+        program = format_compile(format);
+        if (!program) {
+            return -1;
+        }
+    }
+    logger_flush(logger);
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    size_t count = config && config -> extra ? config -> extra -> count : 0;
+    LoggerOutputs *extra = NULL;
+    if (config && count + 1 < LOGGER_MAX_SINKS) {
+        extra = malloc(sizeof(LoggerOutputs) + (count + 1) * sizeof(LoggerOutput));
+    }
+    if (!extra) {
+        format_free(program);
+        if (config) {
+            logger_config_abort(logger_imp, config);
+        }
+        return -1;
+    }
+    if (count) {
+        memcpy(extra -> outputs, config -> extra -> outputs, count * sizeof(LoggerOutput));
+    }
+    LoggerOutput *output = &extra -> outputs[count];
+    output -> sink = sink;
+    output -> format = program;
+    output -> colored = colored < 0 ? logger_file_colored(sink -> file) : colored != 0;
+    output -> level = level;
+    extra -> count = count + 1;
+    config -> extra = extra;
+    logger_config_publish(logger_imp, config);
+    return 0;
+}
+
+
+int logger_remove_sink(LOGGER *logger, LOGGER_SINK *sink) {
     lgimp_t *logger_imp = (lgimp_t*)logger;
-    logger_imp -> file = file;
+    logger_flush(logger);
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return -1;
+    }
+    size_t count = config -> extra ? config -> extra -> count : 0;
+    size_t found = count;
+    for (size_t i = 0; i < count && found == count; i++) {
+        if (config -> extra -> outputs[i].sink == sink) {
+            found = i;
+        }
+    }
+    if (found == count) {
+        logger_config_abort(logger_imp, config);
+        return -1;
+    }
+    LoggerOutputs *extra = NULL;
+    if (count > 1) {
+        extra = malloc(sizeof(LoggerOutputs) + (count - 1) * sizeof(LoggerOutput));
+        if (!extra) {
+            logger_config_abort(logger_imp, config);
+            return -1;
+        }
+        extra -> count = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (i != found) {
+                extra -> outputs[extra -> count++] = config -> extra -> outputs[i];
+            }
+        }
+    }
+    config -> extra = extra;
+    logger_config_publish(logger_imp, config);
+    return 0;
 }
 
 
@@ -119,9 +434,18 @@ void logger_change_format(LOGGER *logger, const char *format) {
         return;
     }
     lgimp_t *logger_imp = (lgimp_t*)logger;
-    linked_list_free((Node*)logger_imp -> format);
-    Node *parsed_format = logger_formatter(format);
-    logger_imp -> format = parsed_format;
+    FormatProgram *parsed_format = format_compile(format);
+    if (!parsed_format) {
+        return; // keep the old one, format_compile already reported why
+    }
+    logger_flush(logger);
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        format_free(parsed_format);
+        return;
+    }
+    config -> format = parsed_format;
+    logger_config_publish(logger_imp, config);
 }
 
 
@@ -130,11 +454,11 @@ void logger_change_level(LOGGER *logger, const int level) {
     if (level == -1) {
         return;
     }
-    if (level < TRACE || level > OFF) {
-        logger_imp -> level = OFF;
-        return;
-    }
-    logger_imp -> level = level;
+    pthread_mutex_lock(&logger_imp -> lock);
+    atomic_store_explicit(&logger_imp -> sink_level, level < TRACE || level > OFF ? OFF : level,
+                          memory_order_relaxed);
+    logger_gate_update(logger_imp, atomic_load(&logger_imp -> config));
+    pthread_mutex_unlock(&logger_imp -> lock);
 }
 
 
@@ -158,268 +482,1039 @@ void logger_change_rffl(LOGGER *logger, const char *ref,
 }
 
 
+int logger_change_mode(LOGGER *logger, const int mode) {
+    if (mode < LOGGER_TEXT || mode > LOGGER_LOGFMT) {
+        return -1;
+    }
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    logger_flush(logger);
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return -1;
+    }
+    config -> mode = mode;
+    if (mode != LOGGER_BINARY) {
+        config -> binary = NULL;
+    } else if (!config -> binary) {
+        config -> binary = binlog_create();
+        if (!config -> binary) {
+            logger_config_abort(logger_imp, config);
+            return -1;
+        }
+    }
+    logger_config_publish(logger_imp, config);
+    return 0;
+}
+
+
+void logger_change_array_style(LOGGER *logger, const int style, size_t head, size_t tail) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return;
+    }
+    config -> array.flags = style;
+    config -> array.head = head;
+    config -> array.tail = tail;
+    logger_config_publish(logger_imp, config);
+}
+
+
+long logger_decode(FILE *in, FILE *out) {
+    return binlog_decode(in, out);
+}
+
+
+void logger_enable_threadsafe(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    if (!logger_imp -> threadsafe) {
+        logger_imp -> threadsafe = 1; // once: readers check it without a lock
+    }
+}
+
+
+int logger_enable_async(LOGGER *logger, size_t capacity,
+                        int overflow, log_level_t keep_level) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    logger_flush(logger);
+    pthread_mutex_lock(&logger_imp -> lock);
+    if (!atomic_load(&logger_imp -> async)) {
+        // the writer thread reads the config behind everyone's back
+        logger_enable_threadsafe(logger);
+        atomic_store(&logger_imp -> async, async_start(logger_imp, capacity, overflow, keep_level));
+    }
+    int failed = !atomic_load(&logger_imp -> async);
+    pthread_mutex_unlock(&logger_imp -> lock);
+    return failed ? -1 : 0;
+}
+
+
+void logger_disable_async(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    pthread_mutex_lock(&logger_imp -> lock);
+    AsyncQueue *queue = atomic_exchange(&logger_imp -> async, NULL);
+    if (queue) {
+        epoch_synchronize(&logger_imp -> guard); // nobody is pushing to it now
+        async_stop(queue); // drains whatever is still queued
+    }
+    pthread_mutex_unlock(&logger_imp -> lock);
+}
+
+
+void logger_flush(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    logger_coalesce_flush(logger_imp);
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+    AsyncQueue *queue = atomic_load_explicit(&logger_imp -> async, memory_order_acquire);
+    if (queue) {
+        async_flush(queue); // the writer flushes the sinks
+    } else {
+        LoggerOutput output;
+        for (size_t i = 0; logger_output(logger_imp, config, i, &output) == 0; i++) {
+            output.sink -> ops -> flush(output.sink);
+        }
+    }
+    logger_read_unlock(logger_imp, token);
+}
+
+
+int logger_enable_coalescing(LOGGER *logger, long timeout_ms) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    if (timeout_ms > 0 && !logger_imp -> threadsafe) {
+        // the timer thread reads the config behind everyone's back
+        logger_enable_threadsafe(logger);
+    }
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return -1;
+    }
+    config -> coalesce = coalesce_create(logger_imp, timeout_ms);
+    if (!config -> coalesce) {
+        logger_config_abort(logger_imp, config);
+        return -1;
+    }
+    logger_config_publish(logger_imp, config);
+    return 0;
+}
+
+
+void logger_disable_coalescing(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return;
+    }
+    config -> coalesce = NULL;
+    logger_config_publish(logger_imp, config);
+}
+
+
+int logger_enable_stats(LOGGER *logger, const int count_filtered) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    pthread_mutex_lock(&logger_imp -> lock);
+    if (!logger_imp -> stats_block) {
+        logger_imp -> stats_block = stats_create();
+    }
+    if (!logger_imp -> stats_block) {
+        pthread_mutex_unlock(&logger_imp -> lock);
+        return -1;
+    }
+    logger_imp -> count_filtered = count_filtered != 0;
+    atomic_store_explicit(&logger_imp -> stats, logger_imp -> stats_block, memory_order_release);
+    logger_gate_update(logger_imp, atomic_load(&logger_imp -> config));
+    pthread_mutex_unlock(&logger_imp -> lock);
+    return 0;
+}
+
+
+void logger_disable_stats(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    pthread_mutex_lock(&logger_imp -> lock);
+    atomic_store_explicit(&logger_imp -> stats, NULL, memory_order_release);
+    logger_gate_update(logger_imp, atomic_load(&logger_imp -> config));
+    pthread_mutex_unlock(&logger_imp -> lock);
+}
+
+
+int logger_stats(LOGGER *logger, LOGGER_STATS *stats, const int reset) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    pthread_mutex_lock(&logger_imp -> lock);
+    LoggerStats *block = logger_imp -> stats_block;
+    if (block) {
+        stats_snapshot(block, stats, reset);
+    }
+    pthread_mutex_unlock(&logger_imp -> lock);
+    return block ? 0 : -1;
+}
+
+
+int logger_enable_recorder(LOGGER *logger, size_t records, const log_level_t level) {
+    if (level < TRACE || level >= OFF || !records) {
+        return -1;
+    }
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return -1;
+    }
+    config -> recorder = recorder_create(records, level);
+    if (!config -> recorder) {
+        logger_config_abort(logger_imp, config);
+        return -1;
+    }
+    logger_config_publish(logger_imp, config);
+    return 0;
+}
+
+
+void logger_disable_recorder(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    LoggerConfig *config = logger_config_copy(logger_imp);
+    if (!config) {
+        return;
+    }
+    config -> recorder = NULL;
+    logger_config_publish(logger_imp, config);
+}
+
+
+void logger_dump_recorder(LOGGER *logger) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    logger_flush(logger); // what was queued before comes first
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+    if (config -> recorder) {
+        // a registry child's dump goes where its records go, in that logger's mode
+        lgimp_t *owner = logger_imp;
+        for (lgimp_t *parent = registry_parent(config -> sink); parent; ) {
+            owner = parent;
+            unsigned owner_token = 0;
+            parent = registry_parent(logger_read_lock(owner, &owner_token) -> sink);
+            logger_read_unlock(owner, owner_token);
+        }
+        unsigned owner_token = 0;
+        const LoggerConfig *target = logger_read_lock(owner, &owner_token);
+        LogBuffer dump = {0};
+        recorder_dump(config -> recorder, target, config -> ref, &dump);
+        if (dump.len) {
+            logger_write(owner, target -> sink, dump.data, dump.len);
+            target -> sink -> ops -> flush(target -> sink);
+        }
+        free(dump.data);
+        logger_read_unlock(owner, owner_token);
+    }
+    logger_read_unlock(logger_imp, token);
+}
+
+
+int logger_recorder_crash_handler(LOGGER *logger, int fd) {
+    lgimp_t *logger_imp = (lgimp_t*)logger;
+    if (fd < 0) {
+        unsigned token = 0;
+        const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+        FILE *file = config -> mode == LOGGER_BINARY ? NULL : config -> sink -> file;
+        fd = file ? fileno(file) : STDERR_FILENO;
+        logger_read_unlock(logger_imp, token);
+    }
+
+    pthread_mutex_lock(&LOGGER_CRASH_LOCK);
+    size_t slot = LOGGER_MAX_CRASH_LOGGERS;
+    for (size_t i = 0; i < LOGGER_MAX_CRASH_LOGGERS; i++) {
+        lgimp_t *registered = atomic_load(&LOGGER_CRASH_LOGGERS[i].logger);
+        if (registered == logger_imp || (!registered && slot == LOGGER_MAX_CRASH_LOGGERS)) {
+            slot = i;
+        }
+    }
+    if (slot == LOGGER_MAX_CRASH_LOGGERS) {
+        pthread_mutex_unlock(&LOGGER_CRASH_LOCK);
+        fprintf(stderr, "liblogger: no room for another crash handler logger\n");
+        return -1;
+    }
+    LOGGER_CRASH_LOGGERS[slot].fd = fd;
+    atomic_store(&LOGGER_CRASH_LOGGERS[slot].logger, logger_imp);
+
+    if (!LOGGER_CRASH_INSTALLED) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = logger_crash_handler;
+        sigemptyset(&action.sa_mask);
+        for (size_t i = 0; i < sizeof(LOGGER_CRASH_SIGNALS) / sizeof(int); i++) {
+            sigaction(LOGGER_CRASH_SIGNALS[i], &action, &LOGGER_CRASH_PREVIOUS[i]);
+        }
+        LOGGER_CRASH_INSTALLED = 1;
+    }
+    pthread_mutex_unlock(&LOGGER_CRASH_LOCK);
+    return 0;
+}
+
+
 void logger_level_color(const log_level_t level, const char *ansi_code) {
+    if (level < TRACE || level > FATAL) {
+        return;
+    }
+    pthread_mutex_lock(&LOGGER_COLORS_LOCK);
+    atomic_fetch_add(&LOGGER_LABELS_SEQ, 1);
     LOGGER_LEVEL_COLORS[level] = ansi_code;
+    logger_level_label_build(level);
+    atomic_fetch_add(&LOGGER_LABELS_SEQ, 1);
+    pthread_mutex_unlock(&LOGGER_COLORS_LOCK);
 }
 
 
 void logger_level_color_default(void) {
+    pthread_mutex_lock(&LOGGER_COLORS_LOCK);
+    atomic_fetch_add(&LOGGER_LABELS_SEQ, 1);
     LOGGER_LEVEL_COLORS[0] = LOGGER_DEFAULT_TRACE;
     LOGGER_LEVEL_COLORS[1] = LOGGER_DEFAULT_DEBUG;
     LOGGER_LEVEL_COLORS[2] = LOGGER_DEFAULT_INFO;
     LOGGER_LEVEL_COLORS[3] = LOGGER_DEFAULT_WARNING;
     LOGGER_LEVEL_COLORS[4] = LOGGER_DEFAULT_ERROR;
     LOGGER_LEVEL_COLORS[5] = LOGGER_DEFAULT_FATAL;
+    for (int level = TRACE; level <= FATAL; level++) {
+        logger_level_label_build(level);
+    }
+    atomic_fetch_add(&LOGGER_LABELS_SEQ, 1);
+    pthread_mutex_unlock(&LOGGER_COLORS_LOCK);
 }
 
 
 void logger_level_color_reset(void) {
-    memset(LOGGER_LEVEL_COLORS, 0, 6);
+    pthread_mutex_lock(&LOGGER_COLORS_LOCK);
+    atomic_fetch_add(&LOGGER_LABELS_SEQ, 1);
+    memset(LOGGER_LEVEL_COLORS, 0, sizeof(LOGGER_LEVEL_COLORS));
+    for (int level = TRACE; level <= FATAL; level++) {
+        logger_level_label_build(level);
+    }
+    atomic_fetch_add(&LOGGER_LABELS_SEQ, 1);
+    pthread_mutex_unlock(&LOGGER_COLORS_LOCK);
+}
+
+
+/* A private copy of the current config to modify, NULL if out of memory
+ * The caller must hand it to logger_config_publish */
+static LoggerConfig *logger_config_copy(lgimp_t *logger) {
+    pthread_mutex_lock(&logger -> lock);
+    LoggerConfig *config = malloc(sizeof(LoggerConfig));
+    if (!config) {
+        pthread_mutex_unlock(&logger -> lock);
+        return NULL;
+    }
+    *config = *atomic_load(&logger -> config);
+    return config;
 }
 
 
-static int logger_getID(const char *s) {
-    size_t i;
-    for (i = 0; i < sizeof(LOGGER_INFO_LABELS)/sizeof(LOGGER_INFO_LABELS[0]); i++) {
-        if (strcmp(s, LOGGER_INFO_LABELS[i]) == 0) {
-            return i;
+/* Give up on a copy, nothing it points to is freed */
+static void logger_config_abort(lgimp_t *logger, LoggerConfig *config) {
+    free(config);
+    pthread_mutex_unlock(&logger -> lock);
+}
+
+
+/* Swap the config in and free the old one once no reader can see it */
+static void logger_config_publish(lgimp_t *logger, LoggerConfig *config) {
+    LoggerConfig *old = atomic_load(&logger -> config);
+    if (config -> mode == LOGGER_BINARY && !registry_parent(config -> sink) &&
+        (old -> mode != LOGGER_BINARY || old -> sink != config -> sink ||
+         old -> format != config -> format || old -> ref != config -> ref)) {
+        // the decoder needs the new format and ref before the records using them
+        // (a registry child writing through its parent logs in the parent's mode)
+        LogBuffer header = {0};
+        if (binlog_header(config, &header) == 0) {
+            logger_write_raw(logger, config, header.data, header.len, NULL);
         }
+        free(header.data);
+    }
+
+    atomic_store(&logger -> config, config);
+    logger_gate_update(logger, config);
+    int was_binary = old -> mode == LOGGER_BINARY, binary = config -> mode == LOGGER_BINARY;
+    if (was_binary && (!binary || old -> sink != config -> sink)) {
+        sink_rotating_preamble(old -> sink, NULL, NULL);
+    }
+    if (binary && (!was_binary || old -> sink != config -> sink)) {
+        // a rotated file starts with what it takes to decode it
+        sink_rotating_preamble(config -> sink, logger_binary_preamble, logger);
+    }
+    if (logger -> threadsafe) {
+        epoch_synchronize(&logger -> guard);
+    }
+    if (old -> format != config -> format) {
+        format_free(old -> format);
+    }
+    if (old -> binary != config -> binary) {
+        binlog_free(old -> binary);
+    }
+    if (old -> recorder != config -> recorder) {
+        free(old -> recorder);
+    }
+    if (old -> coalesce != config -> coalesce && old -> coalesce) {
+        // nobody can add to the run now, it still gets its note
+        CoalesceRun run;
+        pthread_mutex_lock(&old -> coalesce -> lock);
+        coalesce_end(old -> coalesce, &run);
+        logger_emit_run(logger, config, &run);
+        pthread_mutex_unlock(&old -> coalesce -> lock);
+        coalesce_free(old -> coalesce);
+    }
+    if (old -> extra != config -> extra) {
+        logger_outputs_free(old -> extra, config -> extra);
     }
-    return -1;
+    if (old -> sink != config -> sink && old -> owns_sink) {
+        logger_sink_close(old -> sink);
+    }
+    free(old);
+    pthread_mutex_unlock(&logger -> lock);
 }
 
 
-static char *logger_level_to_string(const int level) {
-    int len = 0;
-    if (LOGGER_LEVEL_COLORS[level]) {
-        len = strlen(LOGGER_LEVEL_COLORS[level]);
-        len += 4;
-        // Length of escape sequences (4 is the \033[0m to back to normal)
+/* The header and call site dictionary a new file of a rotating sink starts
+ * with, called from a write: the caller reads the config, it stays alive */
+static int logger_binary_preamble(void *arg, LogBuffer *buffer) {
+    lgimp_t *logger = arg;
+    const LoggerConfig *config = atomic_load(&logger -> config);
+    if (config -> mode != LOGGER_BINARY) {
+        return -1;
     }
-    char *p = malloc(len + 8);
-if (!p) {
-        return NULL;
+    return binlog_header(config, buffer) || binlog_dictionary(config -> binary, buffer) ? -1 : 0;
+}
+
+
+/* Point the logger at sink, closing the previous one if it was ours
+ * Return 0 or -1 if memory ran out (sink is left alone) */
+static int logger_set_sink(lgimp_t *logger, LOGGER_SINK *sink, int owned) {
+    logger_flush((LOGGER *)logger);
+    LoggerConfig *config = logger_config_copy(logger);
+    if (!config) {
+        return -1;
     }
-    if (LOGGER_LEVEL_COLORS[level]) {
-        strcpy(p, LOGGER_LEVEL_COLORS[level]);
-    } else *p = '\0';
-    switch (level) {
-        case TRACE:
-            strcat(p, "TRACE");
-            break;
-        case DEBUG:
-            strcat(p, "DEBUG");
-            break;
-        case INFO:
-            strcat(p, "INFO");
-            break;
-        case WARNING:
-            strcat(p, "WARNING");
-            break;
-        case ERROR:
-            strcat(p, "ERROR");
-            break;
-        case FATAL:
-            strcat(p, "FATAL");
-            break;
-        case OFF:
-            strcat(p, "OFF");
-            break;
-        default:
-            strcat(p, "UNKNOWN");
-            break;
-    }
-    if (LOGGER_LEVEL_COLORS[level]) {
-        strcat(p, LOGGER_RESET);
-    }
-    return p;
-}
-
-
-/* Take a format string and parse it into an easier to use linked list */
-static Node *logger_formatter(const char *s) {
-    if (!s) return NULL;
-    
-    Node *pHead = malloc(sizeof(Node));
-    if (!pHead) return NULL;
-    pHead->string = "HEAD";
-    pHead->type = HEAD;
-    pHead->next = NULL;
-
-    while (*s) {
-        if (*s == '/' && *(s + 1) == '[') {
-            char *buffer = malloc(2);
-            if (!buffer) {
-                linked_list_free(pHead);
-                return NULL;
-            }
-            buffer[0] = '[';
-            buffer[1] = '\0';
-            
-            Node *curr = malloc(sizeof(Node));
-            if (!curr) {
-                free(buffer);
-                linked_list_free(pHead);
-                return NULL;
-            }
-            curr->string = buffer;
-            curr->type = LITERAL;
-            curr->next = NULL;
-            linked_list_add(pHead, curr);
-            
-            s += 2;
-        } else if (*s == '/' && *(s + 1) == ']') {
-            char *buffer = malloc(2);
-            if (!buffer) {
-                linked_list_free(pHead);
-                return NULL;
-            }
-            buffer[0] = ']';
-            buffer[1] = '\0';
-            
-            Node *curr = malloc(sizeof(Node));
-            if (!curr) {
-                free(buffer);
-                linked_list_free(pHead);
-                return NULL;
-            }
-            curr->string = buffer;
-            curr->type = LITERAL;
-            curr->next = NULL;
-            linked_list_add(pHead, curr);
-            
-            s += 2;
-        } else if (*s == '[') {
-            s++;
-            const char *sp = s;
-            int len = 0;
-            
-            while (*s && *s != ']') {
-                len++;
-                s++;
+    if (config -> mode == LOGGER_BINARY) {
+        // the call site dictionary belongs to the stream it was written to
+        config -> binary = binlog_create();
+        if (!config -> binary) {
+            logger_config_abort(logger, config);
+            return -1;
+        }
+    }
+    config -> sink = sink;
+    config -> owns_sink = owned;
+    config -> colored = logger_file_colored(sink -> file);
+    logger_config_publish(logger, config);
+    return 0;
+}
+
+
+/* Free outputs and the formats it owns that keep doesn't share */
+static void logger_outputs_free(LoggerOutputs *outputs, const LoggerOutputs *keep) {
+    if (!outputs) {
+        return;
+    }
+    for (size_t i = 0; i < outputs -> count; i++) {
+        int shared = 0;
+        for (size_t j = 0; keep && j < keep -> count; j++) {
+            shared |= keep -> outputs[j].format == outputs -> outputs[i].format;
+        }
+        if (!shared) {
+            format_free(outputs -> outputs[i].format);
+        }
+    }
+    free(outputs);
+}
+
+
+/* The level the macros check is the lowest one any sink or the recorder
+ * takes, unless they must let everything through to have it counted
+ * Called with the config lock held */
+static void logger_gate_update(lgimp_t *logger, const LoggerConfig *config) {
+    unsigned char level = atomic_load_explicit(&logger -> sink_level, memory_order_relaxed);
+    for (size_t i = 0; config -> extra && i < config -> extra -> count; i++) {
+        if (config -> extra -> outputs[i].level < level) {
+            level = config -> extra -> outputs[i].level;
+        }
+    }
+    atomic_store_explicit(&logger -> min_level, level, memory_order_relaxed);
+    unsigned char record_level = config -> recorder ? config -> recorder -> level : OFF;
+    atomic_store_explicit(&logger -> record_level, record_level, memory_order_relaxed);
+    if (record_level < level) {
+        level = record_level;
+    }
+    if (logger_counting(logger) && logger -> count_filtered) {
+        level = TRACE;
+    }
+    atomic_store_explicit(&logger -> level, level, memory_order_relaxed);
+}
+
+
+/* Colors are only worth it on a terminal */
+static int logger_file_colored(FILE *file) {
+    if (!file) {
+        return 0;
+    }
+    int fd = fileno(file);
+    return fd >= 0 && isatty(fd);
+}
+
+
+/* Render color + name + reset into the colored label table */
+static void logger_level_label_build(const int level) {
+    level_label_t *label = &LOGGER_LEVEL_LABELS[1][level];
+    const char *name = LOGGER_LEVEL_NAMES[level];
+    const char *color = LOGGER_LEVEL_COLORS[level];
+    size_t name_len = strlen(name);
+
+    if (!color || !*color) {
+        memcpy(label -> string, name, name_len + 1);
+        label -> len = name_len;
+        return;
+    }
+    size_t reset_len = strlen(LOGGER_RESET);
+    size_t color_len = strlen(color);
+    size_t room = LOGGER_LABEL_SIZE - 1 - name_len - reset_len;
+    if (color_len > room) {
+        color_len = room;
+    }
+    memcpy(label -> string, color, color_len);
+    memcpy(label -> string + color_len, name, name_len);
+    memcpy(label -> string + color_len + name_len, LOGGER_RESET, reset_len + 1);
+    label -> len = color_len + name_len + reset_len;
+}
+
+
+/* Copy the label into out (LOGGER_LABEL_SIZE bytes) and return its length */
+static size_t logger_level_label(const int level, const int colored, char *out) {
+    const level_label_t *label = &LOGGER_LEVEL_LABELS[colored][level];
+    if (level < TRACE || level > OFF) {
+        label = &LOGGER_LEVEL_LABELS[0][OFF + 1];
+    }
+    unsigned seq;
+    size_t len;
+    do {
+        seq = atomic_load_explicit(&LOGGER_LABELS_SEQ, memory_order_acquire);
+        len = label -> len < LOGGER_LABEL_SIZE ? label -> len : LOGGER_LABEL_SIZE;
+        memcpy(out, label -> string, len);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&LOGGER_LABELS_SEQ, memory_order_relaxed));
+    return len;
+}
+
+
+void logger_stamp(const LoggerConfig *config, LogRecord *record) {
+    unsigned flags = config -> format ? config -> format -> flags : 0;
+    for (size_t i = 0; config -> extra && i < config -> extra -> count; i++) {
+        const FormatProgram *program = config -> extra -> outputs[i].format;
+        flags |= program ? program -> flags : 0;
+    }
+    if (flags & FORMAT_USES_TIME) {
+        timestamp_now(&record -> time, flags & FORMAT_USES_SUBSEC);
+    }
+}
+
+
+int logger_render(const LoggerConfig *config, LogRecord *record, LogBuffer *buffer) {
+    return logger_render_program(config, config -> format, config -> colored, record, buffer, NULL);
+}
+
+
+size_t logger_dispatch(lgimp_t *logger, const LoggerConfig *config, LogRecord *record,
+                       size_t first, LogBuffer *scratch, LogBuffer *batches, GatherList *gathers) {
+    unsigned long long done = 0;
+    size_t total = 0;
+    LoggerOutput output, other;
+    LoggerStats *stats = logger_counting(logger);
+    // structured modes escape what they render in place, they need it copied
+    int gathering = config -> mode != LOGGER_JSON && config -> mode != LOGGER_LOGFMT;
+    for (size_t i = first; logger_output(logger, config, i, &output) == 0; i++) {
+        if (done >> i & 1 || !logger_takes(record, i, output.level)) {
+            continue;
+        }
+        if (gathering && output.sink -> ops -> writev) {
+            total += logger_gather(logger, config, &output, record, batches ? &batches[i] : scratch,
+                                   batches ? &gathers[i] : NULL);
+            continue;
+        }
+        unsigned long long start = stats_start(stats);
+        logger_render_program(config, output.format, output.colored, record, scratch, NULL);
+        stats_time(stats, STATS_RENDER, start);
+        // every later sink of the same variant gets this rendering too
+        for (size_t j = i; logger_output(logger, config, j, &other) == 0; j++) {
+            if (done >> j & 1 || !logger_takes(record, j, other.level) ||
+                other.format != output.format || other.colored != output.colored ||
+                (gathering && other.sink -> ops -> writev)) {
+                continue;
             }
-            
-            if (!*s) {
-                linked_list_free(pHead);
-                return NULL;
+            done |= 1ULL << j;
+            total += scratch -> len;
+            if (batches && other.sink -> ops -> queue) {
+                logger_queue(logger, other.sink, scratch -> data, scratch -> len);
+            } else if (batches) {
+                buffer_append(&batches[j], scratch -> data, scratch -> len);
+            } else {
+                logger_write(logger, other.sink, scratch -> data, scratch -> len);
             }
+        }
+        buffer_clear(scratch);
+    }
+    return total;
+}
 
-            char *buffer = malloc(len + 1);
-            if (!buffer) {
-                linked_list_free(pHead);
-                return NULL;
-            }
-            
-            strncpy(buffer, sp, len);
-            buffer[len] = '\0';
-            
-            Node *curr = malloc(sizeof(Node));
-            if (!curr) {
-                free(buffer);
-                linked_list_free(pHead);
-                return NULL;
+
+/* Render a record for a sink taking pieces, on its own: text that lasts is
+ * pointed at instead of copied to buffer
+ * In a batch it is written with the batch, else right away
+ * Return the number of bytes rendered */
+static size_t logger_gather(lgimp_t *logger, const LoggerConfig *config, const LoggerOutput *output,
+                            LogRecord *record, LogBuffer *buffer, GatherList *batch) {
+    GatherList *gather = batch ? batch : gather_thread_local();
+    size_t before = gather -> bytes + buffer -> len - gather -> mark;
+    LoggerStats *stats = logger_counting(logger);
+    unsigned long long start = stats_start(stats);
+    logger_render_program(config, output -> format, output -> colored, record, buffer, gather);
+    stats_time(stats, STATS_RENDER, start);
+    size_t len = gather -> bytes + buffer -> len - gather -> mark - before;
+    if (!batch) {
+        logger_write_gather(logger, output -> sink, gather, buffer);
+        gather_clear(gather);
+        buffer_clear(buffer);
+    }
+    return len;
+}
+
+
+/* Render a record into buffer following a compiled format
+ * With gather, long text is pointed at instead, gather -> batch says how long it must last */
+static int logger_render_program(const LoggerConfig *config, const FormatProgram *program,
+                                 const int colored, LogRecord *record, LogBuffer *buffer,
+                                 GatherList *gather) {
+    if (!program) {
+        return 0;
+    }
+
+    const TimeCache *clock = NULL;
+    if (program -> flags & FORMAT_USES_TIME) {
+        if (!record -> time.tv_sec && !record -> time.tv_nsec) {
+            logger_stamp(config, record);
+        }
+        clock = timestamp_cache(&record -> time);
+    }
+    const struct timespec now = record -> time;
+
+    // JSON and logfmt keep the labels and drop the literals around them
+    int mode = config -> mode;
+    int structured = mode == LOGGER_JSON || mode == LOGGER_LOGFMT;
+    char label[LOGGER_LABEL_SIZE];
+    size_t label_len = logger_level_label(record -> level, colored && !structured, label);
+    int failed = structured ? structured_begin(buffer, mode) : 0;
+    int first = 1;
+    for (size_t i = 0; i < program -> count && !failed; i++) {
+        const FormatOp *op = &program -> ops[i];
+        size_t start = buffer -> len;
+        if (structured) {
+            if (op -> code == OP_LITERAL || op -> code == OP_FIELDS) {
+                continue;
             }
-            curr->string = buffer;
-            curr->type = LABEL;
-            curr->next = NULL;
-            linked_list_add(pHead, curr);
-            
-            s++;
-        } else {
-            const char *sp = s;
-            int len = 0;
-            
-            while (*s && 
-                   !(*s == '[') && 
-                   !(*s == '/' && (*(s + 1) == '[' || *(s + 1) == ']'))) {
-                len++;
-                s++;
+            failed = structured_key(buffer, mode, structured_label_key(op -> code), first);
+            first = 0;
+            start = buffer -> len;
+        }
+        switch (op -> code) {
+            case OP_LITERAL:
+                failed = logger_render_text(buffer, gather, op -> string, op -> len, 1);
+                break;
+            case OP_REF: {
+                const char *ref = record -> ref ? record -> ref : config -> ref;
+                failed = logger_render_text(buffer, gather, ref ? ref : "(null)", ref ? strlen(ref) : 6, 1);
+                break;
             }
-            
-            if (len > 0) {
-                char *buffer = malloc(len + 1);
-                if (!buffer) {
-                    linked_list_free(pHead);
-                    return NULL;
+            case OP_LEVEL:
+                failed = buffer_append(buffer, label, label_len);
+                break;
+            case OP_DATE:
+                failed = buffer_append_str(buffer, clock -> date);
+                break;
+            case OP_TIME:
+                failed = buffer_append_str(buffer, clock -> time);
+                break;
+            case OP_MSEC:
+                failed = buffer_append_padded(buffer, now.tv_nsec / 1000000, 3);
+                break;
+            case OP_USEC:
+                failed = buffer_append_padded(buffer, now.tv_nsec / 1000, 6);
+                break;
+            case OP_ISO8601:
+                failed = buffer_append_str(buffer, clock -> iso) ||
+                         buffer_append(buffer, ".", 1) ||
+                         buffer_append_padded(buffer, now.tv_nsec / 1000, 6) ||
+                         buffer_append_str(buffer, clock -> zone);
+                break;
+            case OP_EPOCHNS:
+                failed = buffer_append_padded(buffer, (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec, 1);
+                break;
+            case OP_FILENAME:
+                failed = logger_render_text(buffer, gather, record -> fname ? record -> fname : "(null)",
+                                            record -> fname ? strlen(record -> fname) : 6, 1);
+                break;
+            case OP_LINE:
+                failed = buffer_append_int(buffer, record -> line);
+                break;
+            case OP_MSG:
+                if (record -> args) {
+                    va_list copy;
+                    va_copy(copy, *record -> args);
+                    failed = message_vprintf(buffer, record -> msg, copy);
+                    va_end(copy);
+                } else {
+                    failed = logger_render_text(buffer, gather, record -> msg, record -> msg_len, 0);
                 }
-                
-                strncpy(buffer, sp, len);
-                buffer[len] = '\0';
-                
-                Node *curr = malloc(sizeof(Node));
-                if (!curr) {
-                    free(buffer);
-                    linked_list_free(pHead);
-                    return NULL;
+                if (!structured && !(program -> flags & FORMAT_USES_FIELDS) && !failed) {
+                    failed = structured_fields(buffer, LOGGER_TEXT, record -> fields,
+                                               record -> field_count, 0);
                 }
-                curr->string = buffer;
-                curr->type = LITERAL;
-                curr->next = NULL;
-                linked_list_add(pHead, curr);
-            }
+                break;
+            case OP_FIELDS:
+                failed = structured_fields(buffer, LOGGER_TEXT, record -> fields,
+                                           record -> field_count, 1);
+                break;
+            case OP_PRI:
+                failed = buffer_append_int(buffer, LOGGER_SYSLOG_FACILITY + LOGGER_SYSLOG_SEVERITIES[
+                    record -> level >= TRACE && record -> level <= OFF ? record -> level : OFF + 1]);
+                break;
+            case OP_HOSTNAME:
+                pthread_once(&LOGGER_IDENTITY_ONCE, logger_identity_init);
+                failed = logger_render_text(buffer, gather, LOGGER_HOSTNAME, LOGGER_HOSTNAME_LEN, 1);
+                break;
+            case OP_PID:
+                pthread_once(&LOGGER_IDENTITY_ONCE, logger_identity_init);
+                failed = buffer_append_int(buffer, atomic_load_explicit(&LOGGER_PID, memory_order_relaxed));
+                break;
         }
+        if (structured && !failed && !structured_label_numeric(op -> code)) {
+            failed = structured_string(buffer, mode, start);
+        }
+    }
+    if (structured && !failed) {
+        failed = structured_fields(buffer, mode, record -> fields, record -> field_count, first) ||
+                 structured_end(buffer, mode);
+    }
+    return failed ? -1 : 0;
+}
+
+
+/* Append s to buffer, or to gather if it stays valid long enough:
+ * lasting text as long as the config, the rest until the record is written */
+static int logger_render_text(LogBuffer *buffer, GatherList *gather,
+                              const char *s, size_t len, const int lasting) {
+    if (gather && (lasting || !gather -> batch)) {
+        return gather_text(gather, buffer, s, len);
+    }
+    return buffer_append(buffer, s, len);
+}
+
+
+/* Write finished output, through the writer thread in async mode
+ * site is the binary call site whose 'D' entry is in data, marked written
+ * once data reached the sink: right away, or by the writer thread
+ * Return 0 or -1 if it was dropped or the sink failed */
+static int logger_write_raw(lgimp_t *logger, const LoggerConfig *config,
+                            const char *data, size_t len, void *site) {
+    AsyncQueue *queue = atomic_load_explicit(&logger -> async, memory_order_acquire);
+    if (queue) {
+        LogRecord record = {0};
+        record.msg = data;
+        record.msg_len = len;
+        record.raw = 1;
+        record.site = site;
+        return logger_push(logger, queue, &record);
+    }
+    if (logger_write(logger, config -> sink, data, len) < 0) {
+        return -1;
+    }
+    if (site) {
+        binlog_written(site);
     }
-    
-    return pHead;
+    return 0;
+}
+
+
+/* Encode the record instead of formatting it, only the decoder will */
+static void logger_print_binary(lgimp_t *logger, const LoggerConfig *config,
+                                LogRecord *record) {
+    LogBuffer *buffer = buffer_thread_local();
+    timestamp_now(&record -> time, 1);
+    LoggerStats *stats = logger_counting(logger);
+    unsigned long long start = stats_start(stats);
+    void *site = binlog_record(config -> binary, record, buffer);
+    stats_time(stats, STATS_RENDER, start);
+    logger_write_raw(logger, config, buffer -> data, buffer -> len, site);
+    buffer_clear(buffer);
 }
 
 
 /* print a log message */
 static void logger_print_msg(const char *fname, const int line, 
                              const LOGGER *logger, const log_level_t level, 
-                             const char *msg, va_list args) {
+                             const int forced, const char *msg, va_list args) {
     lgimp_t *logger_imp = (lgimp_t*)logger;
-    if (level < logger_imp -> level || level == OFF) {
+    if (!forced && logger_filtered(logger_imp, level) && !logger_recorded(logger_imp, level)) {
+        va_end(args);
         return;
     }
 
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char time_str[26];
-    char date_str[26];
-    // Format: HH:MM:SS
-    strftime(time_str, 26, "%H:%M:%S", tm_info);
-    // Format: YYYY-MM-DD
-    strftime(date_str, 26, "%Y-%m-%d", tm_info);
-
-    char *level_str = logger_level_to_string(level);
-    if (!level_str) {
-        level_str = "GET LEVEL FAILED";
-        // if failed to get level label
-    }
-    const Node *curr = logger_imp -> format;
-    while (curr) {
-        if (curr -> type == LITERAL) {
-            fprintf(logger_imp -> file, "%s", curr -> string);
-        } else {
-            int ID = logger_getID(curr -> string);
-            switch (ID) {
-                case REF:
-                    fprintf(logger_imp -> file, "%s", logger_imp -> ref);
-                    break;
-                case LEVEL:
-                    fprintf(logger_imp -> file, "%s", level_str);
-                    break;
-                case DATE:
-                    fprintf(logger_imp -> file, "%s", date_str);
-                    break;
-                case TIME:
-                    fprintf(logger_imp -> file, "%s", time_str);
-                    break;
-                case FILENAME:
-                    fprintf(logger_imp -> file, "%s", fname);
-                    break;
-                case LINE:
-                    fprintf(logger_imp -> file, "%d", line);
-                    break;
-                case MSG:
-                    vfprintf(logger_imp -> file, msg, args);
-                    break;
-            }
+    va_list copy;
+    va_copy(copy, args);
+    LogRecord record = { fname, line, level, {0, 0}, msg, &copy, 0, 0, NULL, 0, forced, NULL, NULL };
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger_imp, &token);
+    logger_print_record(logger_imp, config, token, &record);
+    va_end(copy);
+    va_end(args);
+}
+
+
+/* Send a record that passed the level check on its way, config was read
+ * with logger_read_lock and is given back here */
+static void logger_print_record(lgimp_t *logger, const LoggerConfig *config,
+                                unsigned token, LogRecord *record) {
+    AsyncQueue *queue = atomic_load_explicit(&logger -> async, memory_order_acquire);
+    if (config -> recorder && record -> level >= config -> recorder -> level) {
+        int shown = logger_takes(record, 0, atomic_load_explicit(&logger -> min_level, memory_order_relaxed));
+        // a FATAL that goes out is not repeated by the dump it triggers
+        recorder_capture(config -> recorder, record, shown && record -> level == FATAL);
+        if (!shown) {
+            logger_read_unlock(logger, token); // only kept in memory
+            return;
         }
-        curr = curr -> next;
     }
-    va_end(args);
-    free(level_str);
+    stats_add(logger_counting(logger), STATS_ACCEPTED, 1);
+    lgimp_t *parent = registry_parent(config -> sink);
+    if (parent) {
+        // a registry child logs through its parent, under its own name
+        if (config -> extra) {
+            logger_dispatch(logger, config, record, 1, buffer_thread_local(), NULL, NULL);
+        }
+        int taken = logger_takes(record, 0, atomic_load_explicit(&logger -> sink_level, memory_order_relaxed));
+        if (!record -> ref) {
+            record -> ref = config -> ref; // borrowed like every ref, it outlives the config
+        }
+        logger_read_unlock(logger, token);
+        if (taken) {
+            logger_forward(parent, record);
+        }
+    } else if (config -> coalesce && config -> mode != LOGGER_BINARY) {
+        logger_print_coalesced(logger, config, token, record);
+    } else if (config -> mode == LOGGER_BINARY) {
+        if (logger_takes(record, 0, atomic_load_explicit(&logger -> sink_level, memory_order_relaxed))) {
+            logger_print_binary(logger, config, record);
+        }
+        if (config -> extra) {
+            // the other sinks get text, from here even in async mode
+            logger_dispatch(logger, config, record, 1, buffer_thread_local(), NULL, NULL);
+        }
+        logger_read_unlock(logger, token);
+    } else if (queue) {
+        logger_stamp(config, record); // the time of the call, not of the write
+        logger_push(logger, queue, record); // still under the guard, the queue can't go
+        logger_read_unlock(logger, token);
+    } else {
+        // each record goes out at once: one sink write, no interleaving
+        logger_dispatch(logger, config, record, 0, buffer_thread_local(), NULL, NULL);
+        logger_read_unlock(logger, token);
+    }
+    if (record -> level == FATAL && logger_recorded(logger, FATAL)) {
+        logger_dump_recorder((LOGGER *)logger);
+    }
+}
+
+
+/* Hold the record back if it repeats the last one, or write it after the
+ * note for the repeats it ends */
+static void logger_print_coalesced(lgimp_t *logger, const LoggerConfig *config,
+                                   unsigned token, LogRecord *record) {
+    // repeats are found on the rendered message, then used as is
+    LogBuffer *text = buffer_thread_message();
+    if (record -> args) {
+        va_list copy;
+        va_copy(copy, *record -> args);
+        int failed = message_vprintf(text, record -> msg, copy);
+        va_end(copy);
+        if (failed) {
+            buffer_clear(text);
+            logger_read_unlock(logger, token);
+            return;
+        }
+        record -> msg = text -> data;
+        record -> msg_len = text -> len;
+        record -> args = NULL;
+    }
+
+    Coalesce *coalesce = config -> coalesce;
+    CoalesceRun run;
+    pthread_mutex_lock(&coalesce -> lock);
+    int held = coalesce_check(coalesce, record, &run);
+    logger_emit_run(logger, config, &run);
+    if (!held) {
+        logger_emit(logger, config, record);
+    }
+    pthread_mutex_unlock(&coalesce -> lock);
+    logger_read_unlock(logger, token);
+    buffer_clear(text);
+}
+
+
+/* Hand a record to the sinks, through the writer thread in async mode */
+static void logger_emit(lgimp_t *logger, const LoggerConfig *config, LogRecord *record) {
+    AsyncQueue *queue = atomic_load_explicit(&logger -> async, memory_order_acquire);
+    if (queue) {
+        logger_stamp(config, record);
+        logger_push(logger, queue, record);
+    } else {
+        logger_dispatch(logger, config, record, 0, buffer_thread_local(), NULL, NULL);
+    }
+}
+
+
+/* "last message repeated N times" at the level and call site of the run */
+static void logger_emit_run(lgimp_t *logger, const LoggerConfig *config, const CoalesceRun *run) {
+    if (!run -> repeats) {
+        return;
+    }
+    char note[64];
+    int len = snprintf(note, sizeof(note), "last message repeated %zu time%s",
+                       run -> repeats, run -> repeats == 1 ? "" : "s");
+    LogRecord record = { run -> fname, run -> line, run -> level, {0, 0}, note, NULL, len, 0, NULL, 0, 0, NULL, NULL };
+    logger_emit(logger, config, &record);
 }
 
+
+/* Write the note of the run in progress, before a flush or the end */
+static void logger_coalesce_flush(lgimp_t *logger) {
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger, &token);
+    if (config -> coalesce) {
+        CoalesceRun run;
+        pthread_mutex_lock(&config -> coalesce -> lock);
+        coalesce_end(config -> coalesce, &run);
+        logger_emit_run(logger, config, &run);
+        pthread_mutex_unlock(&config -> coalesce -> lock);
+    }
+    logger_read_unlock(logger, token);
+}
+
+
+/* The run may belong to a config being replaced, its note then goes out
+ * with the new one as when the config is published */
+void logger_coalesce_expire(lgimp_t *logger, Coalesce *coalesce) {
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(logger, &token);
+    pthread_mutex_lock(&coalesce -> lock);
+    if (coalesce_expired(coalesce)) {
+        CoalesceRun run;
+        coalesce_end(coalesce, &run);
+        logger_emit_run(logger, config, &run);
+    }
+    pthread_mutex_unlock(&coalesce -> lock);
+    logger_read_unlock(logger, token);
+}
+
+
+int logger_forward(lgimp_t *parent, LogRecord *record) {
+    unsigned token = 0;
+    const LoggerConfig *config = logger_read_lock(parent, &token);
+    if (record -> raw) {
+        int failed = logger_write_raw(parent, config, record -> msg, record -> msg_len, NULL);
+        logger_read_unlock(parent, token);
+        return failed;
+    }
+    logger_print_record(parent, config, token, record); // its own sink takes it
+    return 0;
+}
+
+
+int logger_write(lgimp_t *logger, LOGGER_SINK *sink, const char *data, size_t len) {
+    LoggerStats *stats = logger_counting(logger);
+    unsigned long long start = stats_start(stats);
+    int failed = sink -> ops -> write(sink, data, len);
+    stats_time(stats, STATS_WRITE, start);
+    stats_add(stats, failed ? STATS_ERRORS : STATS_BYTES, failed ? 1 : len);
+    return failed ? -1 : 0;
+}
+
+
+void logger_queue(lgimp_t *logger, LOGGER_SINK *sink, const char *data, size_t len) {
+    LoggerStats *stats = logger_counting(logger);
+    int failed = sink -> ops -> queue(sink, data, len);
+    stats_add(stats, failed ? STATS_ERRORS : STATS_BYTES, failed ? 1 : len);
+}
+
+
+void logger_write_gather(lgimp_t *logger, LOGGER_SINK *sink, GatherList *gather, const LogBuffer *buffer) {
+    LoggerStats *stats = logger_counting(logger);
+    unsigned long long start = stats_start(stats);
+    int failed = gather_write(gather, buffer, sink);
+    stats_time(stats, STATS_WRITE, start);
+    stats_add(stats, failed ? STATS_ERRORS : STATS_BYTES, failed ? 1 : gather -> bytes);
+}
+
+
+/* Queue a record for the writer thread, counting it if it is dropped
+ * Return 0 or -1 if it was dropped */
+static int logger_push(lgimp_t *logger, AsyncQueue *queue, LogRecord *record) {
+    if (async_push(queue, record)) {
+        stats_add(logger_counting(logger), STATS_DROPPED, 1);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Below every sink's level: the macros don't always filter for us */
+static int logger_filtered(lgimp_t *logger, const log_level_t level) {
+    if (level >= atomic_load_explicit(&logger -> min_level, memory_order_relaxed) && level != OFF) {
+        return 0;
+    }
+    stats_add(logger_counting(logger), STATS_FILTERED, 1);
+    return 1;
+}
+
+
+static int logger_recorded(lgimp_t *logger, const log_level_t level) {
+    return level < OFF && level >= atomic_load_explicit(&logger -> record_level, memory_order_relaxed);
+}
+
+
+static void logger_identity_init(void) {
+    if (gethostname(LOGGER_HOSTNAME, sizeof(LOGGER_HOSTNAME)) < 0 || !LOGGER_HOSTNAME[0]) {
+        strcpy(LOGGER_HOSTNAME, "-"); // the nil value of syslog
+    }
+    LOGGER_HOSTNAME[sizeof(LOGGER_HOSTNAME) - 1] = '\0';
+    LOGGER_HOSTNAME_LEN = strlen(LOGGER_HOSTNAME);
+    atomic_store(&LOGGER_PID, getpid());
+    pthread_atfork(NULL, NULL, logger_identity_fork);
+}
+
+
+static void logger_identity_fork(void) {
+    atomic_store(&LOGGER_PID, getpid());
+}
+
+
+/* Dump every registered recorder, then let the signal do what it did before
+ * Only async-signal-safe calls from here */
+static void logger_crash_handler(int sig) {
+    for (size_t i = 0; i < LOGGER_MAX_CRASH_LOGGERS; i++) {
+        lgimp_t *logger = atomic_load(&LOGGER_CRASH_LOGGERS[i].logger);
+        if (!logger) {
+            continue;
+        }
+        const LoggerConfig *config = atomic_load(&logger -> config);
+        if (config -> recorder) {
+            recorder_dump_fd(config -> recorder, LOGGER_CRASH_LOGGERS[i].fd);
+        }
+    }
+    for (size_t i = 0; i < sizeof(LOGGER_CRASH_SIGNALS) / sizeof(int); i++) {
+        if (LOGGER_CRASH_SIGNALS[i] == sig) {
+            sigaction(sig, &LOGGER_CRASH_PREVIOUS[i], NULL);
+        }
+    }
+    raise(sig);
+}
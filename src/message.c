@@ -0,0 +1,551 @@
+#include "message.h"
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGE_CACHE_BITS   10
+#define MESSAGE_CACHE_SIZE   (1 << MESSAGE_CACHE_BITS) // formats kept
+#define MESSAGE_CACHE_PROBES 4
+#define MESSAGE_MAX_WIDTH    4096 // wider fields or precisions go to vsnprintf
+#define MESSAGE_MAX_DIGITS   15 // fraction digits written without snprintf
+
+#define MESSAGE_ARG (-2) // width or precision given with *
+
+enum MESSAGE_FLAG {
+    MESSAGE_LEFT = 1, MESSAGE_PLUS = 2, MESSAGE_SPACE = 4, MESSAGE_ALT = 8, MESSAGE_ZERO = 16
+};
+
+enum MESSAGE_LENGTH {
+    MESSAGE_INT, MESSAGE_CHAR, MESSAGE_SHORT, MESSAGE_LONG, MESSAGE_LLONG,
+    MESSAGE_SIZE, MESSAGE_INTMAX, MESSAGE_PTRDIFF, MESSAGE_LDOUBLE
+};
+
+/* Literal text, then a conversion */
+typedef struct MessageOp {
+    size_t offset; // of the text in the program's source
+    size_t len;
+    char conv; // 0 after the last literal
+    unsigned char length; // MESSAGE_LENGTH
+    unsigned char flags; // MESSAGE_FLAG
+    int width; // 0 for none, or MESSAGE_ARG
+    int precision; // -1 for none, or MESSAGE_ARG
+} MessageOp;
+
+/* A parsed format, the ops are followed by a copy of its text */
+typedef struct MessageProgram {
+    const char *format; // the address it was parsed from
+    const char *source;
+    int fallback; // the whole format goes to vsnprintf
+    size_t count;
+    MessageOp ops[];
+} MessageProgram;
+
+/* Never freed: formats are mostly literals, and readers don't lock */
+static _Atomic(MessageProgram *) MESSAGE_CACHE[MESSAGE_CACHE_SIZE];
+
+static const double MESSAGE_POWERS[MESSAGE_MAX_DIGITS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+static const double MESSAGE_NEGATIVE_POWERS[5] = { 1e0, 1e-1, 1e-2, 1e-3, 1e-4 };
+
+static MessageProgram *message_program(const char *format, int *owned);
+static MessageProgram *message_parse(const char *format);
+static int message_spec(const char **cursor, MessageOp *op);
+static int message_convert(LogBuffer *buffer, const MessageOp *op, va_list *ap);
+static int message_integer(LogBuffer *buffer, char conv, int flags, int width, int precision,
+                           unsigned long long value, int negative);
+static int message_round(double magnitude, int digits, unsigned long long *n);
+static int message_fixed(LogBuffer *buffer, int flags, int width, double value,
+                         unsigned long long n, int digits, int trim);
+static int message_general(LogBuffer *buffer, int flags, int width, int precision, double value);
+static int message_snprintf(LogBuffer *buffer, const MessageOp *op, int flags, int width,
+                            int precision, double value, long double long_value);
+static int message_pad(LogBuffer *buffer, int flags, int width, const char *prefix,
+                       size_t prefix_len, size_t zeros, const char *body, size_t len);
+
+
+int message_vprintf(LogBuffer *buffer, const char *format, va_list args) {
+    int owned = 0;
+    MessageProgram *program = message_program(format, &owned);
+    if (!program || program -> fallback) {
+        if (owned) {
+            free(program);
+        }
+        return buffer_vprintf(buffer, format, args);
+    }
+
+    va_list ap;
+    va_copy(ap, args);
+    int failed = 0;
+    for (size_t i = 0; i < program -> count && !failed; i++) {
+        const MessageOp *op = &program -> ops[i];
+        failed = buffer_append(buffer, program -> source + op -> offset, op -> len);
+        if (!failed && op -> conv) {
+            failed = message_convert(buffer, op, &ap);
+        }
+    }
+    va_end(ap);
+    if (owned) {
+        free(program);
+    }
+    return failed;
+}
+
+
+/* The cached program of format, or a new one the caller frees if *owned */
+static MessageProgram *message_program(const char *format, int *owned) {
+    size_t mask = MESSAGE_CACHE_SIZE - 1;
+    size_t slot = (size_t)(((uintptr_t)format * 0x9E3779B97F4A7C15ULL) >> (64 - MESSAGE_CACHE_BITS));
+    for (size_t i = 0; i < MESSAGE_CACHE_PROBES; i++) {
+        MessageProgram *program = atomic_load_explicit(&MESSAGE_CACHE[(slot + i) & mask],
+                                                       memory_order_acquire);
+        if (!program) {
+            break; // slots are taken in order and never given back
+        }
+        // the same address may hold another text now (a reused buffer)
+        if (program -> format == format && !strcmp(program -> source, format)) {
+            *owned = 0;
+            return program;
+        }
+    }
+
+    MessageProgram *program = message_parse(format);
+    if (!program) {
+        return NULL;
+    }
+    for (size_t i = 0; i < MESSAGE_CACHE_PROBES; i++) {
+        MessageProgram *expected = NULL;
+        if (atomic_compare_exchange_strong_explicit(&MESSAGE_CACHE[(slot + i) & mask], &expected,
+                                                    program, memory_order_release,
+                                                    memory_order_relaxed)) {
+            *owned = 0;
+            return program;
+        }
+    }
+    *owned = 1;
+    return program;
+}
+
+
+static MessageProgram *message_parse(const char *format) {
+    size_t len = strlen(format);
+    size_t count = 1; // each % starts at most one op, then the last literal
+    for (const char *p = format; *p; p++) {
+        count += *p == '%';
+    }
+    MessageProgram *program = malloc(sizeof(MessageProgram) + count * sizeof(MessageOp) + len + 1);
+    if (!program) {
+        return NULL;
+    }
+    char *source = (char *)&program -> ops[count];
+    memcpy(source, format, len + 1);
+    program -> format = format;
+    program -> source = source;
+    program -> fallback = 0;
+    program -> count = 0;
+
+    const char *literal = source;
+    for (;;) {
+        MessageOp *op = &program -> ops[program -> count++];
+        const char *percent = strchr(literal, '%');
+        op -> offset = literal - source;
+        op -> len = percent ? (size_t)(percent - literal) : strlen(literal);
+        op -> conv = 0;
+        if (!percent) {
+            break;
+        }
+        literal = percent + 1;
+        if (message_spec(&literal, op)) {
+            program -> fallback = 1;
+            break;
+        }
+    }
+    return program;
+}
+
+
+/* Read one conversion after its %, return -1 if it isn't handled here */
+static int message_spec(const char **cursor, MessageOp *op) {
+    const char *p = *cursor;
+    op -> flags = 0;
+    op -> width = 0;
+    op -> precision = -1;
+    op -> length = MESSAGE_INT;
+    for (;; p++) {
+        if (*p == '-') op -> flags |= MESSAGE_LEFT;
+        else if (*p == '+') op -> flags |= MESSAGE_PLUS;
+        else if (*p == ' ') op -> flags |= MESSAGE_SPACE;
+        else if (*p == '#') op -> flags |= MESSAGE_ALT;
+        else if (*p == '0') op -> flags |= MESSAGE_ZERO;
+        else break;
+    }
+
+    int *fields[2] = { &op -> width, &op -> precision };
+    for (int i = 0; i < 2; i++) {
+        if (i == 1) {
+            if (*p != '.') {
+                break;
+            }
+            p++;
+            op -> precision = 0;
+        }
+        if (*p == '*') {
+            *fields[i] = MESSAGE_ARG;
+            p++;
+            if (*p >= '0' && *p <= '9') {
+                return -1; // *1$
+            }
+            continue;
+        }
+        int value = 0;
+        for (; *p >= '0' && *p <= '9'; p++) {
+            value = value * 10 + (*p - '0');
+            if (value > MESSAGE_MAX_WIDTH) {
+                return -1;
+            }
+        }
+        if (*p == '$') {
+            return -1; // positional arguments
+        }
+        *fields[i] = value;
+    }
+
+    switch (*p) {
+        case 'h':
+            op -> length = p[1] == 'h' ? MESSAGE_CHAR : MESSAGE_SHORT;
+            p += op -> length == MESSAGE_CHAR ? 2 : 1;
+            break;
+        case 'l':
+            op -> length = p[1] == 'l' ? MESSAGE_LLONG : MESSAGE_LONG;
+            p += op -> length == MESSAGE_LLONG ? 2 : 1;
+            break;
+        case 'q': op -> length = MESSAGE_LLONG; p++; break;
+        case 'L': op -> length = MESSAGE_LDOUBLE; p++; break;
+        case 'z': op -> length = MESSAGE_SIZE; p++; break;
+        case 'j': op -> length = MESSAGE_INTMAX; p++; break;
+        case 't': op -> length = MESSAGE_PTRDIFF; p++; break;
+    }
+
+    op -> conv = *p++;
+    switch (op -> conv) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            if (op -> length == MESSAGE_LDOUBLE) {
+                return -1;
+            }
+            break;
+        case 'c': case 's': case 'p':
+            if (op -> length != MESSAGE_INT) {
+                return -1; // wide characters
+            }
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (op -> length != MESSAGE_INT && op -> length != MESSAGE_LONG &&
+                op -> length != MESSAGE_LDOUBLE) {
+                return -1;
+            }
+            break;
+        case '%':
+            break;
+        default:
+            return -1;
+    }
+    *cursor = p;
+    return 0;
+}
+
+
+static int message_convert(LogBuffer *buffer, const MessageOp *op, va_list *ap) {
+    int flags = op -> flags;
+    int width = op -> width == MESSAGE_ARG ? va_arg(*ap, int) : op -> width;
+    int precision = op -> precision == MESSAGE_ARG ? va_arg(*ap, int) : op -> precision;
+    if (width < 0) {
+        flags |= MESSAGE_LEFT;
+        width = width == INT_MIN ? INT_MAX : -width;
+    }
+    if (precision < 0) {
+        precision = -1;
+    }
+
+    switch (op -> conv) {
+        case 'd': case 'i': {
+            long long value;
+            switch (op -> length) {
+                case MESSAGE_CHAR: value = (signed char)va_arg(*ap, int); break;
+                case MESSAGE_SHORT: value = (short)va_arg(*ap, int); break;
+                case MESSAGE_LONG: value = va_arg(*ap, long); break;
+                case MESSAGE_LLONG: value = va_arg(*ap, long long); break;
+                case MESSAGE_SIZE: value = va_arg(*ap, ptrdiff_t); break; // signed size_t
+                case MESSAGE_INTMAX: value = va_arg(*ap, intmax_t); break;
+                case MESSAGE_PTRDIFF: value = va_arg(*ap, ptrdiff_t); break;
+                default: value = va_arg(*ap, int); break;
+            }
+            unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value
+                                                     : (unsigned long long)value;
+            return message_integer(buffer, 'd', flags, width, precision, magnitude, value < 0);
+        }
+        case 'u': case 'o': case 'x': case 'X': {
+            unsigned long long value;
+            switch (op -> length) {
+                case MESSAGE_CHAR: value = (unsigned char)va_arg(*ap, unsigned); break;
+                case MESSAGE_SHORT: value = (unsigned short)va_arg(*ap, unsigned); break;
+                case MESSAGE_LONG: value = va_arg(*ap, unsigned long); break;
+                case MESSAGE_LLONG: value = va_arg(*ap, unsigned long long); break;
+                case MESSAGE_SIZE: value = va_arg(*ap, size_t); break;
+                case MESSAGE_INTMAX: value = va_arg(*ap, uintmax_t); break;
+                case MESSAGE_PTRDIFF: value = va_arg(*ap, ptrdiff_t); break;
+                default: value = va_arg(*ap, unsigned); break;
+            }
+            // + and space are for signed conversions only
+            flags &= ~(MESSAGE_PLUS | MESSAGE_SPACE);
+            return message_integer(buffer, op -> conv, flags, width, precision, value, 0);
+        }
+        case 'c': {
+            char c = (char)va_arg(*ap, int);
+            return message_pad(buffer, flags, width, "", 0, 0, &c, 1);
+        }
+        case 's': {
+            const char *s = va_arg(*ap, const char *);
+            if (!s) {
+                s = precision < 0 || precision >= 6 ? "(null)" : ""; // as glibc does
+            }
+            size_t len = precision < 0 ? strlen(s) : strnlen(s, precision);
+            return message_pad(buffer, flags, width, "", 0, 0, s, len);
+        }
+        case 'p': {
+            void *pointer = va_arg(*ap, void *);
+            if (!pointer) {
+                return message_pad(buffer, flags, width, "", 0, 0, "(nil)", 5);
+            }
+            flags &= ~(MESSAGE_PLUS | MESSAGE_SPACE);
+            return message_integer(buffer, 'x', flags | MESSAGE_ALT, width, precision,
+                                   (uintptr_t)pointer, 0);
+        }
+        case 'f': case 'F': case 'g': case 'G': case 'e': case 'E': case 'a': case 'A': {
+            if (op -> length == MESSAGE_LDOUBLE) {
+                long double value = va_arg(*ap, long double);
+                return message_snprintf(buffer, op, flags, width, precision, 0, value);
+            }
+            double value = va_arg(*ap, double);
+            int done = 1;
+            if (op -> conv == 'f' || op -> conv == 'F') {
+                unsigned long long n;
+                int digits = precision < 0 ? 6 : precision;
+                if (!message_round(fabs(value), digits, &n)) {
+                    return message_fixed(buffer, flags, width, value, n, digits, 0);
+                }
+            } else if (op -> conv == 'g' || op -> conv == 'G') {
+                done = message_general(buffer, flags, width, precision, value);
+            }
+            if (done <= 0) {
+                return done;
+            }
+            return message_snprintf(buffer, op, flags, width, precision, value, 0);
+        }
+        case '%':
+            return buffer_append(buffer, "%", 1);
+    }
+    return 0;
+}
+
+
+/* [sign or 0x][precision zeros]digits in width */
+static int message_integer(LogBuffer *buffer, char conv, int flags, int width, int precision,
+                           unsigned long long value, int negative) {
+    static const char lower[] = "0123456789abcdef";
+    static const char upper[] = "0123456789ABCDEF";
+    char digits[32];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    int zero = value == 0;
+    if (conv == 'x' || conv == 'X') {
+        const char *hex = conv == 'x' ? lower : upper;
+        do {
+            *--p = hex[value & 15];
+            value >>= 4;
+        } while (value);
+    } else if (conv == 'o') {
+        do {
+            *--p = '0' + (value & 7);
+            value >>= 3;
+        } while (value);
+    } else {
+        p = buffer_digits(end, value);
+    }
+    if (precision == 0 && zero) {
+        p = end; // no digits for 0
+    }
+    size_t len = end - p;
+
+    char prefix[2];
+    size_t prefix_len = 0;
+    if (negative) {
+        prefix[prefix_len++] = '-';
+    } else if (flags & MESSAGE_PLUS) {
+        prefix[prefix_len++] = '+';
+    } else if (flags & MESSAGE_SPACE) {
+        prefix[prefix_len++] = ' ';
+    }
+    if ((flags & MESSAGE_ALT) && !zero && (conv == 'x' || conv == 'X')) {
+        prefix[prefix_len++] = '0';
+        prefix[prefix_len++] = conv;
+    }
+
+    size_t zeros = precision > 0 && (size_t)precision > len ? precision - len : 0;
+    if ((flags & MESSAGE_ALT) && conv == 'o' && !zeros && (!len || *p != '0')) {
+        zeros = 1;
+    }
+    if (precision < 0 && (flags & MESSAGE_ZERO) && !(flags & MESSAGE_LEFT) &&
+        (size_t)width > prefix_len + len) {
+        zeros = width - prefix_len - len;
+    }
+    return message_pad(buffer, flags, width, prefix, prefix_len, zeros, p, len);
+}
+
+
+/* magnitude * 10^digits rounded to the nearest integer in n
+ * The product can be off by half an ulp, so a result too close to a tie
+ * to be sure of is left to snprintf (it rounds the exact value)
+ * Return 0, or -1 if n can't be found here */
+static int message_round(double magnitude, int digits, unsigned long long *n) {
+    if (!isfinite(magnitude) || digits > MESSAGE_MAX_DIGITS) {
+        return -1;
+    }
+    double scaled = magnitude * MESSAGE_POWERS[digits];
+    if (scaled >= 4503599627370496.0) {
+        return -1; // 2^52, the fraction isn't kept anymore
+    }
+    unsigned long long whole = (unsigned long long)scaled;
+    double rest = scaled - (double)whole; // exact
+    double margin = scaled * 0x1p-50;
+    if (rest > 0.5 - margin && rest < 0.5 + margin) {
+        return -1;
+    }
+    *n = whole + (rest > 0.5);
+    return 0;
+}
+
+
+/* n / 10^digits with digits fraction digits, trailing zeros cut if trim */
+static int message_fixed(LogBuffer *buffer, int flags, int width, double value,
+                         unsigned long long n, int digits, int trim) {
+    unsigned long long scale = (unsigned long long)MESSAGE_POWERS[digits];
+    char text[48];
+    char *end = text + sizeof(text);
+    char *p = end;
+    if (digits) {
+        p = buffer_digits(end, n % scale);
+        while (end - p < digits) {
+            *--p = '0';
+        }
+        if (trim && !(flags & MESSAGE_ALT)) {
+            while (end > p && end[-1] == '0') {
+                end--;
+            }
+        }
+    }
+    if (end > p || (flags & MESSAGE_ALT)) {
+        *--p = '.';
+    }
+    p = buffer_digits(p, n / scale);
+    size_t len = end - p;
+
+    char sign = signbit(value) ? '-' : flags & MESSAGE_PLUS ? '+' : flags & MESSAGE_SPACE ? ' ' : 0;
+    size_t prefix_len = sign != 0;
+    size_t zeros = 0;
+    if ((flags & MESSAGE_ZERO) && !(flags & MESSAGE_LEFT) && (size_t)width > prefix_len + len) {
+        zeros = width - prefix_len - len;
+    }
+    return message_pad(buffer, flags, width, &sign, prefix_len, zeros, p, len);
+}
+
+
+/* %g in its fixed notation, with precision significant digits
+ * Return 0, -1 if the buffer could not grow or 1 if snprintf has to do it
+ * (exponent notation, or a value rounding across a power of 10) */
+static int message_general(LogBuffer *buffer, int flags, int width, int precision, double value) {
+    int significant = precision < 0 ? 6 : precision ? precision : 1;
+    double magnitude = fabs(value);
+    if (!isfinite(value) || significant > MESSAGE_MAX_DIGITS) {
+        return 1;
+    }
+    int exponent = 0;
+    if (magnitude != 0) {
+        if (magnitude < 1e-4 || magnitude >= MESSAGE_POWERS[significant]) {
+            return 1;
+        }
+        exponent = significant - 1;
+        while (exponent > -4 && magnitude < (exponent >= 0 ? MESSAGE_POWERS[exponent]
+                                                          : MESSAGE_NEGATIVE_POWERS[-exponent])) {
+            exponent--;
+        }
+    }
+    int digits = significant - 1 - exponent;
+    unsigned long long n;
+    if (message_round(magnitude, digits, &n)) {
+        return 1;
+    }
+    if (magnitude != 0 && (n < (unsigned long long)MESSAGE_POWERS[significant - 1] ||
+                           n >= (unsigned long long)MESSAGE_POWERS[significant])) {
+        return 1;
+    }
+    return message_fixed(buffer, flags, width, value, n, digits, 1);
+}
+
+
+/* One floating conversion through snprintf */
+static int message_snprintf(LogBuffer *buffer, const MessageOp *op, int flags, int width,
+                            int precision, double value, long double long_value) {
+    char spec[32];
+    char *p = spec;
+    *p++ = '%';
+    if (flags & MESSAGE_LEFT) *p++ = '-';
+    if (flags & MESSAGE_PLUS) *p++ = '+';
+    if (flags & MESSAGE_SPACE) *p++ = ' ';
+    if (flags & MESSAGE_ALT) *p++ = '#';
+    if (flags & MESSAGE_ZERO) *p++ = '0';
+    *p++ = '*';
+    *p++ = '.';
+    *p++ = '*';
+    if (op -> length == MESSAGE_LDOUBLE) {
+        *p++ = 'L';
+        *p++ = op -> conv;
+        *p = '\0';
+        return buffer_printf(buffer, spec, width, precision, long_value);
+    }
+    *p++ = op -> conv;
+    *p = '\0';
+    return buffer_printf(buffer, spec, width, precision, value);
+}
+
+
+/* [spaces]prefix[zeros]body[spaces] in width */
+static int message_pad(LogBuffer *buffer, int flags, int width, const char *prefix,
+                       size_t prefix_len, size_t zeros, const char *body, size_t len) {
+    size_t total = prefix_len + zeros + len;
+    size_t pad = (size_t)width > total ? width - total : 0;
+    if (buffer_reserve(buffer, total + pad) < 0) {
+        return -1;
+    }
+    char *out = buffer -> data + buffer -> len;
+    if (!(flags & MESSAGE_LEFT)) {
+        memset(out, ' ', pad);
+        out += pad;
+    }
+    memcpy(out, prefix, prefix_len);
+    out += prefix_len;
+    memset(out, '0', zeros);
+    out += zeros;
+    memcpy(out, body, len);
+    out += len;
+    if (flags & MESSAGE_LEFT) {
+        memset(out, ' ', pad);
+    }
+    buffer -> len += total + pad;
+    return 0;
+}
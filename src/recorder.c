@@ -0,0 +1,194 @@
+#define _POSIX_C_SOURCE 200809L
+#include "recorder.h"
+#include "binlog.h"
+#include "message.h"
+#include "structured.h"
+#include "timestamp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *RECORDER_LEVELS[] = {
+    "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL", "OFF"
+};
+
+static int recorder_read(Recorder *recorder, unsigned long long position, RecorderSlot *out);
+static unsigned long long recorder_begin(Recorder *recorder, unsigned long long end);
+static size_t recorder_append(char *out, size_t at, size_t size, const char *s, size_t len);
+static size_t recorder_number(char *out, size_t at, size_t size, unsigned long long value, int width);
+
+
+Recorder *recorder_create(size_t count, log_level_t level) {
+    size_t size = 1;
+    while (size < count) {
+        size <<= 1;
+    }
+    size_t bytes = (sizeof(Recorder) + size * sizeof(RecorderSlot) + 63) / 64 * 64;
+    Recorder *recorder = aligned_alloc(64, bytes);
+    if (!recorder) {
+        return NULL;
+    }
+    memset(recorder, 0, bytes);
+    recorder -> mask = size - 1;
+    recorder -> level = level;
+    return recorder;
+}
+
+
+void recorder_capture(Recorder *recorder, const LogRecord *record, int written) {
+    unsigned long long position = atomic_fetch_add_explicit(&recorder -> head, 1, memory_order_relaxed);
+    RecorderSlot *slot = &recorder -> slots[position & recorder -> mask];
+    atomic_store_explicit(&slot -> sequence, 2 * position + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot -> fname = record -> fname;
+    slot -> line = record -> line;
+    slot -> level = record -> level;
+    slot -> written = written;
+    slot -> time = record -> time;
+    if (!slot -> time.tv_sec && !slot -> time.tv_nsec) {
+        timestamp_now(&slot -> time, 1);
+    }
+    size_t len;
+    if (record -> args) {
+        LogBuffer *text = buffer_thread_message();
+        size_t start = text -> len;
+        va_list copy;
+        va_copy(copy, *record -> args);
+        len = message_vprintf(text, record -> msg, copy) ? 0 : text -> len - start;
+        va_end(copy);
+        len = len < RECORDER_MSG ? len : RECORDER_MSG - 1;
+        memcpy(slot -> msg, text -> data + start, len);
+        text -> len = start;
+    } else {
+        len = record -> msg_len < RECORDER_MSG ? record -> msg_len : RECORDER_MSG;
+        memcpy(slot -> msg, record -> msg, len);
+    }
+    if (record -> field_count && len < RECORDER_MSG) {
+        LogBuffer *fields = buffer_thread_message();
+        size_t start = fields -> len;
+        if (structured_fields(fields, LOGGER_TEXT, record -> fields, record -> field_count, 0) == 0) {
+            size_t extra = fields -> len - start;
+            extra = extra < RECORDER_MSG - len ? extra : RECORDER_MSG - len;
+            memcpy(slot -> msg + len, fields -> data + start, extra);
+            len += extra;
+        }
+        fields -> len = start;
+    }
+    slot -> len = len;
+
+    atomic_store_explicit(&slot -> sequence, 2 * position + 2, memory_order_release);
+}
+
+
+int recorder_dump(Recorder *recorder, const LoggerConfig *config, const char *ref, LogBuffer *buffer) {
+    unsigned long long end = atomic_load_explicit(&recorder -> head, memory_order_acquire);
+    unsigned long long position = recorder_begin(recorder, end);
+    for (; position < end; position++) {
+        RecorderSlot slot;
+        if (!recorder_read(recorder, position, &slot) || slot.written) {
+            continue; // overwritten, still being written or already out
+        }
+        LogRecord record = {
+            slot.fname, slot.line, slot.level, slot.time, slot.msg, NULL, slot.len, 0, NULL, 0, 0, NULL, ref
+        };
+        if (config -> mode == LOGGER_BINARY) {
+            binlog_record(config -> binary, &record, buffer); // a text entry, args is NULL
+        } else if (logger_render(config, &record, buffer)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void recorder_dump_fd(Recorder *recorder, int fd) {
+    unsigned long long end = atomic_load_explicit(&recorder -> head, memory_order_acquire);
+    unsigned long long position = recorder_begin(recorder, end);
+    for (; position < end; position++) {
+        RecorderSlot slot;
+        if (!recorder_read(recorder, position, &slot)) {
+            continue;
+        }
+        // LEVEL seconds.nanoseconds file:line msg
+        char line[RECORDER_MSG + 128];
+        size_t at = 0, size = sizeof(line) - 1;
+        const char *level = RECORDER_LEVELS[slot.level <= OFF ? slot.level : OFF];
+        const char *fname = slot.fname ? slot.fname : "?";
+        at = recorder_append(line, at, size, level, strlen(level));
+        at = recorder_append(line, at, size, " ", 1);
+        at = recorder_number(line, at, size, slot.time.tv_sec, 1);
+        at = recorder_append(line, at, size, ".", 1);
+        at = recorder_number(line, at, size, slot.time.tv_nsec, 9);
+        at = recorder_append(line, at, size, " ", 1);
+        at = recorder_append(line, at, size, fname, strlen(fname));
+        at = recorder_append(line, at, size, ":", 1);
+        at = recorder_number(line, at, size, slot.line < 0 ? 0 : slot.line, 1);
+        at = recorder_append(line, at, size, " ", 1);
+        at = recorder_append(line, at, size, slot.msg, slot.len);
+        line[at++] = '\n';
+        for (size_t written = 0; written < at; ) {
+            ssize_t n = write(fd, line + written, at - written);
+            if (n <= 0) {
+                return;
+            }
+            written += n;
+        }
+    }
+}
+
+
+/* Copy a slot if it still holds position, 0 if it doesn't */
+static int recorder_read(Recorder *recorder, unsigned long long position, RecorderSlot *out) {
+    RecorderSlot *slot = &recorder -> slots[position & recorder -> mask];
+    unsigned long long sequence = atomic_load_explicit(&slot -> sequence, memory_order_acquire);
+    if (sequence != 2 * position + 2) {
+        return 0;
+    }
+    out -> time = slot -> time;
+    out -> fname = slot -> fname;
+    out -> line = slot -> line;
+    out -> level = slot -> level;
+    out -> written = slot -> written;
+    out -> len = slot -> len < RECORDER_MSG ? slot -> len : RECORDER_MSG;
+    memcpy(out -> msg, slot -> msg, out -> len);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot -> sequence, memory_order_relaxed) == sequence;
+}
+
+
+/* Claim what was captured since the last dump, at most a ring's worth */
+static unsigned long long recorder_begin(Recorder *recorder, unsigned long long end) {
+    unsigned long long start = atomic_exchange_explicit(&recorder -> dumped, end, memory_order_relaxed);
+    if (start >= end) {
+        return end; // a racing dump took them
+    }
+    size_t count = recorder -> mask + 1;
+    return end - start > count ? end - count : start;
+}
+
+
+static size_t recorder_append(char *out, size_t at, size_t size, const char *s, size_t len) {
+    len = len < size - at ? len : size - at;
+    memcpy(out + at, s, len);
+    return at + len;
+}
+
+
+/* value in decimal, zero padded to width */
+static size_t recorder_number(char *out, size_t at, size_t size, unsigned long long value, int width) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value && n < 20);
+    while (n < width && n < 20) {
+        digits[n++] = '0';
+    }
+    while (n && at < size) {
+        out[at++] = digits[--n];
+    }
+    return at;
+}
@@ -0,0 +1,332 @@
+#include "logger_imp.h"
+#include "sink.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REGISTRY_ARENA_BLOCK  (64 * 1024)
+#define REGISTRY_MIN_CAPACITY 64 // power of 2
+#define REGISTRY_ROOT_REF     "root"
+#define REGISTRY_ROOT_FORMAT  "/[[REF]/]/[[LEVEL]/] - ([FILENAME]:[LINE])\n- [MSG]\n" // DEFAULT_LOG_FORMAT
+
+/* A named logger, linked to its parent and children for subtree changes */
+typedef struct RegistryNode {
+    const char *name;
+    unsigned long long hash;
+    lgimp_t *logger;
+    struct RegistryNode *parent;
+    struct RegistryNode *child; // first one
+    struct RegistryNode *sibling; // next child of parent
+} RegistryNode;
+
+/* Links a child to its parent, records are handed to the parent's config
+ * whichever it is at the time (see logger_forward) */
+typedef struct ParentSink {
+    LOGGER_SINK sink;
+    lgimp_t *parent;
+} ParentSink;
+
+/* Loggers live as long as the registry, so they come from blocks freed together */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+} ArenaBlock;
+
+static struct {
+    pthread_mutex_t lock;
+    RegistryNode **table; // open addressing, linear probing
+    size_t capacity;
+    size_t count;
+    ArenaBlock *arena;
+} REGISTRY = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL };
+
+static int registry_sink_write(LOGGER_SINK *sink, const char *data, size_t len);
+static int registry_sink_flush(LOGGER_SINK *sink);
+static void registry_sink_close(LOGGER_SINK *sink);
+
+static const SinkOps REGISTRY_SINK_OPS = {
+    registry_sink_write, registry_sink_flush, registry_sink_close, NULL, NULL
+};
+
+static RegistryNode *registry_get(const char *name, size_t len);
+static RegistryNode *registry_find(const char *name, size_t len, unsigned long long hash);
+static RegistryNode *registry_new(const char *name, size_t len, unsigned long long hash,
+                                  RegistryNode *parent);
+static int registry_insert(RegistryNode *node);
+static void registry_set_level(RegistryNode *node, log_level_t level);
+static void registry_destroy(RegistryNode *node);
+static int registry_valid(const char *name);
+static unsigned long long registry_hash(const char *name, size_t len);
+static void *arena_alloc(size_t size);
+
+
+LOGGER *logger_get(const char *name) {
+    if (!name || !registry_valid(name)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&REGISTRY.lock);
+    RegistryNode *node = registry_get(name, strlen(name));
+    pthread_mutex_unlock(&REGISTRY.lock);
+    return node ? (LOGGER*)node -> logger : NULL;
+}
+
+
+int logger_registry_level(const char *name, const log_level_t level) {
+    if (!name || !registry_valid(name) || level < TRACE || level > OFF) {
+        return -1;
+    }
+    pthread_mutex_lock(&REGISTRY.lock);
+    RegistryNode *node = registry_get(name, strlen(name));
+    if (node) {
+        registry_set_level(node, level);
+    }
+    pthread_mutex_unlock(&REGISTRY.lock);
+    return node ? 0 : -1;
+}
+
+
+void logger_registry_clear(void) {
+    pthread_mutex_lock(&REGISTRY.lock);
+    RegistryNode *root = registry_find("", 0, registry_hash("", 0));
+    if (root) {
+        registry_destroy(root);
+    }
+    while (REGISTRY.arena) {
+        ArenaBlock *next = REGISTRY.arena -> next;
+        free(REGISTRY.arena);
+        REGISTRY.arena = next;
+    }
+    free(REGISTRY.table);
+    REGISTRY.table = NULL;
+    REGISTRY.capacity = 0;
+    REGISTRY.count = 0;
+    pthread_mutex_unlock(&REGISTRY.lock);
+}
+
+
+lgimp_t *registry_parent(const LOGGER_SINK *sink) {
+    return sink -> ops == &REGISTRY_SINK_OPS ? ((const ParentSink *)sink) -> parent : NULL;
+}
+
+
+/* Finished output from the child (records go through logger_forward),
+ * written in the parent's order, behind its queued records */
+static int registry_sink_write(LOGGER_SINK *sink, const char *data, size_t len) {
+    LogRecord record = {0};
+    record.msg = data;
+    record.msg_len = len;
+    record.raw = 1;
+    return logger_forward(((ParentSink *)sink) -> parent, &record);
+}
+
+
+static int registry_sink_flush(LOGGER_SINK *sink) {
+    logger_flush((LOGGER *)((ParentSink *)sink) -> parent);
+    return 0;
+}
+
+
+/* The arena has it */
+static void registry_sink_close(LOGGER_SINK *sink) {
+    (void)sink;
+}
+
+
+/* Find name, creating it and the ancestors it lacks, with the lock held */
+static RegistryNode *registry_get(const char *name, size_t len) {
+    unsigned long long hash = registry_hash(name, len);
+    RegistryNode *node = registry_find(name, len, hash);
+    if (node) {
+        return node;
+    }
+    RegistryNode *parent = NULL;
+    if (len) {
+        size_t parent_len = len;
+        while (parent_len && name[parent_len - 1] != '.') {
+            parent_len--;
+        }
+        parent = registry_get(name, parent_len ? parent_len - 1 : 0);
+        if (!parent) {
+            return NULL;
+        }
+    }
+    return registry_new(name, len, hash, parent);
+}
+
+
+static RegistryNode *registry_find(const char *name, size_t len, unsigned long long hash) {
+    if (!REGISTRY.capacity) {
+        return NULL;
+    }
+    size_t mask = REGISTRY.capacity - 1;
+    for (size_t i = hash & mask; REGISTRY.table[i]; i = (i + 1) & mask) {
+        RegistryNode *node = REGISTRY.table[i];
+        if (node -> hash == hash && !strncmp(node -> name, name, len) && !node -> name[len]) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+
+/* A logger writing to its parent's sink with its parent's format and level,
+ * the root writes to stdout */
+static RegistryNode *registry_new(const char *name, size_t len, unsigned long long hash,
+                                  RegistryNode *parent) {
+    RegistryNode *node = arena_alloc(sizeof(RegistryNode));
+    char *copy = arena_alloc(len + 1);
+    lgimp_t *logger = arena_alloc(LOGGER_IMP_SIZE);
+    if (!node || !copy || !logger) {
+        return NULL;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    node -> name = copy;
+    node -> hash = hash;
+    node -> parent = parent;
+    node -> child = NULL;
+    node -> sibling = NULL;
+
+    LOGGER *created;
+    if (!parent) {
+        LOGGER_SINK *sink = sink_file(stdout);
+        if (!sink) {
+            return NULL;
+        }
+        created = logger_init(logger, REGISTRY_ROOT_REF, sink, 1, isatty(fileno(stdout)),
+                              REGISTRY_ROOT_FORMAT, INFO);
+        if (!created) {
+            logger_sink_close(sink);
+            return NULL;
+        }
+    } else {
+        ParentSink *sink = arena_alloc(sizeof(ParentSink));
+        if (!sink) {
+            return NULL;
+        }
+        sink -> sink.ops = &REGISTRY_SINK_OPS;
+        sink -> sink.file = NULL;
+        sink -> parent = parent -> logger;
+        unsigned token = 0;
+        const LoggerConfig *config = logger_read_lock(parent -> logger, &token);
+        created = logger_init(logger, node -> name, &sink -> sink, 0, config -> colored,
+                              config -> format ? config -> format -> source : NULL,
+                              atomic_load(&parent -> logger -> sink_level));
+        logger_read_unlock(parent -> logger, token);
+        if (!created) {
+            return NULL;
+        }
+    }
+    logger_enable_threadsafe(created); // any thread may get it from the registry
+    logger -> pooled = 1;
+    node -> logger = logger;
+
+    if (registry_insert(node)) {
+        logger_destroy(logger);
+        return NULL;
+    }
+    if (parent) {
+        node -> sibling = parent -> child;
+        parent -> child = node;
+    }
+    return node;
+}
+
+
+static int registry_insert(RegistryNode *node) {
+    if ((REGISTRY.count + 1) * 10 > REGISTRY.capacity * 7) {
+        size_t capacity = REGISTRY.capacity ? REGISTRY.capacity * 2 : REGISTRY_MIN_CAPACITY;
+        RegistryNode **table = calloc(capacity, sizeof(RegistryNode *));
+        if (!table) {
+            return -1;
+        }
+        for (size_t i = 0; i < REGISTRY.capacity; i++) {
+            RegistryNode *moved = REGISTRY.table[i];
+            if (moved) {
+                size_t j = moved -> hash & (capacity - 1);
+                while (table[j]) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                table[j] = moved;
+            }
+        }
+        free(REGISTRY.table);
+        REGISTRY.table = table;
+        REGISTRY.capacity = capacity;
+    }
+    size_t mask = REGISTRY.capacity - 1;
+    size_t i = node -> hash & mask;
+    while (REGISTRY.table[i]) {
+        i = (i + 1) & mask;
+    }
+    REGISTRY.table[i] = node;
+    REGISTRY.count++;
+    return 0;
+}
+
+
+static void registry_set_level(RegistryNode *node, log_level_t level) {
+    logger_change_level((LOGGER*)node -> logger, level);
+    for (RegistryNode *child = node -> child; child; child = child -> sibling) {
+        registry_set_level(child, level);
+    }
+}
+
+
+/* Children first, they write through their parent */
+static void registry_destroy(RegistryNode *node) {
+    for (RegistryNode *child = node -> child; child; child = child -> sibling) {
+        registry_destroy(child);
+    }
+    logger_destroy(node -> logger);
+}
+
+
+/* "" or dot separated non-empty parts */
+static int registry_valid(const char *name) {
+    if (!*name) {
+        return 1;
+    }
+    char previous = '.';
+    for (const char *p = name; *p; p++) {
+        if (*p == '.' && previous == '.') {
+            return 0;
+        }
+        previous = *p;
+    }
+    return previous != '.';
+}
+
+
+/* FNV-1a */
+static unsigned long long registry_hash(const char *name, size_t len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/* 64 aligned pieces of the current block, a new block when it is full */
+static void *arena_alloc(size_t size) {
+    size = (size + 63) / 64 * 64;
+    const size_t header = (sizeof(ArenaBlock) + 63) / 64 * 64;
+    ArenaBlock *block = REGISTRY.arena;
+    if (!block || block -> size - block -> used < size) {
+        size_t block_size = header + size > REGISTRY_ARENA_BLOCK ? header + size : REGISTRY_ARENA_BLOCK;
+        block = aligned_alloc(64, block_size);
+        if (!block) {
+            return NULL;
+        }
+        block -> next = REGISTRY.arena;
+        block -> used = header;
+        block -> size = block_size;
+        REGISTRY.arena = block;
+    }
+    void *p = (char *)block + block -> used;
+    block -> used += size;
+    return p;
+}
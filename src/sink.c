@@ -0,0 +1,68 @@
+#include "sink.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int sink_file_write(LOGGER_SINK *sink, const char *data, size_t len);
+static int sink_file_flush(LOGGER_SINK *sink);
+static void sink_file_close(LOGGER_SINK *sink);
+
+static const SinkOps SINK_FILE_OPS = {
+    sink_file_write, sink_file_flush, sink_file_close, NULL, NULL
+};
+
+
+LOGGER_SINK *sink_file(FILE *file) {
+    LOGGER_SINK *sink = malloc(sizeof(LOGGER_SINK));
+    if (!sink) {
+        return NULL;
+    }
+    sink -> ops = &SINK_FILE_OPS;
+    sink -> file = file;
+    return sink;
+}
+
+
+void logger_sink_close(LOGGER_SINK *sink) {
+    if (sink) {
+        sink -> ops -> close(sink);
+    }
+}
+
+
+/* What the FILE holds goes first, then the record is a single write(2):
+ * a buffered fwrite could cut it where another process appends its own
+ * FILEs without a descriptor (fmemopen, fopencookie) get an fwrite */
+static int sink_file_write(LOGGER_SINK *sink, const char *data, size_t len) {
+    FILE *file = sink -> file;
+    flockfile(file); // no other thread's record in between
+    int fd = fileno(file);
+    int failed = 0;
+    if (fd < 0) {
+        failed = fwrite(data, 1, len, file) != len;
+    } else if (fflush(file)) {
+        failed = 1;
+    }
+    while (fd >= 0 && !failed && len) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            failed = errno != EINTR;
+            continue;
+        }
+        data += written;
+        len -= written;
+    }
+    funlockfile(file);
+    return failed ? -1 : 0;
+}
+
+
+static int sink_file_flush(LOGGER_SINK *sink) {
+    return fflush(sink -> file) == 0 ? 0 : -1;
+}
+
+
+/* The file belongs to the user, it may even be closed already */
+static void sink_file_close(LOGGER_SINK *sink) {
+    free(sink);
+}
@@ -0,0 +1,99 @@
+#include "sink.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Records go to the descriptor with write and writev, no stdio in between
+ * Each call is one system call unless the kernel takes less than asked,
+ * which regular files only do when the disk is full */
+typedef struct FdSink {
+    LOGGER_SINK base;
+    int fd;
+    int close_fd;
+} FdSink;
+
+static int fd_sink_write(LOGGER_SINK *base, const char *data, size_t len);
+static int fd_sink_writev(LOGGER_SINK *base, const struct iovec *iov, int count);
+static int fd_sink_flush(LOGGER_SINK *base);
+static void fd_sink_close(LOGGER_SINK *base);
+
+static const SinkOps SINK_FD_OPS = {
+    fd_sink_write, fd_sink_flush, fd_sink_close, fd_sink_writev, NULL
+};
+
+
+LOGGER_SINK *logger_sink_fd(int fd, int close_fd) {
+    if (fd < 0) {
+        return NULL;
+    }
+    FdSink *sink = malloc(sizeof(FdSink));
+    if (!sink) {
+        return NULL;
+    }
+    sink -> base.ops = &SINK_FD_OPS;
+    sink -> base.file = NULL;
+    sink -> fd = fd;
+    sink -> close_fd = close_fd;
+    return &sink -> base;
+}
+
+
+static int fd_sink_write(LOGGER_SINK *base, const char *data, size_t len) {
+    FdSink *sink = (FdSink *)base;
+    while (len) {
+        ssize_t written = write(sink -> fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+/* Finish a short writev from where the kernel stopped */
+static int fd_sink_writev(LOGGER_SINK *base, const struct iovec *iov, int count) {
+    FdSink *sink = (FdSink *)base;
+    while (count) {
+        ssize_t written = writev(sink -> fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count && (size_t)written >= iov -> iov_len) {
+            written -= iov -> iov_len;
+            iov++;
+            count--;
+        }
+        if (written) {
+            if (fd_sink_write(base, (const char *)iov -> iov_base + written, iov -> iov_len - written) < 0) {
+                return -1;
+            }
+            iov++;
+            count--;
+        }
+    }
+    return 0;
+}
+
+
+/* Nothing is kept in user space */
+static int fd_sink_flush(LOGGER_SINK *base) {
+    (void)base;
+    return 0;
+}
+
+
+static void fd_sink_close(LOGGER_SINK *base) {
+    FdSink *sink = (FdSink *)base;
+    if (sink -> close_fd) {
+        close(sink -> fd);
+    }
+    free(sink);
+}
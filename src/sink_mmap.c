@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MMAP_DEFAULT_WINDOW (16 * 1024 * 1024)
+
+/* Records are copied into a shared mapping of the file, one window at a time
+ * The window is allocated on disk before it is mapped, so running out of
+ * space is an error from write instead of a SIGBUS */
+typedef struct MmapSink {
+    LOGGER_SINK base;
+    int fd;
+    int sync; // LOGGER_MSYNC_*
+    char *window; // maps [window_start, window_start + window_size) of the file
+    off_t window_start;
+    size_t window_size;
+    off_t length; // bytes logged, the file is cut back to it on close
+    pthread_mutex_t lock;
+} MmapSink;
+
+static int mmap_sink_write(LOGGER_SINK *base, const char *data, size_t len);
+static int mmap_sink_flush(LOGGER_SINK *base);
+static void mmap_sink_close(LOGGER_SINK *base);
+static int mmap_sink_map(MmapSink *sink, off_t offset);
+static int mmap_sink_sync(MmapSink *sink);
+
+static const SinkOps SINK_MMAP_OPS = {
+    mmap_sink_write, mmap_sink_flush, mmap_sink_close, NULL, NULL
+};
+
+
+LOGGER_SINK *logger_sink_mmap(const char *path, size_t window, int sync) {
+    if (!path || sync < LOGGER_MSYNC_NONE || sync > LOGGER_MSYNC_SYNC) {
+        return NULL;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (!window) {
+        window = MMAP_DEFAULT_WINDOW;
+    }
+    window = (window + page - 1) / page * page;
+
+    MmapSink *sink = malloc(sizeof(MmapSink));
+    if (!sink) {
+        return NULL;
+    }
+    sink -> fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (sink -> fd < 0 || fstat(sink -> fd, &st) < 0) {
+        fprintf(stderr, "liblogger: can't open \"%s\": %s\n", path, strerror(errno));
+        if (sink -> fd >= 0) {
+            close(sink -> fd);
+        }
+        free(sink);
+        return NULL;
+    }
+    sink -> base.ops = &SINK_MMAP_OPS;
+    sink -> base.file = NULL;
+    sink -> sync = sync;
+    sink -> window = NULL;
+    sink -> window_start = 0;
+    sink -> window_size = window;
+    sink -> length = st.st_size; // append to what is there
+    pthread_mutex_init(&sink -> lock, NULL);
+
+    if (mmap_sink_map(sink, sink -> length) < 0) {
+        fprintf(stderr, "liblogger: can't map \"%s\": %s\n", path, strerror(errno));
+        pthread_mutex_destroy(&sink -> lock);
+        close(sink -> fd);
+        free(sink);
+        return NULL;
+    }
+    return (LOGGER_SINK *)sink;
+}
+
+
+/* A record crossing the end of the window is split over the next one */
+static int mmap_sink_write(LOGGER_SINK *base, const char *data, size_t len) {
+    MmapSink *sink = (MmapSink *)base;
+    int failed = 0;
+    pthread_mutex_lock(&sink -> lock);
+    while (len) {
+        size_t used = sink -> length - sink -> window_start;
+        if (!sink -> window || used == sink -> window_size) {
+            if (mmap_sink_map(sink, sink -> length) < 0) {
+                failed = -1;
+                break;
+            }
+            used = sink -> length - sink -> window_start;
+        }
+        size_t n = sink -> window_size - used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(sink -> window + used, data, n);
+        sink -> length += n;
+        data += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&sink -> lock);
+    return failed;
+}
+
+
+static int mmap_sink_flush(LOGGER_SINK *base) {
+    MmapSink *sink = (MmapSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    int failed = mmap_sink_sync(sink);
+    pthread_mutex_unlock(&sink -> lock);
+    return failed;
+}
+
+
+/* Give the preallocated tail back so the file ends at the last record */
+static void mmap_sink_close(LOGGER_SINK *base) {
+    MmapSink *sink = (MmapSink *)base;
+    if (sink -> window) {
+        mmap_sink_sync(sink);
+        munmap(sink -> window, sink -> window_size);
+    }
+    if (ftruncate(sink -> fd, sink -> length) == 0 && sink -> sync == LOGGER_MSYNC_SYNC) {
+        fsync(sink -> fd);
+    }
+    close(sink -> fd);
+    pthread_mutex_destroy(&sink -> lock);
+    free(sink);
+}
+
+
+/* Unmap the current window and map the one holding offset
+ * Return 0 or -1 with errno set */
+static int mmap_sink_map(MmapSink *sink, off_t offset) {
+    if (sink -> window) {
+        mmap_sink_sync(sink);
+        munmap(sink -> window, sink -> window_size);
+        sink -> window = NULL;
+    }
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = offset / page * page;
+
+    if (fallocate(sink -> fd, 0, start, sink -> window_size) < 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            return -1;
+        }
+        // the file system can't reserve blocks, at least make the pages exist
+        struct stat st;
+        if (fstat(sink -> fd, &st) < 0) {
+            return -1;
+        }
+        if (st.st_size < start + (off_t)sink -> window_size &&
+            ftruncate(sink -> fd, start + sink -> window_size) < 0) {
+            return -1;
+        }
+    }
+
+    void *window = mmap(NULL, sink -> window_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, sink -> fd, start);
+    if (window == MAP_FAILED) {
+        return -1;
+    }
+    sink -> window = window;
+    sink -> window_start = start;
+    return 0;
+}
+
+
+/* Push the written part of the window to disk as the policy asks */
+static int mmap_sink_sync(MmapSink *sink) {
+    size_t used = sink -> length - sink -> window_start;
+    if (!sink -> window || !used || sink -> sync == LOGGER_MSYNC_NONE) {
+        return 0;
+    }
+    int flags = sink -> sync == LOGGER_MSYNC_SYNC ? MS_SYNC : MS_ASYNC;
+    return msync(sink -> window, used, flags) == 0 ? 0 : -1;
+}
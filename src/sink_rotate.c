@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+#include "epoch.h"
+#include "sink.h"
+#include "timestamp.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define ROTATE_DEFAULT_SUFFIX "%Y%m%d-%H%M%S"
+#define ROTATE_SUFFIX_SIZE    256
+
+extern char **environ;
+
+/* Work for the helper thread: close fd once no writer can still be using it,
+ * then compress archive and drop the segments past the retention count */
+typedef struct RotateJob {
+    struct RotateJob *next;
+    int fd;
+    char *archive; // NULL when the sink is closing
+} RotateJob;
+
+/* Writers load fd and write to it inside the guard, a rotation renames
+ * the file, opens a new one under path and swaps fd, the old one is
+ * closed by the helper after the guard let every writer out */
+typedef struct RotateSink {
+    LOGGER_SINK base;
+    EpochGuard guard;
+    atomic_int fd;
+    atomic_size_t size; // bytes in the current segment
+    atomic_llong deadline; // when the interval runs out, 0 without interval
+    size_t max_size;
+    long interval;
+    int keep;
+    int compress;
+    char *path;
+    char *suffix;
+    pthread_mutex_t rotate_lock; // one rotation at a time
+    SinkPreamble preamble; // set and called under rotate_lock
+    void *preamble_arg;
+
+    pthread_t helper;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_wake;
+    RotateJob *jobs;
+    RotateJob **jobs_tail;
+    int stop;
+    char **history; // archives, oldest first, only touched by the helper
+    size_t history_len;
+    size_t history_cap;
+} RotateSink;
+
+typedef struct RotateEntry {
+    char *name;
+    time_t mtime;
+} RotateEntry;
+
+static int rotate_sink_write(LOGGER_SINK *base, const char *data, size_t len);
+static int rotate_sink_flush(LOGGER_SINK *base);
+static void rotate_sink_close(LOGGER_SINK *base);
+static int rotate_sink_due(RotateSink *sink, size_t len, time_t now);
+static void rotate_sink_rotate(RotateSink *sink, size_t len);
+static void rotate_sink_preamble(RotateSink *sink, int fd);
+static char *rotate_sink_archive_name(RotateSink *sink, time_t now);
+static int rotate_sink_queue(RotateSink *sink, int fd, char *archive);
+static void *rotate_sink_helper(void *arg);
+static char *rotate_sink_compress(char *archive);
+static int rotate_sink_remember(RotateSink *sink, char *archive);
+static void rotate_sink_scan(RotateSink *sink);
+static int rotate_sink_is_archive(const RotateSink *sink, const char *suffix);
+static int rotate_entry_compare(const void *a, const void *b);
+
+static const SinkOps SINK_ROTATE_OPS = {
+    rotate_sink_write, rotate_sink_flush, rotate_sink_close, NULL, NULL
+};
+
+
+LOGGER_SINK *logger_sink_rotating(const char *path, const char *suffix,
+                                  size_t max_size, long interval,
+                                  int keep, int compress) {
+    if (!path || interval < 0 || keep < 0) {
+        return NULL;
+    }
+    size_t size = (sizeof(RotateSink) + 63) / 64 * 64;
+    RotateSink *sink = aligned_alloc(64, size);
+    if (!sink) {
+        return NULL;
+    }
+    memset(sink, 0, sizeof(RotateSink));
+    sink -> path = strdup(path);
+    sink -> suffix = strdup(suffix ? suffix : ROTATE_DEFAULT_SUFFIX);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (!sink -> path || !sink -> suffix || fd < 0 || fstat(fd, &st) < 0) {
+        if (fd < 0) {
+            fprintf(stderr, "liblogger: can't open \"%s\": %s\n", path, strerror(errno));
+        } else {
+            close(fd);
+        }
+        free(sink -> path);
+        free(sink -> suffix);
+        free(sink);
+        return NULL;
+    }
+
+    sink -> base.ops = &SINK_ROTATE_OPS;
+    sink -> base.file = NULL;
+    atomic_init(&sink -> fd, fd);
+    atomic_init(&sink -> size, st.st_size);
+    sink -> max_size = max_size;
+    sink -> interval = interval;
+    sink -> keep = keep;
+    sink -> compress = compress;
+    if (interval) {
+        struct timespec now;
+        timestamp_now(&now, 0);
+        atomic_init(&sink -> deadline, (now.tv_sec / interval + 1) * interval);
+    }
+    sink -> jobs_tail = &sink -> jobs;
+    pthread_mutex_init(&sink -> rotate_lock, NULL);
+    pthread_mutex_init(&sink -> jobs_lock, NULL);
+    pthread_cond_init(&sink -> jobs_wake, NULL);
+    rotate_sink_scan(sink);
+
+    if (pthread_create(&sink -> helper, NULL, rotate_sink_helper, sink) != 0) {
+        close(fd);
+        for (size_t i = 0; i < sink -> history_len; i++) {
+            free(sink -> history[i]);
+        }
+        free(sink -> history);
+        pthread_mutex_destroy(&sink -> rotate_lock);
+        pthread_mutex_destroy(&sink -> jobs_lock);
+        pthread_cond_destroy(&sink -> jobs_wake);
+        free(sink -> path);
+        free(sink -> suffix);
+        free(sink);
+        return NULL;
+    }
+    return (LOGGER_SINK *)sink;
+}
+
+
+static int rotate_sink_write(LOGGER_SINK *base, const char *data, size_t len) {
+    RotateSink *sink = (RotateSink *)base;
+    struct timespec now = {0, 0};
+    if (sink -> interval) {
+        timestamp_now(&now, 0);
+    }
+    if (rotate_sink_due(sink, len, now.tv_sec)) {
+        rotate_sink_rotate(sink, len);
+    }
+    atomic_fetch_add_explicit(&sink -> size, len, memory_order_relaxed);
+
+    unsigned token = epoch_enter(&sink -> guard);
+    int fd = atomic_load_explicit(&sink -> fd, memory_order_acquire);
+    int failed = 0;
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = -1;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    epoch_exit(&sink -> guard, token);
+    return failed;
+}
+
+
+/* Records go straight to the kernel, there is nothing to flush */
+static int rotate_sink_flush(LOGGER_SINK *base) {
+    (void)base;
+    return 0;
+}
+
+
+static void rotate_sink_close(LOGGER_SINK *base) {
+    RotateSink *sink = (RotateSink *)base;
+    int fd = atomic_load(&sink -> fd);
+    if (rotate_sink_queue(sink, fd, NULL) < 0) {
+        close(fd);
+    }
+    pthread_mutex_lock(&sink -> jobs_lock);
+    sink -> stop = 1;
+    pthread_cond_signal(&sink -> jobs_wake);
+    pthread_mutex_unlock(&sink -> jobs_lock);
+    pthread_join(sink -> helper, NULL); // finishes the queued jobs first
+
+    for (size_t i = 0; i < sink -> history_len; i++) {
+        free(sink -> history[i]);
+    }
+    free(sink -> history);
+    pthread_mutex_destroy(&sink -> rotate_lock);
+    pthread_mutex_destroy(&sink -> jobs_lock);
+    pthread_cond_destroy(&sink -> jobs_wake);
+    free(sink -> path);
+    free(sink -> suffix);
+    free(sink);
+}
+
+
+/* A record that would overflow a non empty segment, or the interval is over */
+static int rotate_sink_due(RotateSink *sink, size_t len, time_t now) {
+    if (sink -> max_size) {
+        size_t size = atomic_load_explicit(&sink -> size, memory_order_relaxed);
+        if (size && size + len > sink -> max_size) {
+            return 1;
+        }
+    }
+    long long deadline = atomic_load_explicit(&sink -> deadline, memory_order_relaxed);
+    return deadline && now >= deadline;
+}
+
+
+/* Only one writer rotates, the others go on with whichever fd they load */
+static void rotate_sink_rotate(RotateSink *sink, size_t len) {
+    if (pthread_mutex_trylock(&sink -> rotate_lock) != 0) {
+        return;
+    }
+    struct timespec now;
+    timestamp_now(&now, 0);
+    if (!rotate_sink_due(sink, len, now.tv_sec)) {
+        pthread_mutex_unlock(&sink -> rotate_lock); // someone was faster
+        return;
+    }
+    if (sink -> interval) {
+        // even if the rotation fails, don't retry on every record
+        atomic_store(&sink -> deadline, (now.tv_sec / sink -> interval + 1) * sink -> interval);
+    }
+
+    // writers still on the old fd now write to the archive, nothing is lost
+    char *archive = rotate_sink_archive_name(sink, now.tv_sec);
+    if (!archive || rename(sink -> path, archive) < 0) {
+        free(archive);
+        atomic_store(&sink -> size, 0); // try again a segment later
+        pthread_mutex_unlock(&sink -> rotate_lock);
+        return;
+    }
+    int fd = open(sink -> path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        rename(archive, sink -> path);
+        free(archive);
+        atomic_store(&sink -> size, 0);
+        pthread_mutex_unlock(&sink -> rotate_lock);
+        return;
+    }
+    // nobody writes to the new file before it is swapped in, the preamble
+    // isn't counted or a large one would rotate on every record
+    rotate_sink_preamble(sink, fd);
+    int old = atomic_exchange_explicit(&sink -> fd, fd, memory_order_acq_rel);
+    atomic_store(&sink -> size, 0);
+    if (rotate_sink_queue(sink, old, archive) < 0) {
+        free(archive); // leak the fd rather than close it under a writer
+    }
+    pthread_mutex_unlock(&sink -> rotate_lock);
+}
+
+
+int sink_rotating_preamble(LOGGER_SINK *base, SinkPreamble preamble, void *arg) {
+    if (!base || base -> ops != &SINK_ROTATE_OPS) {
+        return -1;
+    }
+    RotateSink *sink = (RotateSink *)base;
+    pthread_mutex_lock(&sink -> rotate_lock);
+    sink -> preamble = preamble;
+    sink -> preamble_arg = arg;
+    pthread_mutex_unlock(&sink -> rotate_lock);
+    return 0;
+}
+
+
+/* Write the preamble to a new file, with rotate_lock held */
+static void rotate_sink_preamble(RotateSink *sink, int fd) {
+    if (!sink -> preamble) {
+        return;
+    }
+    LogBuffer buffer = {0};
+    size_t written = 0;
+    if (sink -> preamble(sink -> preamble_arg, &buffer) == 0) {
+        while (written < buffer.len) {
+            ssize_t n = write(fd, buffer.data + written, buffer.len - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                break;
+            }
+            written += n;
+        }
+    }
+    free(buffer.data);
+}
+
+
+/* path.suffix (strftime'd), with -N added if that name is taken */
+static char *rotate_sink_archive_name(RotateSink *sink, time_t now) {
+    struct tm tm;
+    char suffix[ROTATE_SUFFIX_SIZE];
+    localtime_r(&now, &tm);
+    if (!strftime(suffix, sizeof(suffix), sink -> suffix, &tm)) {
+        suffix[0] = '\0';
+    }
+    size_t size = strlen(sink -> path) + strlen(suffix) + 32;
+    char *name = malloc(size);
+    if (!name) {
+        return NULL;
+    }
+    snprintf(name, size, "%s.%s", sink -> path, suffix);
+    size_t base_len = strlen(name);
+    for (int n = 1; ; n++) {
+        char compressed[base_len + 32];
+        snprintf(compressed, sizeof(compressed), "%s.gz", name);
+        if (access(name, F_OK) < 0 && access(compressed, F_OK) < 0) {
+            return name;
+        }
+        snprintf(name + base_len, size - base_len, "-%d", n);
+    }
+}
+
+
+/* Return 0 or -1 if out of memory */
+static int rotate_sink_queue(RotateSink *sink, int fd, char *archive) {
+    RotateJob *job = malloc(sizeof(RotateJob));
+    if (!job) {
+        return -1;
+    }
+    job -> next = NULL;
+    job -> fd = fd;
+    job -> archive = archive;
+    pthread_mutex_lock(&sink -> jobs_lock);
+    *sink -> jobs_tail = job;
+    sink -> jobs_tail = &job -> next;
+    pthread_cond_signal(&sink -> jobs_wake);
+    pthread_mutex_unlock(&sink -> jobs_lock);
+    return 0;
+}
+
+
+/* Everything slow about a rotation happens here, away from the writers */
+static void *rotate_sink_helper(void *arg) {
+    RotateSink *sink = arg;
+    pthread_mutex_lock(&sink -> jobs_lock);
+    for (;;) {
+        while (!sink -> jobs && !sink -> stop) {
+            pthread_cond_wait(&sink -> jobs_wake, &sink -> jobs_lock);
+        }
+        RotateJob *job = sink -> jobs;
+        if (!job) {
+            break;
+        }
+        sink -> jobs = job -> next;
+        if (!sink -> jobs) {
+            sink -> jobs_tail = &sink -> jobs;
+        }
+        pthread_mutex_unlock(&sink -> jobs_lock);
+
+        epoch_synchronize(&sink -> guard); // no writer is left on job -> fd
+        close(job -> fd);
+        if (job -> archive) {
+            char *archive = job -> archive;
+            if (sink -> compress) {
+                archive = rotate_sink_compress(archive);
+            }
+            if (rotate_sink_remember(sink, archive) < 0) {
+                free(archive);
+            }
+        }
+        free(job);
+        pthread_mutex_lock(&sink -> jobs_lock);
+    }
+    pthread_mutex_unlock(&sink -> jobs_lock);
+    return NULL;
+}
+
+
+/* gzip the archive, return its new name, or the old one if gzip failed */
+static char *rotate_sink_compress(char *archive) {
+    char *argv[] = {"gzip", "-f", "--", archive, NULL};
+    pid_t pid;
+    int status;
+    if (posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ) != 0) {
+        return archive;
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return archive;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return archive;
+    }
+    size_t len = strlen(archive);
+    char *compressed = malloc(len + 4);
+    if (!compressed) {
+        return archive;
+    }
+    memcpy(compressed, archive, len);
+    memcpy(compressed + len, ".gz", 4);
+    free(archive);
+    return compressed;
+}
+
+
+/* Add the newest archive and delete the oldest ones past keep
+ * Return -1 if it could not be remembered (archive is not taken) */
+static int rotate_sink_remember(RotateSink *sink, char *archive) {
+    if (sink -> history_len == sink -> history_cap) {
+        size_t cap = sink -> history_cap ? sink -> history_cap * 2 : 16;
+        char **history = realloc(sink -> history, cap * sizeof(char *));
+        if (!history) {
+            return -1;
+        }
+        sink -> history = history;
+        sink -> history_cap = cap;
+    }
+    sink -> history[sink -> history_len++] = archive;
+    if (!sink -> keep || sink -> history_len <= (size_t)sink -> keep) {
+        return 0;
+    }
+    size_t extra = sink -> history_len - sink -> keep;
+    for (size_t i = 0; i < extra; i++) {
+        unlink(sink -> history[i]);
+        free(sink -> history[i]);
+    }
+    memmove(sink -> history, sink -> history + extra, sink -> keep * sizeof(char *));
+    sink -> history_len = sink -> keep;
+    return 0;
+}
+
+
+/* Archives left by an earlier run count toward keep too:
+ * every file next to path named as this sink names them, oldest first */
+static void rotate_sink_scan(RotateSink *sink) {
+    const char *slash = strrchr(sink -> path, '/');
+    size_t dir_len = slash ? (size_t)(slash - sink -> path) + 1 : 0;
+    const char *base = sink -> path + dir_len;
+    size_t base_len = strlen(base);
+    char dir[dir_len + 2];
+    if (dir_len) {
+        memcpy(dir, sink -> path, dir_len);
+        dir[dir_len] = '\0';
+    } else {
+        memcpy(dir, ".", 2);
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    RotateEntry *entries = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (strncmp(entry -> d_name, base, base_len) != 0 || entry -> d_name[base_len] != '.' ||
+            !rotate_sink_is_archive(sink, entry -> d_name + base_len + 1)) {
+            continue;
+        }
+        size_t size = dir_len + strlen(entry -> d_name) + 1;
+        char *name = malloc(size);
+        struct stat st;
+        if (!name) {
+            break;
+        }
+        snprintf(name, size, "%.*s%s", (int)dir_len, sink -> path, entry -> d_name);
+        if (stat(name, &st) < 0 || !S_ISREG(st.st_mode)) {
+            free(name);
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            RotateEntry *grown = realloc(entries, cap * sizeof(RotateEntry));
+            if (!grown) {
+                free(name);
+                break;
+            }
+            entries = grown;
+        }
+        entries[count].name = name;
+        entries[count].mtime = st.st_mtime;
+        count++;
+    }
+    closedir(d);
+
+    if (count) {
+        qsort(entries, count, sizeof(RotateEntry), rotate_entry_compare);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (rotate_sink_remember(sink, entries[i].name) < 0) {
+            free(entries[i].name);
+        }
+    }
+    free(entries);
+}
+
+
+/* Whether suffix (what follows "path.") is one rotate_sink_archive_name
+ * could have made: the strftime suffix, then maybe -N, then maybe .gz
+ * Anything else is somebody else's file and is left alone */
+static int rotate_sink_is_archive(const RotateSink *sink, const char *suffix) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *rest = strptime(suffix, sink -> suffix, &tm);
+    if (!rest) {
+        return 0;
+    }
+    if (rest[0] == '-' && rest[1] >= '0' && rest[1] <= '9') {
+        rest++;
+        while (*rest >= '0' && *rest <= '9') {
+            rest++;
+        }
+    }
+    return !*rest || !strcmp(rest, ".gz");
+}
+
+
+static int rotate_entry_compare(const void *a, const void *b) {
+    time_t x = ((const RotateEntry *)a) -> mtime;
+    time_t y = ((const RotateEntry *)b) -> mtime;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include "sink.h"
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define SOCKET_DEFAULT_QUEUE 1024
+#define SOCKET_BATCH         64 // datagrams per sendmmsg
+#define SOCKET_RETRY_NS      500000000L // between connection attempts
+#define SOCKET_FRAME_SIZE    24 // room for an octet count and its space
+
+/* Records wait in a bounded queue, back to back in one buffer, and go out
+ * as soon as the socket takes them: one datagram each through sendmmsg,
+ * or as many as fit in one sendmsg on a stream
+ * The socket never blocks, when the collector is slow or gone the queue
+ * fills up and new records are dropped until there is room again
+ * A refused or broken connection is retried at most every SOCKET_RETRY_NS,
+ * the queued records are sent once it is back */
+typedef struct SocketRecord {
+    size_t offset;
+    size_t len;
+} SocketRecord;
+
+typedef struct SocketSink {
+    LOGGER_SINK base;
+    int type; // LOGGER_SOCKET_*
+    int rfc5424;
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    int fd; // -1 while not connected
+    struct timespec retry; // no connection attempt before
+    char *data;
+    size_t len;
+    size_t cap;
+    SocketRecord *records;
+    size_t head; // first record not sent
+    size_t count;
+    size_t max;
+    size_t sent_part; // bytes of the head record a stream took already
+    unsigned long long sent;
+    unsigned long long dropped;
+    unsigned long long reconnects;
+    unsigned long long errors;
+    pthread_mutex_t lock;
+} SocketSink;
+
+static int socket_sink_write(LOGGER_SINK *base, const char *data, size_t len);
+static int socket_sink_queue(LOGGER_SINK *base, const char *data, size_t len);
+static int socket_sink_flush(LOGGER_SINK *base);
+static void socket_sink_close(LOGGER_SINK *base);
+static int socket_address(SocketSink *sink, const char *address);
+static int socket_enqueue(SocketSink *sink, const char *data, size_t len);
+static void socket_send(SocketSink *sink);
+static int socket_connect(SocketSink *sink);
+static void socket_disconnect(SocketSink *sink);
+static size_t socket_send_datagrams(SocketSink *sink);
+static size_t socket_send_stream(SocketSink *sink);
+
+static const SinkOps SINK_SOCKET_OPS = {
+    socket_sink_write, socket_sink_flush, socket_sink_close, NULL, socket_sink_queue
+};
+
+
+LOGGER_SINK *logger_sink_socket(int type, const char *address, size_t queue, int rfc5424) {
+    if (!address || type < LOGGER_SOCKET_UNIX_DGRAM || type > LOGGER_SOCKET_UDP) {
+        return NULL;
+    }
+    SocketSink *sink = calloc(1, sizeof(SocketSink));
+    if (!sink) {
+        return NULL;
+    }
+    sink -> type = type;
+    sink -> rfc5424 = rfc5424 != 0;
+    if (socket_address(sink, address) < 0) {
+        fprintf(stderr, "liblogger: invalid socket address \"%s\"\n", address);
+        free(sink);
+        return NULL;
+    }
+    sink -> max = queue ? queue : SOCKET_DEFAULT_QUEUE;
+    sink -> records = malloc(sink -> max * sizeof(SocketRecord));
+    if (!sink -> records) {
+        free(sink);
+        return NULL;
+    }
+    sink -> base.ops = &SINK_SOCKET_OPS;
+    sink -> base.file = NULL;
+    sink -> fd = -1;
+    pthread_mutex_init(&sink -> lock, NULL);
+    // the collector may not be up yet, records wait for it
+    socket_connect(sink);
+    return &sink -> base;
+}
+
+
+int logger_sink_socket_stats(LOGGER_SINK *base, LOGGER_SOCKET_STATS *stats) {
+    if (!base || !stats || base -> ops != &SINK_SOCKET_OPS) {
+        return -1;
+    }
+    SocketSink *sink = (SocketSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    stats -> connected = sink -> fd >= 0;
+    stats -> queued = sink -> count - sink -> head;
+    stats -> queued_bytes = sink -> len - (sink -> head < sink -> count ?
+                                           sink -> records[sink -> head].offset + sink -> sent_part : sink -> len);
+    stats -> sent = sink -> sent;
+    stats -> dropped = sink -> dropped;
+    stats -> reconnects = sink -> reconnects;
+    stats -> errors = sink -> errors;
+    pthread_mutex_unlock(&sink -> lock);
+    return 0;
+}
+
+
+/* A record on its own: sent right away with whatever was waiting */
+static int socket_sink_write(LOGGER_SINK *base, const char *data, size_t len) {
+    SocketSink *sink = (SocketSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    int failed = socket_enqueue(sink, data, len);
+    socket_send(sink);
+    pthread_mutex_unlock(&sink -> lock);
+    return failed;
+}
+
+
+/* A record of an async batch, the batch goes out on flush */
+static int socket_sink_queue(LOGGER_SINK *base, const char *data, size_t len) {
+    SocketSink *sink = (SocketSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    int failed = socket_enqueue(sink, data, len);
+    if (sink -> count - sink -> head >= SOCKET_BATCH) {
+        socket_send(sink);
+    }
+    pthread_mutex_unlock(&sink -> lock);
+    return failed;
+}
+
+
+/* Send what the socket takes now, the rest waits for the next record or flush */
+static int socket_sink_flush(LOGGER_SINK *base) {
+    SocketSink *sink = (SocketSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    socket_send(sink);
+    int failed = sink -> head < sink -> count ? -1 : 0;
+    pthread_mutex_unlock(&sink -> lock);
+    return failed;
+}
+
+
+/* One last try, what the collector doesn't take now is lost */
+static void socket_sink_close(LOGGER_SINK *base) {
+    SocketSink *sink = (SocketSink *)base;
+    sink -> retry.tv_sec = 0;
+    socket_send(sink);
+    socket_disconnect(sink);
+    pthread_mutex_destroy(&sink -> lock);
+    free(sink -> data);
+    free(sink -> records);
+    free(sink);
+}
+
+
+/* A path for unix sockets, host:port or [host]:port for UDP
+ * Return 0 or -1 */
+static int socket_address(SocketSink *sink, const char *address) {
+    if (sink -> type != LOGGER_SOCKET_UDP) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&sink -> address;
+        size_t len = strlen(address);
+        if (!len || len >= sizeof(un -> sun_path)) {
+            return -1;
+        }
+        un -> sun_family = AF_UNIX;
+        memcpy(un -> sun_path, address, len + 1);
+        sink -> address_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+        return 0;
+    }
+
+    char host[256];
+    const char *port = strrchr(address, ':');
+    size_t len = port ? (size_t)(port - address) : 0;
+    if (!port || !port[1] || len >= sizeof(host)) {
+        return -1;
+    }
+    if (len >= 2 && address[0] == '[' && address[len - 1] == ']') {
+        address++;
+        len -= 2;
+    }
+    memcpy(host, address, len);
+    host[len] = '\0';
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(host, port + 1, &hints, &found) != 0) {
+        return -1;
+    }
+    memcpy(&sink -> address, found -> ai_addr, found -> ai_addrlen);
+    sink -> address_len = found -> ai_addrlen;
+    freeaddrinfo(found);
+    return 0;
+}
+
+
+/* Copy a record to the queue, framed as asked, with the lock held
+ * Return 0 or -1 if it was dropped */
+static int socket_enqueue(SocketSink *sink, const char *data, size_t len) {
+    if (sink -> count == sink -> max) {
+        socket_send(sink); // the collector may have caught up
+    }
+    if (sink -> head == sink -> count) {
+        sink -> head = sink -> count = sink -> len = 0;
+    } else if (sink -> count == sink -> max && sink -> head) {
+        // slide the records waiting to the front
+        size_t start = sink -> records[sink -> head].offset;
+        memmove(sink -> data, sink -> data + start, sink -> len - start);
+        sink -> len -= start;
+        sink -> count -= sink -> head;
+        for (size_t i = 0; i < sink -> count; i++) {
+            sink -> records[i] = sink -> records[sink -> head + i];
+            sink -> records[i].offset -= start;
+        }
+        sink -> head = 0;
+    }
+    if (sink -> count == sink -> max) {
+        sink -> dropped++;
+        return -1;
+    }
+    if (sink -> rfc5424 && len && data[len - 1] == '\n') {
+        len--; // the framing says where the record ends
+    }
+    if (sink -> cap - sink -> len < len + SOCKET_FRAME_SIZE) {
+        size_t cap = sink -> cap ? sink -> cap : 4096;
+        while (cap - sink -> len < len + SOCKET_FRAME_SIZE) {
+            cap *= 2;
+        }
+        char *grown = realloc(sink -> data, cap);
+        if (!grown) {
+            sink -> dropped++;
+            return -1;
+        }
+        sink -> data = grown;
+        sink -> cap = cap;
+    }
+    SocketRecord *record = &sink -> records[sink -> count++];
+    record -> offset = sink -> len;
+    if (sink -> rfc5424 && sink -> type == LOGGER_SOCKET_UNIX_STREAM) {
+        // octet counting (RFC 6587): the length, a space, the message
+        sink -> len += snprintf(sink -> data + sink -> len, SOCKET_FRAME_SIZE, "%zu ", len);
+    }
+    memcpy(sink -> data + sink -> len, data, len);
+    sink -> len += len;
+    record -> len = sink -> len - record -> offset;
+    return 0;
+}
+
+
+/* Send queued records until the socket would block, with the lock held */
+static void socket_send(SocketSink *sink) {
+    while (sink -> head < sink -> count) {
+        if (sink -> fd < 0 && socket_connect(sink) < 0) {
+            return;
+        }
+        size_t sent = sink -> type == LOGGER_SOCKET_UNIX_STREAM ?
+                      socket_send_stream(sink) : socket_send_datagrams(sink);
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+
+/* Return 0 or -1 if the collector isn't there, or it is too early to ask again */
+static int socket_connect(SocketSink *sink) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < sink -> retry.tv_sec ||
+        (now.tv_sec == sink -> retry.tv_sec && now.tv_nsec < sink -> retry.tv_nsec)) {
+        return -1;
+    }
+    sink -> retry.tv_sec = now.tv_sec + (now.tv_nsec + SOCKET_RETRY_NS) / 1000000000L;
+    sink -> retry.tv_nsec = (now.tv_nsec + SOCKET_RETRY_NS) % 1000000000L;
+
+    int stream = sink -> type == LOGGER_SOCKET_UNIX_STREAM;
+    int fd = socket(sink -> address.ss_family, (stream ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&sink -> address, sink -> address_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (sink -> sent || sink -> reconnects || sink -> dropped) {
+        sink -> reconnects++;
+    }
+    sink -> fd = fd;
+    sink -> sent_part = 0; // a record cut by the last connection is sent again whole
+    return 0;
+}
+
+
+static void socket_disconnect(SocketSink *sink) {
+    if (sink -> fd >= 0) {
+        close(sink -> fd);
+        sink -> fd = -1;
+    }
+}
+
+
+/* The collector went away, or is not listening (UDP learns it from a later send) */
+static int socket_lost(int error) {
+    return error == ECONNREFUSED || error == ECONNRESET || error == ENOTCONN ||
+           error == EPIPE || error == ENOENT || error == EDESTADDRREQ;
+}
+
+
+/* One datagram per record, SOCKET_BATCH per call
+ * Return the number of records gone, sent or dropped */
+static size_t socket_send_datagrams(SocketSink *sink) {
+    struct mmsghdr messages[SOCKET_BATCH];
+    struct iovec iov[SOCKET_BATCH];
+    size_t count = sink -> count - sink -> head;
+    if (count > SOCKET_BATCH) {
+        count = SOCKET_BATCH;
+    }
+    memset(messages, 0, count * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < count; i++) {
+        const SocketRecord *record = &sink -> records[sink -> head + i];
+        iov[i].iov_base = sink -> data + record -> offset;
+        iov[i].iov_len = record -> len;
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(sink -> fd, messages, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+        sink -> head += sent;
+        sink -> sent += sent;
+        return sent;
+    }
+    if (errno == EMSGSIZE) {
+        // too large for a datagram, it never will fit
+        sink -> head++;
+        sink -> dropped++;
+        return 1;
+    }
+    if (socket_lost(errno)) {
+        socket_disconnect(sink);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EINTR) {
+        sink -> errors++;
+    }
+    return 0;
+}
+
+
+/* As many records as the socket takes in one sendmsg, a cut one is finished later
+ * Return the number of records fully sent */
+static size_t socket_send_stream(SocketSink *sink) {
+    struct iovec iov[IOV_MAX < 256 ? IOV_MAX : 256];
+    size_t count = sink -> count - sink -> head;
+    if (count > sizeof(iov) / sizeof(iov[0])) {
+        count = sizeof(iov) / sizeof(iov[0]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        const SocketRecord *record = &sink -> records[sink -> head + i];
+        size_t skip = i ? 0 : sink -> sent_part;
+        iov[i].iov_base = sink -> data + record -> offset + skip;
+        iov[i].iov_len = record -> len - skip;
+    }
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    ssize_t written = sendmsg(sink -> fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < 0) {
+        if (socket_lost(errno)) {
+            socket_disconnect(sink);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            sink -> errors++;
+        }
+        return 0;
+    }
+    size_t done = 0;
+    for (size_t i = 0; i < count && (size_t)written >= iov[i].iov_len; i++) {
+        written -= iov[i].iov_len;
+        done++;
+    }
+    sink -> head += done;
+    sink -> sent += done;
+    sink -> sent_part = done ? (size_t)written : sink -> sent_part + written;
+    return done;
+}
@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include "sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define URING_AVAILABLE 1
+#else
+#define URING_AVAILABLE 0
+#endif
+
+#define URING_DEFAULT_DEPTH  8
+#define URING_MAX_DEPTH      1024
+#define URING_DEFAULT_BUFFER (64 * 1024)
+#define URING_LINGER_NS      1000000 // 1ms
+
+/* Records are copied into one of depth buffers, a full buffer becomes a write
+ * at its offset in the file, submitted with the others queued so far by one
+ * io_uring_enter
+ * A buffer is submitted once full, on flush, or by the timer thread once it
+ * held a record for URING_LINGER_NS, so records on their own share writes
+ * The async writer's records (the queue op) are submitted by the flush
+ * ending the batch
+ * Completions are read from the shared ring, a write only enters the kernel
+ * to wait when the next buffer is still in flight
+ * Offsets are given explicitly: the file keeps the records' order whatever
+ * order the writes complete in, so the sink must be its only writer
+ * Without io_uring the buffers are written with pwrite when full */
+typedef struct UringBuffer {
+    char *data;
+    size_t len;
+    off_t offset; // where it goes, set when submitted
+    int busy; // submitted and not completed
+} UringBuffer;
+
+typedef struct UringSink {
+    LOGGER_SINK base;
+    int fd;
+    int ring; // -1 for the pwrite fallback
+    int fixed_buffers;
+    int fixed_file;
+    unsigned depth;
+    size_t buffer_size;
+    char *memory; // the buffers, registered with the ring if fixed_buffers
+    UringBuffer *buffers;
+    unsigned current; // being filled
+    unsigned queued; // in the submission ring, not handed to the kernel yet
+    off_t offset; // end of the file once every write lands
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    void *sqes_map;
+    size_t sqes_map_size;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+#if URING_AVAILABLE
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+
+    unsigned in_flight;
+    size_t in_flight_bytes;
+    unsigned long long writes;
+    unsigned long long enters;
+    unsigned long long waits;
+    unsigned long long errors;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a record lingers in the current buffer, or stop
+    pthread_t timer;
+    int lingering; // the current buffer holds records since since
+    struct timespec since;
+    int stop;
+} UringSink;
+
+static int uring_sink_write(LOGGER_SINK *base, const char *data, size_t len);
+static int uring_sink_queue(LOGGER_SINK *base, const char *data, size_t len);
+static int uring_sink_flush(LOGGER_SINK *base);
+static void uring_sink_close(LOGGER_SINK *base);
+static int uring_setup(UringSink *sink);
+static void uring_teardown(UringSink *sink);
+static int uring_queue(UringSink *sink);
+static int uring_submit(UringSink *sink, unsigned wait);
+static int uring_reap(UringSink *sink);
+static int uring_pwrite(UringSink *sink, const char *data, size_t len, off_t offset);
+static int uring_copy(UringSink *sink, const char *data, size_t len);
+static void *uring_timer(void *arg);
+
+static const SinkOps SINK_URING_OPS = {
+    uring_sink_write, uring_sink_flush, uring_sink_close, NULL, uring_sink_queue
+};
+
+
+LOGGER_SINK *logger_sink_uring(const char *path, unsigned depth, size_t buffer_size) {
+    if (!path || depth > URING_MAX_DEPTH) {
+        return NULL;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    depth = depth ? depth : URING_DEFAULT_DEPTH;
+    buffer_size = buffer_size ? buffer_size : URING_DEFAULT_BUFFER;
+    buffer_size = (buffer_size + page - 1) / page * page;
+
+    UringSink *sink = calloc(1, sizeof(UringSink));
+    if (!sink) {
+        return NULL;
+    }
+    sink -> fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    off_t end = sink -> fd < 0 ? -1 : lseek(sink -> fd, 0, SEEK_END);
+    if (end < 0) {
+        fprintf(stderr, "liblogger: can't open \"%s\": %s\n", path, strerror(errno));
+        if (sink -> fd >= 0) {
+            close(sink -> fd);
+        }
+        free(sink);
+        return NULL;
+    }
+    sink -> base.ops = &SINK_URING_OPS;
+    sink -> base.file = NULL;
+    sink -> offset = end; // append to what is there
+    sink -> depth = depth;
+    sink -> buffer_size = buffer_size;
+    sink -> ring = -1;
+    sink -> memory = aligned_alloc(page, depth * buffer_size);
+    sink -> buffers = calloc(depth, sizeof(UringBuffer));
+    if (!sink -> memory || !sink -> buffers) {
+        free(sink -> memory);
+        free(sink -> buffers);
+        close(sink -> fd);
+        free(sink);
+        return NULL;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        sink -> buffers[i].data = sink -> memory + i * buffer_size;
+    }
+    pthread_mutex_init(&sink -> lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // since is monotonic
+    pthread_cond_init(&sink -> wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (uring_setup(sink) < 0) {
+        uring_teardown(sink); // old kernel, seccomp or io_uring_disabled: pwrite it is
+    }
+    if (pthread_create(&sink -> timer, NULL, uring_timer, sink) != 0) {
+        uring_teardown(sink);
+        pthread_mutex_destroy(&sink -> lock);
+        pthread_cond_destroy(&sink -> wake);
+        close(sink -> fd);
+        free(sink -> memory);
+        free(sink -> buffers);
+        free(sink);
+        return NULL;
+    }
+    return &sink -> base;
+}
+
+
+int logger_sink_uring_stats(LOGGER_SINK *base, LOGGER_URING_STATS *stats) {
+    if (!base || !stats || base -> ops != &SINK_URING_OPS) {
+        return -1;
+    }
+    UringSink *sink = (UringSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    uring_reap(sink);
+    stats -> uring = sink -> ring >= 0;
+    stats -> fixed_buffers = sink -> fixed_buffers;
+    stats -> fixed_file = sink -> fixed_file;
+    stats -> depth = sink -> depth;
+    stats -> buffer_size = sink -> buffer_size;
+    stats -> in_flight = sink -> in_flight;
+    stats -> in_flight_bytes = sink -> in_flight_bytes;
+    stats -> buffered_bytes = sink -> buffers[sink -> current].len;
+    stats -> writes = sink -> writes;
+    stats -> enters = sink -> enters;
+    stats -> waits = sink -> waits;
+    stats -> errors = sink -> errors;
+    pthread_mutex_unlock(&sink -> lock);
+    return 0;
+}
+
+
+/* A record on its own: it waits in the buffer for the next ones, the timer
+ * submits it if the buffer neither fills nor gets flushed in time */
+static int uring_sink_write(LOGGER_SINK *base, const char *data, size_t len) {
+    UringSink *sink = (UringSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    int failed = uring_copy(sink, data, len);
+    if (!sink -> lingering && sink -> buffers[sink -> current].len) {
+        // once per buffer: the timer is asleep until then
+        clock_gettime(CLOCK_MONOTONIC, &sink -> since);
+        sink -> lingering = 1;
+        pthread_cond_signal(&sink -> wake);
+    }
+    pthread_mutex_unlock(&sink -> lock);
+    return failed ? -1 : 0;
+}
+
+
+/* A record of an async batch, the flush after the batch submits it */
+static int uring_sink_queue(LOGGER_SINK *base, const char *data, size_t len) {
+    UringSink *sink = (UringSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    int failed = uring_copy(sink, data, len);
+    pthread_mutex_unlock(&sink -> lock);
+    return failed ? -1 : 0;
+}
+
+
+/* Copy to the current buffer, a record larger than what is left of it goes
+ * on in the next one, with the lock held
+ * Return 0 or -1 if a write failed */
+static int uring_copy(UringSink *sink, const char *data, size_t len) {
+    int failed = 0;
+    while (len && !failed) {
+        UringBuffer *buffer = &sink -> buffers[sink -> current];
+        size_t n = sink -> buffer_size - buffer -> len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buffer -> data + buffer -> len, data, n);
+        buffer -> len += n;
+        data += n;
+        len -= n;
+        if (buffer -> len == sink -> buffer_size) {
+            failed = uring_queue(sink) || uring_submit(sink, 0);
+        }
+    }
+    return failed;
+}
+
+
+/* Hand everything buffered to the kernel, without waiting for the disk */
+static int uring_sink_flush(LOGGER_SINK *base) {
+    UringSink *sink = (UringSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    int failed = uring_queue(sink) || uring_submit(sink, 0) || uring_reap(sink);
+    pthread_mutex_unlock(&sink -> lock);
+    return failed ? -1 : 0;
+}
+
+
+/* Every write has landed before the ring goes away */
+static void uring_sink_close(LOGGER_SINK *base) {
+    UringSink *sink = (UringSink *)base;
+    pthread_mutex_lock(&sink -> lock);
+    sink -> stop = 1;
+    pthread_cond_signal(&sink -> wake);
+    pthread_mutex_unlock(&sink -> lock);
+    pthread_join(sink -> timer, NULL);
+    uring_queue(sink);
+    uring_submit(sink, 0);
+    while (sink -> in_flight && uring_submit(sink, 1) == 0) {
+        uring_reap(sink);
+    }
+    uring_teardown(sink);
+    close(sink -> fd);
+    pthread_mutex_destroy(&sink -> lock);
+    pthread_cond_destroy(&sink -> wake);
+    free(sink -> memory);
+    free(sink -> buffers);
+    free(sink);
+}
+
+
+/* Sleep until a record has lingered URING_LINGER_NS in the current buffer,
+ * then submit it */
+static void *uring_timer(void *arg) {
+    UringSink *sink = arg;
+    pthread_mutex_lock(&sink -> lock);
+    while (!sink -> stop) {
+        if (!sink -> lingering) {
+            pthread_cond_wait(&sink -> wake, &sink -> lock);
+            continue;
+        }
+        struct timespec now, due = sink -> since;
+        due.tv_nsec += URING_LINGER_NS;
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec)) {
+            pthread_cond_timedwait(&sink -> wake, &sink -> lock, &due);
+            continue;
+        }
+        uring_queue(sink); // errors are counted, the next write or flush reports its own
+        uring_submit(sink, 0);
+    }
+    pthread_mutex_unlock(&sink -> lock);
+    return NULL;
+}
+
+
+#if URING_AVAILABLE
+
+/* Create the ring, map it and register the buffers and the file
+ * Return 0 or -1 if io_uring can't be used at all */
+static int uring_setup(UringSink *sink) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // the rings are mapped by the kernel, no liburing needed
+    int ring = syscall(__NR_io_uring_setup, sink -> depth, &params);
+    if (ring < 0) {
+        return -1;
+    }
+    sink -> ring = ring;
+    sink -> sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    sink -> cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && sink -> cq_map_size > sink -> sq_map_size) {
+        sink -> sq_map_size = sink -> cq_map_size;
+    }
+    sink -> sq_map = mmap(NULL, sink -> sq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (sink -> sq_map == MAP_FAILED) {
+        sink -> sq_map = NULL;
+        return -1;
+    }
+    if (single) {
+        sink -> cq_map = sink -> sq_map;
+    } else {
+        sink -> cq_map = mmap(NULL, sink -> cq_map_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (sink -> cq_map == MAP_FAILED) {
+            sink -> cq_map = NULL;
+            return -1;
+        }
+    }
+    sink -> sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sink -> sqes_map = mmap(NULL, sink -> sqes_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (sink -> sqes_map == MAP_FAILED) {
+        sink -> sqes_map = NULL;
+        return -1;
+    }
+    char *sq = sink -> sq_map;
+    char *cq = sink -> cq_map;
+    sink -> sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    sink -> sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sink -> sq_array = (unsigned *)(sq + params.sq_off.array);
+    sink -> cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    sink -> cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    sink -> cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    sink -> sqes = sink -> sqes_map;
+    sink -> cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // both are optional: the kernel pins the buffers and keeps the file once
+    // instead of on every write, but the memory lock limit may say no
+    struct iovec *iov = malloc(sink -> depth * sizeof(struct iovec));
+    if (iov) {
+        for (unsigned i = 0; i < sink -> depth; i++) {
+            iov[i].iov_base = sink -> buffers[i].data;
+            iov[i].iov_len = sink -> buffer_size;
+        }
+        sink -> fixed_buffers = syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS,
+                                        iov, sink -> depth) == 0;
+        free(iov);
+    }
+    sink -> fixed_file = syscall(__NR_io_uring_register, ring, IORING_REGISTER_FILES,
+                                 &sink -> fd, 1) == 0;
+    return 0;
+}
+
+
+static void uring_teardown(UringSink *sink) {
+    if (sink -> sqes_map) {
+        munmap(sink -> sqes_map, sink -> sqes_map_size);
+    }
+    if (sink -> cq_map && sink -> cq_map != sink -> sq_map) {
+        munmap(sink -> cq_map, sink -> cq_map_size);
+    }
+    if (sink -> sq_map) {
+        munmap(sink -> sq_map, sink -> sq_map_size);
+    }
+    sink -> sqes_map = sink -> cq_map = sink -> sq_map = NULL;
+    if (sink -> ring >= 0) {
+        close(sink -> ring); // drops the registered buffers and file with it
+    }
+    sink -> ring = -1;
+    sink -> fixed_buffers = 0;
+    sink -> fixed_file = 0;
+}
+
+
+/* Make the current buffer a write and move to the next one, waiting for it
+ * if it is still in flight, with the lock held
+ * Return 0 or -1 if a write failed */
+static int uring_queue(UringSink *sink) {
+    UringBuffer *buffer = &sink -> buffers[sink -> current];
+    sink -> lingering = 0;
+    if (!buffer -> len) {
+        return 0;
+    }
+    buffer -> offset = sink -> offset;
+    sink -> offset += buffer -> len;
+    sink -> writes++;
+    if (sink -> ring < 0) {
+        int failed = uring_pwrite(sink, buffer -> data, buffer -> len, buffer -> offset);
+        buffer -> len = 0;
+        return failed;
+    }
+
+    unsigned tail = atomic_load_explicit(sink -> sq_tail, memory_order_relaxed);
+    unsigned index = tail & sink -> sq_mask;
+    struct io_uring_sqe *sqe = &sink -> sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe -> opcode = sink -> fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe -> fd = sink -> fixed_file ? 0 : sink -> fd;
+    sqe -> flags = sink -> fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe -> off = buffer -> offset;
+    sqe -> addr = (unsigned long long)(uintptr_t)buffer -> data;
+    sqe -> len = buffer -> len;
+    sqe -> buf_index = sink -> fixed_buffers ? sink -> current : 0;
+    sqe -> user_data = sink -> current;
+    sink -> sq_array[index] = index;
+    atomic_store_explicit(sink -> sq_tail, tail + 1, memory_order_release);
+    buffer -> busy = 1;
+    sink -> queued++;
+    sink -> in_flight++;
+    sink -> in_flight_bytes += buffer -> len;
+
+    // one buffer per write in flight, so the rings never overflow
+    sink -> current = (sink -> current + 1) % sink -> depth;
+    int failed = uring_reap(sink);
+    if (sink -> buffers[sink -> current].busy) {
+        sink -> waits++;
+        while (sink -> buffers[sink -> current].busy) {
+            if (uring_submit(sink, 1) < 0) {
+                return -1;
+            }
+            failed |= uring_reap(sink);
+        }
+    }
+    return failed;
+}
+
+
+/* Hand the queued writes over and/or wait for wait completions
+ * Return 0 or -1 if the ring failed */
+static int uring_submit(UringSink *sink, unsigned wait) {
+    if (sink -> ring < 0 || (!sink -> queued && !wait)) {
+        return 0;
+    }
+    for (;;) {
+        sink -> enters++;
+        int done = syscall(__NR_io_uring_enter, sink -> ring, sink -> queued, wait,
+                           wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (done >= 0) {
+            sink -> queued -= done;
+            if (!sink -> queued || wait) {
+                return 0;
+            }
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            sink -> errors++;
+            return -1;
+        }
+    }
+}
+
+
+/* Free the buffers whose write completed, a failed or short one is finished
+ * with pwrite, with the lock held
+ * Return 0 or -1 if a write failed */
+static int uring_reap(UringSink *sink) {
+    if (sink -> ring < 0) {
+        return 0;
+    }
+    int failed = 0;
+    unsigned head = atomic_load_explicit(sink -> cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(sink -> cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &sink -> cqes[head & sink -> cq_mask];
+        UringBuffer *buffer = &sink -> buffers[cqe -> user_data];
+        size_t written = cqe -> res < 0 ? 0 : (size_t)cqe -> res;
+        if (written < buffer -> len) {
+            if (cqe -> res < 0) {
+                sink -> errors++;
+            }
+            failed |= uring_pwrite(sink, buffer -> data + written, buffer -> len - written,
+                                   buffer -> offset + written);
+        }
+        sink -> in_flight--;
+        sink -> in_flight_bytes -= buffer -> len;
+        buffer -> len = 0;
+        buffer -> busy = 0;
+    }
+    atomic_store_explicit(sink -> cq_head, head, memory_order_release);
+    return failed;
+}
+
+#else
+
+static int uring_setup(UringSink *sink) {
+    (void)sink;
+    return -1;
+}
+
+
+static void uring_teardown(UringSink *sink) {
+    sink -> ring = -1;
+}
+
+
+static int uring_queue(UringSink *sink) {
+    UringBuffer *buffer = &sink -> buffers[sink -> current];
+    sink -> lingering = 0;
+    if (!buffer -> len) {
+        return 0;
+    }
+    sink -> writes++;
+    int failed = uring_pwrite(sink, buffer -> data, buffer -> len, sink -> offset);
+    sink -> offset += buffer -> len;
+    buffer -> len = 0;
+    return failed;
+}
+
+
+static int uring_submit(UringSink *sink, unsigned wait) {
+    (void)sink;
+    (void)wait;
+    return 0;
+}
+
+
+static int uring_reap(UringSink *sink) {
+    (void)sink;
+    return 0;
+}
+
+#endif
+
+
+/* The blocking path */
+static int uring_pwrite(UringSink *sink, const char *data, size_t len, off_t offset) {
+    while (len) {
+        ssize_t written = pwrite(sink -> fd, data, len, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sink -> errors++;
+            return -1;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
@@ -0,0 +1,344 @@
+#include "logger.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define SITE_MAX_SETTING 512
+
+static const char *SITE_LEVEL_NAMES[] = {
+    "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL"
+};
+
+static const char *SITE_STATE_NAMES[] = { "default", "on", "off" };
+
+/* The sites of one program or library */
+typedef struct SiteSection {
+    LOGGER_SITE *start;
+    LOGGER_SITE *stop;
+} SiteSection;
+
+/* A logger_sites_set call, kept for the sections registered after it */
+typedef struct SiteRule {
+    char *file; // NULL for all
+    int first_line;
+    int last_line;
+    int level;
+    int state;
+} SiteRule;
+
+static struct {
+    pthread_mutex_t lock;
+    SiteSection *sections;
+    size_t section_count;
+    SiteRule *rules;
+    size_t rule_count;
+    int started; // the environment was read
+} SITES = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0 };
+
+static void site_start(void);
+static void site_release(void) __attribute__((destructor));
+static int site_set(const char *file, int first_line, int last_line, int level, int state);
+static int site_apply(const SiteSection *section, const SiteRule *rule);
+static int site_match(const LOGGER_SITE *site, const SiteRule *rule);
+static int site_control(const char *settings);
+static int site_load(const char *path);
+static int site_parse(char *setting, SiteRule *rule);
+
+
+void __logger_sites_register__(LOGGER_SITE *start, LOGGER_SITE *stop) {
+    if (!start || stop <= start) {
+        return;
+    }
+    pthread_mutex_lock(&SITES.lock);
+    // every file including the header registers its program's section
+    for (size_t i = 0; i < SITES.section_count; i++) {
+        if (SITES.sections[i].start == start) {
+            pthread_mutex_unlock(&SITES.lock);
+            return;
+        }
+    }
+    SiteSection *sections = realloc(SITES.sections, (SITES.section_count + 1) * sizeof(SiteSection));
+    if (!sections) {
+        pthread_mutex_unlock(&SITES.lock);
+        fprintf(stderr, "liblogger: out of memory, call sites can't be switched\n");
+        return;
+    }
+    SITES.sections = sections;
+    SiteSection *section = &sections[SITES.section_count++];
+    section -> start = start;
+    section -> stop = stop;
+    for (size_t i = 0; i < SITES.rule_count; i++) {
+        site_apply(section, &SITES.rules[i]);
+    }
+    site_start();
+    pthread_mutex_unlock(&SITES.lock);
+}
+
+
+int logger_sites_set(const char *file, int first_line, int last_line,
+                     const int level, const int state) {
+    pthread_mutex_lock(&SITES.lock);
+    site_start();
+    int changed = site_set(file, first_line, last_line, level, state);
+    pthread_mutex_unlock(&SITES.lock);
+    return changed;
+}
+
+
+int logger_sites_control(const char *settings) {
+    if (!settings) {
+        return -1;
+    }
+    pthread_mutex_lock(&SITES.lock);
+    site_start();
+    int changed = site_control(settings);
+    pthread_mutex_unlock(&SITES.lock);
+    return changed;
+}
+
+
+int logger_sites_load(const char *path) {
+    if (!path) {
+        return -1;
+    }
+    pthread_mutex_lock(&SITES.lock);
+    site_start();
+    int changed = site_load(path);
+    pthread_mutex_unlock(&SITES.lock);
+    return changed;
+}
+
+
+void logger_sites_list(FILE *file) {
+    pthread_mutex_lock(&SITES.lock);
+    for (size_t i = 0; i < SITES.section_count; i++) {
+        for (const LOGGER_SITE *site = SITES.sections[i].start; site < SITES.sections[i].stop; site++) {
+            unsigned char state = ((const volatile LOGGER_SITE *)site) -> state;
+            fprintf(file, "%s:%d %s %s\n", site -> file, site -> line,
+                    site -> level >= TRACE && site -> level <= FATAL ? SITE_LEVEL_NAMES[site -> level] : "?",
+                    state <= LOGGER_SITE_OFF ? SITE_STATE_NAMES[state] : "?");
+        }
+    }
+    pthread_mutex_unlock(&SITES.lock);
+}
+
+
+/* Apply LOGGER_SITES then LOGGER_SITES_FILE once, with the lock held */
+static void site_start(void) {
+    if (SITES.started) {
+        return;
+    }
+    SITES.started = 1;
+    const char *settings = getenv("LOGGER_SITES");
+    if (settings && site_control(settings) < 0) {
+        fprintf(stderr, "liblogger: LOGGER_SITES is partly ignored\n");
+    }
+    const char *path = getenv("LOGGER_SITES_FILE");
+    if (path) {
+        site_load(path);
+    }
+}
+
+
+/* Keep the rule, then apply it to every section, with the lock held
+ * A rule for the same sites as an earlier one replaces it: both pick the
+ * same sites and the later wins, so switching a site back and forth
+ * doesn't grow the list */
+static int site_set(const char *file, int first_line, int last_line, int level, int state) {
+    if ((level < TRACE && level != -1) || level > FATAL ||
+        state < LOGGER_SITE_DEFAULT || state > LOGGER_SITE_OFF ||
+        first_line < 0 || last_line < 0 || (last_line && first_line > last_line)) {
+        return -1;
+    }
+    if (file && !strcmp(file, "*")) {
+        file = NULL;
+    }
+    for (size_t i = 0; i < SITES.rule_count; i++) {
+        SiteRule *old = &SITES.rules[i];
+        if (old -> first_line == first_line && old -> last_line == last_line && old -> level == level &&
+            (old -> file == file || (old -> file && file && !strcmp(old -> file, file)))) {
+            // it goes last, where it is replayed after the rules it came after
+            free(old -> file);
+            memmove(old, old + 1, (SITES.rule_count - i - 1) * sizeof(SiteRule));
+            SITES.rule_count--;
+            break;
+        }
+    }
+    SiteRule *rules = realloc(SITES.rules, (SITES.rule_count + 1) * sizeof(SiteRule));
+    if (!rules) {
+        return -1;
+    }
+    SITES.rules = rules;
+    SiteRule *rule = &rules[SITES.rule_count];
+    rule -> file = NULL;
+    if (file && !(rule -> file = strdup(file))) {
+        return -1;
+    }
+    rule -> first_line = first_line;
+    rule -> last_line = last_line;
+    rule -> level = level;
+    rule -> state = state;
+    SITES.rule_count++;
+
+    int changed = 0;
+    for (size_t i = 0; i < SITES.section_count; i++) {
+        changed += site_apply(&SITES.sections[i], rule);
+    }
+    return changed;
+}
+
+
+/* The sections and rules go with the library */
+static void site_release(void) {
+    pthread_mutex_lock(&SITES.lock);
+    for (size_t i = 0; i < SITES.rule_count; i++) {
+        free(SITES.rules[i].file);
+    }
+    free(SITES.rules);
+    free(SITES.sections);
+    SITES.rules = NULL;
+    SITES.rule_count = 0;
+    SITES.sections = NULL;
+    SITES.section_count = 0;
+    pthread_mutex_unlock(&SITES.lock);
+}
+
+
+static int site_apply(const SiteSection *section, const SiteRule *rule) {
+    int changed = 0;
+    for (LOGGER_SITE *site = section -> start; site < section -> stop; site++) {
+        if (site_match(site, rule)) {
+            *(volatile unsigned char *)&site -> state = rule -> state;
+            changed++;
+        }
+    }
+    return changed;
+}
+
+
+static int site_match(const LOGGER_SITE *site, const SiteRule *rule) {
+    if ((rule -> level != -1 && site -> level != rule -> level) ||
+        (rule -> first_line && site -> line < rule -> first_line) ||
+        (rule -> last_line && site -> line > rule -> last_line)) {
+        return 0;
+    }
+    if (!rule -> file) {
+        return 1;
+    }
+    const char *base = strrchr(site -> file, '/');
+    return !fnmatch(rule -> file, site -> file, 0) || (base && !fnmatch(rule -> file, base + 1, 0));
+}
+
+
+/* Settings separated by ; or new lines, with the lock held */
+static int site_control(const char *settings) {
+    int changed = 0;
+    while (*settings) {
+        size_t len = strcspn(settings, ";\n");
+        char setting[SITE_MAX_SETTING];
+        SiteRule rule;
+        if (len >= sizeof(setting)) {
+            fprintf(stderr, "liblogger: call site setting too long\n");
+            return -1;
+        }
+        memcpy(setting, settings, len);
+        setting[len] = '\0';
+        int parsed = site_parse(setting, &rule);
+        if (parsed < 0) {
+            fprintf(stderr, "liblogger: invalid call site setting \"%.*s\", "
+                            "expected glob[:first[-last]][@LEVEL]=on|off|default\n", (int)len, settings);
+            return -1;
+        }
+        if (parsed) {
+            int done = site_set(rule.file, rule.first_line, rule.last_line, rule.level, rule.state);
+            if (done < 0) {
+                return -1;
+            }
+            changed += done;
+        }
+        settings += len;
+        if (*settings) {
+            settings++;
+        }
+    }
+    return changed;
+}
+
+
+/* One setting per line, with the lock held */
+static int site_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "liblogger: can't read call site settings from %s\n", path);
+        return -1;
+    }
+    char line[SITE_MAX_SETTING];
+    int changed = 0;
+    while (changed >= 0 && fgets(line, sizeof(line), file)) {
+        int done = site_control(line);
+        changed = done < 0 ? -1 : changed + done;
+    }
+    fclose(file);
+    return changed;
+}
+
+
+/* Split "glob[:first[-last]][@LEVEL]=state" in place, rule -> file points into setting
+ * Return 1, 0 if there is nothing to do or -1 if it is invalid */
+static int site_parse(char *setting, SiteRule *rule) {
+    while (isspace((unsigned char)*setting)) {
+        setting++;
+    }
+    char *end = setting + strlen(setting);
+    while (end > setting && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    if (!*setting || *setting == '#') {
+        return 0;
+    }
+
+    char *state = strrchr(setting, '=');
+    if (!state) {
+        return -1;
+    }
+    *state++ = '\0';
+    rule -> state = -1;
+    for (int i = LOGGER_SITE_DEFAULT; i <= LOGGER_SITE_OFF; i++) {
+        if (!strcasecmp(state, SITE_STATE_NAMES[i])) {
+            rule -> state = i;
+        }
+    }
+
+    rule -> level = -1;
+    char *level = strchr(setting, '@');
+    if (level) {
+        *level++ = '\0';
+        rule -> level = -2;
+        for (int i = TRACE; i <= FATAL; i++) {
+            if (!strcasecmp(level, SITE_LEVEL_NAMES[i])) {
+                rule -> level = i;
+            }
+        }
+    }
+
+    rule -> first_line = 0;
+    rule -> last_line = 0;
+    char *lines = strchr(setting, ':');
+    if (lines) {
+        *lines++ = '\0';
+        char *last;
+        rule -> first_line = strtol(lines, &last, 10);
+        rule -> last_line = rule -> first_line;
+        if (*last == '-') {
+            rule -> last_line = strtol(last + 1, &last, 10);
+        }
+        if (last == lines || *last || rule -> first_line <= 0) {
+            return -1;
+        }
+    }
+    rule -> file = *setting ? setting : NULL;
+    return rule -> state < 0 || rule -> level == -2 ? -1 : 1;
+}
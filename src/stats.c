@@ -0,0 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_SUB_BITS 2 // 4 linear buckets per power of 2
+#define STATS_SUB      (1 << STATS_SUB_BITS)
+
+static _Atomic unsigned stats_threads;
+static _Thread_local unsigned stats_thread; // 1 + this thread's number, 0 before
+
+static size_t stats_bucket(unsigned long long ns);
+static unsigned long long stats_take(_Atomic unsigned long long *counter, int reset);
+
+
+LoggerStats *stats_create(void) {
+    LoggerStats *stats = aligned_alloc(64, sizeof(LoggerStats));
+    if (stats) {
+        memset(stats, 0, sizeof(LoggerStats));
+    }
+    return stats;
+}
+
+
+StatsShard *stats_shard(LoggerStats *stats) {
+    if (!stats_thread) {
+        stats_thread = atomic_fetch_add_explicit(&stats_threads, 1, memory_order_relaxed) + 1;
+    }
+    return &stats -> shards[(stats_thread - 1) % STATS_SHARDS];
+}
+
+
+unsigned long long stats_start(LoggerStats *stats) {
+    if (!stats) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void stats_time(LoggerStats *stats, int histogram, unsigned long long start) {
+    if (!stats) {
+        return;
+    }
+    unsigned long long end = stats_start(stats);
+    size_t bucket = stats_bucket(end > start ? end - start : 0);
+    atomic_fetch_add_explicit(&stats_shard(stats) -> histograms[histogram][bucket], 1,
+                              memory_order_relaxed);
+}
+
+
+void stats_snapshot(LoggerStats *stats, LOGGER_STATS *out, int reset) {
+    unsigned long long counters[STATS_COUNTERS] = {0};
+    memset(out, 0, sizeof(LOGGER_STATS));
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        StatsShard *shard = &stats -> shards[i];
+        for (size_t c = 0; c < STATS_COUNTERS; c++) {
+            counters[c] += stats_take(&shard -> counters[c], reset);
+        }
+        for (size_t b = 0; b < LOGGER_STATS_BUCKETS; b++) {
+            out -> render_ns[b] += stats_take(&shard -> histograms[STATS_RENDER][b], reset);
+            out -> write_ns[b] += stats_take(&shard -> histograms[STATS_WRITE][b], reset);
+        }
+    }
+    out -> accepted = counters[STATS_ACCEPTED];
+    out -> filtered = counters[STATS_FILTERED];
+    out -> bytes = counters[STATS_BYTES];
+    out -> write_errors = counters[STATS_ERRORS];
+    out -> dropped = counters[STATS_DROPPED];
+}
+
+
+unsigned long long logger_stats_bucket(size_t bucket) {
+    if (bucket < STATS_SUB) {
+        return bucket;
+    }
+    size_t exponent = bucket / STATS_SUB + STATS_SUB_BITS - 1;
+    return (unsigned long long)(STATS_SUB + bucket % STATS_SUB) << (exponent - STATS_SUB_BITS);
+}
+
+
+/* Log-linear: exact below 4 ns, then 4 buckets per power of 2
+ * (within 25% of the value), the last one takes everything above */
+static size_t stats_bucket(unsigned long long ns) {
+    if (ns < STATS_SUB) {
+        return ns;
+    }
+    size_t exponent = 63 - __builtin_clzll(ns);
+    size_t bucket = (exponent - STATS_SUB_BITS + 1) * STATS_SUB +
+                    ((ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB - 1));
+    return bucket < LOGGER_STATS_BUCKETS ? bucket : LOGGER_STATS_BUCKETS - 1;
+}
+
+
+static unsigned long long stats_take(_Atomic unsigned long long *counter, int reset) {
+    return reset ? atomic_exchange_explicit(counter, 0, memory_order_relaxed)
+                 : atomic_load_explicit(counter, memory_order_relaxed);
+}
@@ -0,0 +1,186 @@
+#include "structured.h"
+#include "format.h"
+#include <math.h>
+#include <string.h>
+
+/* indexed by opcode */
+static const char *STRUCTURED_KEYS[] = {
+    "ref", "level", "date", "time", "filename", "line", "msg",
+    "msec", "usec", "iso8601", "epochns", "fields",
+    "pri", "hostname", "pid"
+};
+
+static int structured_quote(LogBuffer *buffer, size_t start);
+static size_t structured_escape_len(unsigned char c);
+static int structured_bare(unsigned char c);
+
+
+const char *structured_label_key(int code) {
+    return code >= 0 && code < OP_LITERAL ? STRUCTURED_KEYS[code] : "";
+}
+
+
+/* MSEC and USEC are zero padded, which JSON numbers can't be */
+int structured_label_numeric(int code) {
+    return code == OP_LINE || code == OP_EPOCHNS || code == OP_PRI || code == OP_PID;
+}
+
+
+int structured_begin(LogBuffer *buffer, int mode) {
+    return mode == LOGGER_JSON ? buffer_append(buffer, "{", 1) : 0;
+}
+
+
+int structured_end(LogBuffer *buffer, int mode) {
+    return mode == LOGGER_JSON ? buffer_append(buffer, "}\n", 2) : buffer_append(buffer, "\n", 1);
+}
+
+
+int structured_key(LogBuffer *buffer, int mode, const char *key, int first) {
+    if (!key) {
+        key = "";
+    }
+    if (mode == LOGGER_JSON) {
+        if (!first && buffer_append(buffer, ",", 1)) {
+            return -1;
+        }
+        size_t start = buffer -> len;
+        return buffer_append_str(buffer, key) ||
+               structured_quote(buffer, start) ||
+               buffer_append(buffer, ":", 1);
+    }
+
+    // logfmt keys can't be quoted, anything that would need it becomes _
+    size_t len = strlen(key);
+    if ((!first && buffer_append(buffer, " ", 1)) || buffer_reserve(buffer, len + 2)) {
+        return -1;
+    }
+    char *p = buffer -> data + buffer -> len;
+    for (size_t i = 0; i < len; i++) {
+        p[i] = structured_bare(key[i]) ? key[i] : '_';
+    }
+    if (!len) {
+        p[len++] = '_';
+    }
+    p[len++] = '=';
+    buffer -> len += len;
+    return 0;
+}
+
+
+int structured_string(LogBuffer *buffer, int mode, size_t start) {
+    if (mode == LOGGER_JSON || buffer -> len == start) {
+        return structured_quote(buffer, start);
+    }
+    for (size_t i = start; i < buffer -> len; i++) {
+        if (!structured_bare(buffer -> data[i])) {
+            return structured_quote(buffer, start);
+        }
+    }
+    return 0;
+}
+
+
+int structured_fields(LogBuffer *buffer, int mode, const LOGGER_FIELD *fields,
+                      size_t count, int first) {
+    int json = mode == LOGGER_JSON;
+    for (size_t i = 0; i < count; i++) {
+        const LOGGER_FIELD *field = &fields[i];
+        if (structured_key(buffer, mode, field -> key, first && i == 0)) {
+            return -1;
+        }
+        int failed = 0;
+        switch (field -> type) {
+            case LOGGER_FIELD_INT:
+                failed = buffer_append_int(buffer, field -> value.i);
+                break;
+            case LOGGER_FIELD_DOUBLE:
+                if (json && !isfinite(field -> value.d)) {
+                    failed = buffer_append(buffer, "null", 4);
+                } else {
+                    failed = buffer_append_double(buffer, field -> value.d);
+                }
+                break;
+            case LOGGER_FIELD_STRING:
+                if (!field -> value.s) {
+                    failed = buffer_append(buffer, "null", 4);
+                } else {
+                    size_t start = buffer -> len;
+                    failed = buffer_append_str(buffer, field -> value.s) ||
+                             structured_string(buffer, mode, start);
+                }
+                break;
+            case LOGGER_FIELD_BOOL:
+                failed = buffer_append_str(buffer, field -> value.b ? "true" : "false");
+                break;
+            default:
+                failed = buffer_append(buffer, "null", 4);
+                break;
+        }
+        if (failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Escape [start, len) and put it between quotes, in place:
+ * grow once, then copy backwards so nothing is overwritten before it is read */
+static int structured_quote(LogBuffer *buffer, size_t start) {
+    size_t extra = 2;
+    for (size_t i = start; i < buffer -> len; i++) {
+        extra += structured_escape_len(buffer -> data[i]) - 1;
+    }
+    if (buffer_reserve(buffer, extra)) {
+        return -1;
+    }
+    static const char hex[] = "0123456789abcdef";
+    char *data = buffer -> data;
+    size_t r = buffer -> len, w = buffer -> len + extra;
+    data[--w] = '"';
+    while (r > start) {
+        unsigned char c = data[--r];
+        char escape = 0;
+        switch (c) {
+            case '"': escape = '"'; break;
+            case '\\': escape = '\\'; break;
+            case '\n': escape = 'n'; break;
+            case '\r': escape = 'r'; break;
+            case '\t': escape = 't'; break;
+            case '\b': escape = 'b'; break;
+            case '\f': escape = 'f'; break;
+        }
+        if (escape) {
+            data[--w] = escape;
+            data[--w] = '\\';
+        } else if (c < 0x20) {
+            data[--w] = hex[c & 15];
+            data[--w] = hex[c >> 4];
+            data[--w] = '0';
+            data[--w] = '0';
+            data[--w] = 'u';
+            data[--w] = '\\';
+        } else {
+            data[--w] = c;
+        }
+    }
+    data[--w] = '"';
+    buffer -> len += extra;
+    return 0;
+}
+
+
+static size_t structured_escape_len(unsigned char c) {
+    switch (c) {
+        case '"': case '\\': case '\n': case '\r': case '\t': case '\b': case '\f':
+            return 2;
+    }
+    return c < 0x20 ? 6 : 1;
+}
+
+
+/* Can be written unquoted in logfmt */
+static int structured_bare(unsigned char c) {
+    return c > ' ' && c != '=' && c != '"' && c != '\\' && c != 0x7f;
+}
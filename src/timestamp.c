@@ -0,0 +1,47 @@
+#define _POSIX_C_SOURCE 200809L
+#include "timestamp.h"
+#include <string.h>
+
+static _Thread_local TimeCache thread_cache = { .second = -1 };
+
+
+void timestamp_now(struct timespec *ts, int precise) {
+#ifdef CLOCK_REALTIME_COARSE
+    if (!precise) {
+        clock_gettime(CLOCK_REALTIME_COARSE, ts);
+        return;
+    }
+#else
+    (void)precise;
+#endif
+    clock_gettime(CLOCK_REALTIME, ts);
+}
+
+
+const TimeCache *timestamp_cache(const struct timespec *ts) {
+    TimeCache *cache = &thread_cache;
+    if (cache -> second == ts -> tv_sec) {
+        return cache;
+    }
+
+    struct tm tm_info;
+    localtime_r(&ts -> tv_sec, &tm_info);
+    // Format: YYYY-MM-DD
+    strftime(cache -> date, sizeof(cache -> date), "%Y-%m-%d", &tm_info);
+    // Format: HH:MM:SS
+    strftime(cache -> time, sizeof(cache -> time), "%H:%M:%S", &tm_info);
+    // Format: YYYY-MM-DDTHH:MM:SS
+    strftime(cache -> iso, sizeof(cache -> iso), "%Y-%m-%dT%H:%M:%S", &tm_info);
+
+    // %z gives +hhmm, RFC3339 wants +hh:mm
+    char zone[8];
+    if (strftime(zone, sizeof(zone), "%z", &tm_info) == 5) {
+        memcpy(cache -> zone, zone, 3);
+        cache -> zone[3] = ':';
+        memcpy(cache -> zone + 4, zone + 3, 3);
+    } else {
+        strcpy(cache -> zone, "Z");
+    }
+    cache -> second = ts -> tv_sec;
+    return cache;
+}
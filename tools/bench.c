@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "logger.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Measure the cost of a log call, output goes nowhere so it is the
+ * library's time only, writing included but not the device
+ * usage: logger_bench [records per case], prints one CSV line per case */
+
+#define BENCH_DEFAULT_RECORDS 200000
+#define BENCH_MAX_THREADS     16
+#define BENCH_SOCKET          "/tmp/logger_bench.sock"
+
+typedef struct Bench {
+    LOGGER *logger;
+    long records;
+    int kind;
+} Bench;
+
+enum BENCH_KIND {
+    BENCH_DISABLED, BENCH_LITERAL, BENCH_FORMATTED, BENCH_ARRAY
+};
+
+static _Atomic unsigned long long bench_bytes;
+
+static ssize_t bench_write(void *cookie, const char *data, size_t len);
+static FILE *bench_null(void);
+static double bench_now(void);
+static void *bench_loop(void *arg);
+static void *bench_collect(void *arg);
+static void bench_case(const char *name, LOGGER *logger, int kind, int threads, long records);
+
+
+int main(int argc, char **argv) {
+    long records = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_RECORDS;
+    if (argc > 2 || records <= 0) {
+        fprintf(stderr, "usage: %s [records per case]\n", argv[0]);
+        return 2;
+    }
+    FILE *out = bench_null();
+    if (!out) {
+        perror("fopencookie");
+        return 1;
+    }
+    // a fixed line buffer so the numbers don't depend on stdio guessing
+    setvbuf(out, NULL, _IOFBF, 64 * 1024);
+    printf("case,threads,records,ns_per_record,records_per_s,bytes_per_s\n");
+
+    LOGGER *logger = logger_create("bench", out, "[LEVEL] [MSG]\n", INFO);
+    bench_case("disabled", logger, BENCH_DISABLED, 1, records);
+    bench_case("literal", logger, BENCH_LITERAL, 1, records);
+    bench_case("formatted", logger, BENCH_FORMATTED, 1, records);
+    bench_case("array", logger, BENCH_ARRAY, 1, records);
+    logger_remove(logger);
+
+    logger = logger_create("bench", out, DEFAULT_LOG_FORMAT, INFO);
+    bench_case("default_format", logger, BENCH_FORMATTED, 1, records);
+    logger_remove(logger);
+
+    // the file isn't a terminal, so color is asked for through a sink
+    for (int colored = 0; colored <= 1; colored++) {
+        logger = logger_create("bench", out, "[LEVEL] [MSG]\n", INFO);
+        logger_change_level(logger, OFF);
+        logger_add_sink(logger, logger_sink_file(out), INFO, NULL, colored);
+        bench_case(colored ? "colored" : "uncolored", logger, BENCH_FORMATTED, 1, records);
+        logger_remove(logger);
+    }
+
+    // stdio against write/writev on a descriptor, io_uring and datagrams to a local collector,
+    // record by record then in batches (bytes_per_s is 0: /dev/null doesn't count)
+    int collector = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX, .sun_path = BENCH_SOCKET };
+    pthread_t collecting;
+    unlink(BENCH_SOCKET);
+    bind(collector, (struct sockaddr *)&address, sizeof(address));
+    pthread_create(&collecting, NULL, bench_collect, &collector);
+    for (int async = 0; async <= 1; async++) {
+        FILE *file = fopen("/dev/null", "w");
+        logger = logger_create("bench", file, DEFAULT_LOG_FORMAT, INFO);
+        if (async) {
+            logger_enable_async(logger, 0, LOGGER_BLOCK, INFO);
+        }
+        bench_case(async ? "stdio_async" : "stdio", logger, BENCH_FORMATTED, 1, records);
+        logger_remove(logger);
+        fclose(file);
+
+        LOGGER_SINK *sink = logger_sink_fd(open("/dev/null", O_WRONLY), 1);
+        logger = logger_create("bench", out, DEFAULT_LOG_FORMAT, INFO);
+        logger_change_sink(logger, sink);
+        if (async) {
+            logger_enable_async(logger, 0, LOGGER_BLOCK, INFO);
+        }
+        bench_case(async ? "writev_async" : "writev", logger, BENCH_FORMATTED, 1, records);
+        logger_remove(logger);
+        logger_sink_close(sink);
+
+        sink = logger_sink_uring("/dev/null", 0, 0);
+        logger = logger_create("bench", out, DEFAULT_LOG_FORMAT, INFO);
+        logger_change_sink(logger, sink);
+        if (async) {
+            logger_enable_async(logger, 0, LOGGER_BLOCK, INFO);
+        }
+        bench_case(async ? "uring_async" : "uring", logger, BENCH_FORMATTED, 1, records);
+        logger_remove(logger);
+        logger_sink_close(sink);
+
+        sink = logger_sink_socket(LOGGER_SOCKET_UNIX_DGRAM, BENCH_SOCKET, 0, 0);
+        logger = logger_create("bench", out, DEFAULT_LOG_FORMAT, INFO);
+        logger_change_sink(logger, sink);
+        if (async) {
+            logger_enable_async(logger, 0, LOGGER_BLOCK, INFO);
+        }
+        bench_case(async ? "socket_async" : "socket", logger, BENCH_FORMATTED, 1, records);
+        logger_remove(logger);
+        logger_sink_close(sink);
+    }
+    shutdown(collector, SHUT_RDWR);
+    pthread_join(collecting, NULL);
+    close(collector);
+    unlink(BENCH_SOCKET);
+
+    logger = logger_create("bench", out, "[LEVEL] [MSG]\n", INFO);
+    logger_enable_threadsafe(logger);
+    for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+        bench_case("threads", logger, BENCH_FORMATTED, threads, records);
+    }
+    logger_remove(logger);
+    fclose(out);
+    return 0;
+}
+
+
+static ssize_t bench_write(void *cookie, const char *data, size_t len) {
+    (void)cookie;
+    (void)data;
+    bench_bytes += len;
+    return len;
+}
+
+
+/* A FILE that only counts what it gets */
+static FILE *bench_null(void) {
+    cookie_io_functions_t io = { NULL, bench_write, NULL, NULL };
+    return fopencookie(NULL, "w", io);
+}
+
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void *bench_loop(void *arg) {
+    const Bench *bench = arg;
+    LOGGER *logger = bench -> logger;
+    int values[16];
+    for (int i = 0; i < 16; i++) {
+        values[i] = i * 1237 - 5000;
+    }
+    for (long i = 0; i < bench -> records; i++) {
+        switch (bench -> kind) {
+            case BENCH_DISABLED:
+                logger_debugf(logger, "request %ld from %s", i, "client");
+                break;
+            case BENCH_LITERAL:
+                logger_info(logger, "connection accepted");
+                break;
+            case BENCH_FORMATTED:
+                logger_infof(logger, "request %ld from %s took %.3f ms, status %d",
+                             i, "10.0.0.1", i * 0.001, 200);
+                break;
+            case BENCH_ARRAY:
+                logger_array(logger, INFO, values, sizeof(int), 16, PRINT_D, "values");
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+/* Read datagrams as fast as they come, until the socket is shut down */
+static void *bench_collect(void *arg) {
+    int fd = *(int *)arg;
+    char record[4096];
+    while (recv(fd, record, sizeof(record), 0) > 0) {
+    }
+    return NULL;
+}
+
+
+/* threads threads log records records each */
+static void bench_case(const char *name, LOGGER *logger, int kind, int threads, long records) {
+    Bench bench = { logger, records, kind };
+    pthread_t workers[BENCH_MAX_THREADS];
+    logger_flush(logger);
+    bench_bytes = 0;
+
+    double start = bench_now();
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&workers[i], NULL, bench_loop, &bench);
+    }
+    bench_loop(&bench);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    logger_flush(logger);
+    double elapsed = bench_now() - start;
+
+    double total = (double)records * threads;
+    printf("%s,%d,%.0f,%.1f,%.0f,%.0f\n", name, threads, total,
+           elapsed * 1e9 / total, total / elapsed, bench_bytes / elapsed);
+    fflush(stdout);
+}
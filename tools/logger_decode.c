@@ -0,0 +1,28 @@
+#include "logger.h"
+#include <stdio.h>
+
+/* Turn a binary log written in LOGGER_BINARY mode back into text
+ * usage: logger_decode [binary log [output]], default to stdin and stdout */
+int main(int argc, char **argv) {
+    FILE *in = stdin;
+    FILE *out = stdout;
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [binary log [output]]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 1 && !(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (argc > 2 && !(out = fopen(argv[2], "w"))) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    long records = logger_decode(in, out);
+    if (records < 0) {
+        fprintf(stderr, "%s: not a valid binary log\n", argc > 1 ? argv[1] : "stdin");
+        return 1;
+    }
+    return 0;
+}